@@ -44,13 +44,85 @@
 
     --- HOW TO USE ---
 
+    Include kif.h in the file that uses it. The functions are defined in the header, so include it in one translation unit only.
+
+    Define KIF_FREESTANDING before including kif.h to leave out everything that needs libc I/O or a heap (kernels, bootloaders).
+    What remains decodes straight from the input bytes into a caller provided framebuffer: kif_decode_into(), kif_blit()
+    and the chunk queries.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SSE2 stores for kif_decode_padded(), define KIF_NO_SIMD to use plain C
+#if defined(__SSE2__) && !defined(KIF_NO_SIMD)
+#define KIF_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef KIF_FREESTANDING
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 64-bit file positions for packs, long is only 32 bits on Windows and 32-bit POSIX targets.
+// _kif_fsync() flushes a stream to disk, plain C can only flush it to the OS.
+#if defined(_WIN32)
+#include <io.h>
+#define _kif_fseek(File, Offset, Whence) _fseeki64(File, (__int64)(Offset), Whence)
+#define _kif_ftell(File) ((int64_t)_ftelli64(File))
+#define _kif_fsync(File) (fflush(File) == 0 && _commit(_fileno(File)) == 0)
+#elif defined(__APPLE__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L)
+#include <unistd.h>
+#define _kif_fseek(File, Offset, Whence) fseeko(File, (off_t)(Offset), Whence)
+#define _kif_ftell(File) ((int64_t)ftello(File))
+#define _kif_fsync(File) (fflush(File) == 0 && fsync(fileno(File)) == 0)
+#else
+#define _kif_fseek(File, Offset, Whence) fseek(File, (long)(Offset), Whence)
+#define _kif_ftell(File) ((int64_t)ftell(File))
+#define _kif_fsync(File) (fflush(File) == 0)
+#endif
+#endif
+
+// The decoded pixel cache needs mmap(), define KIF_NO_DISK_CACHE to leave it out.
+#if !defined(KIF_FREESTANDING) && !defined(KIF_NO_DISK_CACHE) && (defined(__unix__) || defined(__APPLE__))
+#define KIF_DISK_CACHE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* --- Tracing hooks --- */
+// Define these before including kif.h to time the encoder and decoder stages, Name is a string literal.
+// They expand to nothing otherwise.
+#ifndef KIF_TRACE_BEGIN
+#define KIF_TRACE_BEGIN(Name)
+#endif
+#ifndef KIF_TRACE_END
+#define KIF_TRACE_END(Name)
+#endif
+
+/* --- Header flags (KIFHeader.Compressed) --- */
+#define KIF_FLAG_ALPHA_ORDERED	0x01	// Palette is ordered [fully transparent | fully opaque | translucent], see kif_alpha_classes()
+#define KIF_FLAG_OPAQUE_RECTS	0x02	// An OPAQ chunk lists fully opaque rectangles, see kif_opaque_rects()
+#define KIF_FLAG_PROGRESSIVE	0x04	// A PROG chunk holds a 1/4 resolution preview layer, see kif_progressive_update()
+#define KIF_FLAG_PLACEHOLDER	0x08	// A PREV chunk, first in the chunk area, holds the average color and a 4x4 preview, see kif_placeholder()
+#define KIF_FLAG_VARIANTS		0x10	// A VARS chunk holds named alternative palettes for the same runs, set by kif_encode_variants()
+#define KIF_FLAG_CHUNKS			0x80	// Header is followed by a chunk area, set by the encoder when any chunk is written
+
+/*
+    The chunk area starts with a 32-bit byte count, followed by chunks of a 4 byte tag, a 32-bit payload
+    length and the payload padded to 4 bytes. The palette follows directly after the chunk area.
 */
 
 #pragma pack(push, 1) // Disable padding
 	typedef struct {
 		uint32_t Magic;					// = 'kif1'
 		uint8_t BPP;					// 3 = RGB, 4 = RGBA (24/32bit palette)
-		uint8_t Compressed;				// Will at the moment be 0, as we have no compression yet.
+		uint8_t Compressed;				// Format flags (KIF_FLAG_*), 0 for a plain icon. There is no compression yet.
 		uint16_t palEntries;			// Number of palette entries (bpp * palEntries = bytes to read after header to get the palette. Limited to 65K unique colors.)		
 		uint16_t Width;					// Width
 		uint16_t Height;				// Heigth
@@ -65,20 +137,431 @@
 	typedef struct {
 		unsigned char pID, rle;
 	} kif_rle_t;
+
+	typedef struct {
+		uint32_t Magic;					// = 'kifp'
+		uint32_t Generation;			// Incremented every time a new index generation is appended
+		uint64_t IndexOffset;			// File offset of the current index generation
+		uint32_t IndexEntries;			// Number of KIFPackEntry records in the current index generation
+		uint32_t Reserved;				// Must be 0
+		uint64_t DeadBytes;				// Bytes no longer referenced by the current index (replaced blobs and old indexes)
+	} KIFPackHeader;	// Pack header is 32 bytes
+
+	typedef struct {
+		uint16_t X, Y, Width, Height;
+	} KIFRect;
+
+	typedef struct {
+		char Name[48];					// Icon name, NUL terminated. The index is sorted by name.
+		uint64_t Offset;				// File offset of the .kif blob
+		uint32_t Length;				// Length of the .kif blob in bytes
+		uint32_t Reserved;				// Must be 0
+	} KIFPackEntry;	// Index entries are 64 bytes
+
+	typedef struct {
+		uint32_t Magic;					// = 'kift'
+		uint32_t Slots;					// Number of KIFThemeSlot records in the hash table (power of two)
+		uint32_t StringsOffset;			// File offset of the icon name strings ("<context>/<name>")
+		uint32_t StringsSize;			// Size of the string table in bytes
+	} KIFThemeHeader;	// Theme index header is 16 bytes
+
+	typedef struct {
+		uint32_t Hash;					// Hash of name, size and scale. 0 = empty slot
+		uint32_t NameOffset;			// Offset of the "<context>/<name>" string in the string table
+		uint16_t Size;					// Requested size this slot answers
+		uint8_t Scale;					// Requested scale this slot answers
+		uint8_t Pack;					// Pack in the inheritance chain the resolved blob lives in
+		uint32_t BlobLength;			// Length of the resolved .kif blob
+		uint64_t BlobOffset;			// Offset of the resolved .kif blob inside its pack
+	} KIFThemeSlot;	// Theme index slots are 24 bytes
 #pragma pack(pop) // Restore default packing
 
 /* --- API Functions --- */
+#ifndef KIF_FREESTANDING
 int kif_write(const char *Filename, const void *Data, KIFHeader *Header);
 void *kif_read(const char *Filename, KIFHeader *Header, int OutputBPP);
 void *kif_encode(const void *Data, KIFHeader *Header, int *OutputLength);
 void *kif_decode(const void *RawData, KIFHeader *Header, int OutputBPP);
 
+/* --- Incremental encoding --- */
+#define KIF_ENCODE_ERROR	-1
+#define KIF_ENCODE_MORE		0		// Budget used up, call kif_encode_step() again
+#define KIF_ENCODE_DONE		1		// All pixels encoded, call kif_encode_finish()
+
+#define KIF_ENCODE_SLICE	4096	// Pixels encoded between clock reads
+
+typedef struct {
+	const uint32_t *Pixels;			// Input pixels, must stay valid until kif_encode_finish()
+	KIFHeader Header;				// Width, Height and the requested flags
+	uint32_t Position, Total;		// Pixels encoded so far and in the whole image
+	void *Writer;					// Palette and runs built so far
+} KIFEncoder;
+
+int kif_encode_begin(KIFEncoder *Encoder, const void *Data, const KIFHeader *Header);
+int kif_encode_step(KIFEncoder *Encoder, uint32_t MaxPixels, uint32_t MaxMicroseconds);
+void *kif_encode_finish(KIFEncoder *Encoder, KIFHeader *Header, int *OutputLength);
+void kif_encode_abort(KIFEncoder *Encoder);
+
+/* --- Multi-size encoding --- */
+typedef struct {
+	int Width, Height;
+	float *Pixels;					// Premultiplied RGBA, resampled for every size
+	void *Colors;					// Colors of the master, kept first when a size is reduced to a .kif palette
+} KIFMaster;
+
+int kif_resize(const void *Data, int Width, int Height, void *Output, int OutputWidth, int OutputHeight);
+int kif_master_begin(KIFMaster *Master, const void *Data, int Width, int Height);
+void *kif_master_encode(const KIFMaster *Master, int Size, int Flags, KIFHeader *Header, int *OutputLength);
+void kif_master_end(KIFMaster *Master);
+int kif_encode_sizes(const void *Data, int Width, int Height, const int *Sizes, int Count, int Flags, void **Outputs, int *Lengths);
+
+/* --- Image diff --- */
+typedef struct {
+	int Width, Height;				// Size of both icons
+	uint32_t Pixels;				// Number of pixels that differ
+	KIFRect Bounds;					// Bounding box of the pixels that differ, all 0 when none do
+	int MaxDelta;					// Largest difference in any straight (not premultiplied) RGBA channel (0 - 255)
+} KIFDiff;
+
+int kif_diff(const void *A, const void *B, KIFDiff *Diff);
+void *kif_diff_encode(const void *A, const void *B, KIFDiff *Diff, int *OutputLength);
+#endif
+int kif_decode_into(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP);
+int kif_decode_oriented(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP, int Orientation);
+
+/* --- Padded output decoding --- */
+#define KIF_DECODE_ALIGN		64		// Alignment of Output and Stride for kif_decode_padded()
+#define KIF_DECODE_SLACK		32		// Writable bytes kif_decode_padded() needs after the last pixel of the last row
+#define KIF_DECODE_STRIDE(Width, BPP)				(((Width) * ((BPP) / 8) + KIF_DECODE_ALIGN - 1) & ~(KIF_DECODE_ALIGN - 1))
+#define KIF_DECODE_PADDED_SIZE(Width, Height, BPP)	((size_t)KIF_DECODE_STRIDE(Width, BPP) * (size_t)(Height) + KIF_DECODE_SLACK)
+
+int kif_decode_padded(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP);
+
+/* --- YUV output --- */
+#define KIF_YUV_I420		0		// Y plane, then U and V planes at half width and height
+#define KIF_YUV_NV12		1		// Y plane, then one half height plane of interleaved U and V
+
+#define KIF_YUV_BT601		0		// Limited range (16 - 235 luma) BT.601, standard definition video
+#define KIF_YUV_BT709		1		// Limited range BT.709, high definition video
+
+typedef struct {
+	uint8_t *Y, *U, *V, *A;			// U holds interleaved UV for NV12 and V is unused, A (full resolution alpha) may be NULL
+	int YStride, UStride, VStride, AStride;
+	int Format;						// KIF_YUV_I420 or KIF_YUV_NV12
+	int Matrix;						// KIF_YUV_BT601 or KIF_YUV_BT709
+} KIFYUVPlanes;
+
+int kif_decode_yuv(const void *Data, KIFHeader *Header, const KIFYUVPlanes *Planes);
+
+/* --- Color statistics --- */
+int kif_histogram(const void *Data, KIFHeader *Header, uint32_t *Counts);
+int kif_dominant_colors(const void *Data, KIFHeader *Header, kif_rgba_t *Colors, uint32_t *Weights, int MaxColors, int Distance);
+
+/* --- Resource limits --- */
+#define KIF_LIMIT_OK			0
+#define KIF_ERROR_FORMAT		-1		// Not a .kif icon, or invalid arguments
+#define KIF_ERROR_TRUNCATED		-2		// Less data than the header says
+#define KIF_ERROR_CORRUPT		-3		// Runs reference palette entries that do not exist
+#define KIF_ERROR_PIXELS		-4		// Width * Height over MaxPixels
+#define KIF_ERROR_PALETTE		-5		// palEntries over MaxPaletteEntries
+#define KIF_ERROR_ENTRIES		-6		// RLEEntries over MaxEntries
+#define KIF_ERROR_OUTPUT		-7		// Decoded size over MaxOutputBytes
+#define KIF_ERROR_WORK			-8		// Pixels + RLE entries over MaxWork
+#define KIF_ERROR_MEMORY		-9		// Allocation failed
+
+typedef struct {
+	uint32_t MaxPixels;				// Width * Height
+	uint32_t MaxPaletteEntries;
+	uint32_t MaxEntries;			// RLE entries
+	uint64_t MaxOutputBytes;		// Size of the decoded image at the requested bits per pixel
+	uint64_t MaxWork;				// Pixels written + RLE entries read, proportional to decode time
+} KIFLimits;	// 0 means no limit
+
+// Limits for icons up to 1024x1024 pixels
+#define KIF_ICON_LIMITS			{ 1024 * 1024, 256, 1024 * 1024, 4 * 1024 * 1024, 2 * 1024 * 1024 }
+
+// Limits kif_decode() and kif_decode_variant() apply before allocating, define before including kif.h to change them
+#ifndef KIF_DEFAULT_LIMITS
+#define KIF_DEFAULT_LIMITS		{ 8192 * 8192, 0, 0, 256 * 1024 * 1024, 0 }
+#endif
+
+int kif_check_header(const void *Data, int OutputBPP, const KIFLimits *Limits, KIFHeader *Header);
+const char *kif_error_string(int Error);
+#ifndef KIF_FREESTANDING
+void *kif_decode_limited(const void *Data, size_t Size, KIFHeader *Header, int OutputBPP, const KIFLimits *Limits, int *Error);
+#endif
+
+/* --- Orientation flags for kif_decode_oriented() --- */
+#define KIF_ROTATE_90			0x01	// Rotate clockwise by 90 degrees, the output is Height pixels wide
+#define KIF_ROTATE_180			0x02	// Rotate by 180 degrees
+#define KIF_ROTATE_270			0x03	// Rotate clockwise by 270 degrees, the output is Height pixels wide
+#define KIF_FLIP_VERTICAL		0x04	// Store rows bottom-up (after rotating), e.g. for OpenGL uploads
+
+#define KIF_TILE				16		// Tile size used to keep rotated writes within a few cache lines
+
+/* --- Progressive decoding --- */
+#define KIF_PROGRESS_ERROR		-1		// Invalid data
+#define KIF_PROGRESS_NONE		0		// Not even the header is available yet
+#define KIF_PROGRESS_HEADER		1		// Header is known, nothing painted yet
+#define KIF_PROGRESS_PREVIEW	2		// The coarse preview layer has been painted
+#define KIF_PROGRESS_PARTIAL	3		// Some rows have been refined to full resolution
+#define KIF_PROGRESS_DONE		4		// The whole icon has been decoded
+
+typedef struct {
+	KIFHeader Header;				// Valid from KIF_PROGRESS_HEADER on
+	int Stage;						// Last KIF_PROGRESS_* stage reached
+	uint32_t Entry;					// Next RLE entry to decode
+	int X, Y;						// Position of the next full resolution pixel
+} KIFProgressive;
+
+void kif_progressive_init(KIFProgressive *State);
+int kif_progressive_update(KIFProgressive *State, const void *Data, uint32_t Available, void *Output, int Stride, int OutputBPP);
+
+/* --- Chunks and palette classes --- */
+#define KIF_MAX_OPAQUE_RECTS	32		// Max number of rectangles the encoder stores in an OPAQ chunk
+#define KIF_MIN_OPAQUE_SPAN		4		// Opaque spans narrower than this are not worth culling
+
+const void *kif_find_chunk(const void *Data, const char *Tag, int *Length);
+int kif_alpha_classes(const void *Data, int *OpaqueStart, int *TranslucentStart);
+int kif_opaque_rects(const void *Data, const KIFRect **Rects);
+int kif_placeholder(const void *Data, kif_rgba_t *Average, kif_rgba_t *Preview);
+
+/* --- Palette variants --- */
+#define KIF_VARIANT_NAME		16		// Bytes per variant name in a VARS chunk, NUL terminated
+
+int kif_decode_variant_into(const void *Data, KIFHeader *Header, int Variant, void *Output, int Stride, int OutputBPP);
+int kif_variant_count(const void *Data);
+const kif_rgba_t *kif_variant_palette(const void *Data, int Variant, const char **Name);
+int kif_variant_find(const void *Data, const char *Name);
+#ifndef KIF_FREESTANDING
+void *kif_decode_variant(const void *Data, KIFHeader *Header, int Variant, int OutputBPP);
+void *kif_encode_variants(const void *const *Data, const char *const *Names, int Count, KIFHeader *Header, int *OutputLength);
+#endif
+
+/* --- Span iteration --- */
+#define KIF_SPAN_SKIP_TRANSPARENT	0x01	// Do not return spans whose palette alpha is 0
+
+typedef struct {
+	int Y, X, Length;				// Row, first column and number of pixels, never crosses a row
+	int pID;						// Palette index
+	kif_rgba_t Color;				// Palette color
+} KIFSpan;
+
+typedef struct {
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;			// Next RLE entry to load
+	uint32_t Entries;				// RLE entries left after Runs
+	int pID, Remaining;				// Current run and the pixels left in it
+	int Width, Height;
+	int X, Y;						// Position of the next pixel
+	int Flags;
+} KIFSpanIter;
+
+int kif_span_begin(KIFSpanIter *Iter, const void *Data, int Flags);
+int kif_span_next(KIFSpanIter *Iter, KIFSpan *Span);
+int kif_for_each_span(const void *Data, int Flags, int (*Callback)(const KIFSpan *Span, void *User), void *User);
+
+/* --- Run domain operations --- */
+int kif_blit(const void *Data, void *Destination, int Stride, int DestWidth, int DestHeight, int X, int Y);
+int kif_collide(const void *A, int AX, int AY, const void *B, int BX, int BY);
+#ifndef KIF_FREESTANDING
+void *kif_composite(const void *Base, const void *Overlay, int X, int Y, int *OutputLength);
+
+/* --- Icon packs --- */
+typedef struct {
+	const unsigned char *Data;		// Start of the pack (usually an mmap of the whole file)
+	uint64_t Size;					// Number of bytes available at Data
+	KIFPackHeader Header;			// Snapshot of the pack header taken by kif_pack_open()
+	const KIFPackEntry *Index;		// Index generation that was current when the pack was opened
+} KIFPack;
+
+int kif_pack_open(KIFPack *Pack, const void *Data, uint64_t Size);
+const void *kif_pack_find(const KIFPack *Pack, const char *Name, int *Length);
+int kif_pack_update(const char *Filename, int Count, const char **Names, const void **Data, const int *Lengths);
+int kif_pack_put(const char *Filename, const char *Name, const void *Data, int Length);
+int kif_pack_compact(const char *Filename, int DeadPercent);
+
+/* --- PNG export --- */
+void *kif_encode_png(const void *Data, int *OutputLength);
+int kif_write_png(const char *Filename, const void *Data);
+
+/* --- QOI transcoding --- */
+void *kif_to_qoi(const void *Data, int *OutputLength);
+void *qoi_to_kif(const void *Data, int Size, int *OutputLength);
+
+/* --- Theme lookup index --- */
+void *kif_theme_build(const KIFPack *Packs, int PackCount, const int *Sizes, const int *Scales, int SizeCount, int *OutputLength);
+const KIFThemeSlot *kif_theme_lookup(const void *Index, uint64_t IndexSize, const char *Context, const char *Name, int Size, int Scale);
+#endif
+
+#ifdef KIF_DISK_CACHE
+/* --- Decoded pixel cache --- */
+typedef struct {
+	uint32_t Magic;					// = 'kifc'
+	uint32_t BPP;					// Output bits per pixel of the pixels that follow
+	uint64_t Hash;					// Hash of the .kif file the pixels were decoded from
+	KIFHeader Header;				// Header of that .kif file
+} KIFCacheBlob;	// Blob header is 32 bytes, followed by Width * Height * BPP / 8 bytes of pixels
+
+typedef struct {
+	char *Path;						// Source .kif file
+	long long MTime, Size;			// Source mtime in nanoseconds and size when it was cached
+	uint64_t Hash;					// Source content hash, names the blob
+	int BPP;
+} _kif_cache_entry;	// Kept sorted by Path, then BPP
+
+typedef struct {
+	char Dir[2048];
+	_kif_cache_entry *Entries;
+	int Count, Size;
+	int Dirty;						// Index needs to be written by kif_cache_close()
+} KIFCache;
+
+typedef struct {
+	void *Pixels;					// Decoded pixels
+	KIFHeader Header;
+	void *Mapping;					// Mapped blob, or NULL if Pixels was decoded into a malloc()ed buffer
+	size_t MappingSize;
+} KIFCachedImage;
+
+int kif_cache_open(KIFCache *Cache, const char *CacheDir);
+int kif_cache_read(KIFCache *Cache, const char *Filename, int OutputBPP, KIFCachedImage *Image);
+void kif_cache_release(KIFCachedImage *Image);
+int kif_cache_close(KIFCache *Cache);
+#endif
+
 /* --- Internal Functions --- */
 static unsigned short _read16bit(const unsigned char *buffer);
 static unsigned int _read32bit(const unsigned char *buffer);
+static unsigned int _kif_palette_offset(const unsigned char *data_bytes);
+
+static int _kif_read_header(const void *Data, KIFHeader *Header);
+static int _kif_parse(const void *Data, KIFHeader *Header, const kif_rgba_t **Palette, const kif_rle_t **Runs);
+static kif_rgba_t _kif_blend(kif_rgba_t Dst, kif_rgba_t Src);
+static void _kif_fill(unsigned char *Pixel, kif_rgba_t Color, int Count, int BytesPerPixel);
+static void _kif_fill_blocks(unsigned char *Pixel, kif_rgba_t Color, int Count, int BytesPerPixel);
+static void _kif_decode_runs(const KIFHeader *Header, const kif_rgba_t *Palette, const kif_rle_t *Runs, unsigned char *Output, int Stride, int BytesPerPixel);
+static void _kif_clear_rest(unsigned char *Row, int x, int y, int Width, int Height, int Stride, int BytesPerPixel);
+static int _kif_variants(const void *Data, const unsigned char **Chunk);
+static int _kif_decode_padded(const void *Data, KIFHeader *Header, unsigned char *Output, int Stride, int OutputBPP);
+
+typedef struct {
+	const kif_rle_t *Runs;			// Next RLE entry to load
+	uint32_t Entries;				// RLE entries left after Runs
+	int pID, Length;				// Current run and the pixels left in it
+} _kif_run_cursor;
+
+static int _kif_cursor_peek(_kif_run_cursor *Cursor, int Max);
+static void _kif_cursor_skip(_kif_run_cursor *Cursor, int Count);
+
+typedef struct {
+	uint8_t Y, U, V, A;
+} _kif_yuv_t;
+
+static _kif_yuv_t _kif_yuv_average(const _kif_yuv_t *Lut, int A, int B, int C, int D);
+static void _kif_yuv_put_chroma(const KIFYUVPlanes *Planes, int Row, int Column, int Count, _kif_yuv_t Chroma);
+
+#ifndef KIF_FREESTANDING
+
+typedef struct {
+	unsigned char *Data;
+	int Length, Size;
+} _kif_chunk_buffer;
+
+static void *_kif_decode(const void *Data, KIFHeader *Header, int OutputBPP);
+static int _order_palette(kif_rgba_t *Palette, int NumberOfColors, int *OpaqueStart, int *TranslucentStart, uint8_t *Remap);
+static uint64_t _kif_microseconds(void);
+static int _opaque_rects(const kif_rgba_t *Palette, const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, KIFRect *Rects);
+static int _compare_rect_area(const void *A, const void *B);
+static int _progressive_layer(const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, _kif_chunk_buffer *Chunks);
+static int _placeholder(const kif_rgba_t *Palette, const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, _kif_chunk_buffer *Chunks);
+
+typedef struct {
+	kif_rgba_t Palette[256];
+	int16_t Slots[1024];			// Color hash table, palette index or -1
+	int Colors;
+	kif_rle_t *Runs;
+	int Count, Size;
+	int Failed;
+} _kif_run_writer;
+
+static void _kif_writer_init(_kif_run_writer *Writer);
+static uint32_t _kif_writer_slot(const _kif_run_writer *Writer, kif_rgba_t Color);
+static void _kif_writer_put(_kif_run_writer *Writer, kif_rgba_t Color, int Length);
+static void *_kif_writer_finish(_kif_run_writer *Writer, KIFHeader *Header, int *OutputLength);
+static int _kif_chunk_add(_kif_chunk_buffer *Chunks, const char *Tag, const void *Payload, int Length);
+static void *_kif_assemble(KIFHeader *Header, const _kif_chunk_buffer *Chunks, const kif_rgba_t *Palette, int NumberOfColors, const kif_rle_t *Runs, int NumberOfRuns, int *OutputLength);
+
+static void _kif_premultiply(const uint32_t *Pixels, size_t Count, float *Output);
+static void _kif_scale_add(float *Acc, const float *Source, float Weight, int Count);
+static int _kif_resample(const float *Source, int Width, int Height, uint32_t *Output, int OutputWidth, int OutputHeight);
+
+typedef struct {
+	kif_rgba_t Color;
+	uint32_t Count;
+	kif_rgba_t Mapped;				// Palette color that replaces Color, set by _kif_quantize()
+} _kif_color_count;
+
+static int _kif_quantize(uint32_t *Pixels, size_t Count, const _kif_run_writer *Shared);
+static int _kif_diff(const void *A, const void *B, KIFDiff *Diff, _kif_run_writer *Writer);
+static int _compare_color_count(const void *A, const void *B);
+
+static int _pack_read_index(FILE *Pack, KIFPackHeader *Header, KIFPackEntry **Index);
+static int _pack_find_entry(const KIFPackEntry *Index, int Entries, const char *Name, int *Found);
 
-static void _generate_palette(const void *Data, KIFHeader *Header, kif_rgba_t *Palette, int *NumberOfColors);
-static int _in_palette(kif_rgba_t Color, kif_rgba_t *Palette, int *NumberOfColors);
+typedef struct {
+	char Key[48];					// "<context>/<name>"
+	int Size, Scale, Pack;
+	const KIFPackEntry *Entry;
+} _kif_theme_candidate;
+
+static int _theme_parse_name(const char *Name, char *Key, int *Size, int *Scale);
+static int _theme_compare_candidates(const void *A, const void *B);
+static int _theme_better_size(const _kif_theme_candidate *A, const _kif_theme_candidate *B, int Size, int Scale);
+static uint32_t _theme_hash(const char *Key, int Length, int Size, int Scale);
+
+typedef struct {
+	unsigned char *Data;
+	size_t Length, Size;
+	uint32_t Bits;					// Deflate bits not written yet, least significant first
+	int Count;						// Number of bits in Bits
+	uint32_t A, B;					// Adler-32 of the uncompressed scanlines
+	uint32_t Crc[256];				// CRC-32 table
+	int Failed;
+} _kif_png_writer;
+
+static void _png_writer_init(_kif_png_writer *Writer);
+static int _png_reserve(_kif_png_writer *Writer, size_t Length);
+static void _png_bytes(_kif_png_writer *Writer, const void *Bytes, size_t Length);
+static void _png_u32(_kif_png_writer *Writer, uint32_t Value);
+static size_t _png_chunk_begin(_kif_png_writer *Writer, const char *Tag);
+static void _png_chunk_end(_kif_png_writer *Writer, size_t Start);
+static void _png_bits(_kif_png_writer *Writer, uint32_t Value, int Count);
+static void _png_code(_kif_png_writer *Writer, uint32_t Code, int Length);
+static void _png_symbol(_kif_png_writer *Writer, int Symbol);
+static void _png_match(_kif_png_writer *Writer, int Length, int Distance);
+static void _png_copy(_kif_png_writer *Writer, int Value, int Length, int Distance);
+static void _png_adler_run(_kif_png_writer *Writer, int Byte, int Count);
+static void _png_adler_bytes(_kif_png_writer *Writer, const unsigned char *Bytes, int Length);
+static void _png_row(_kif_png_writer *Writer, const unsigned char *Row, const unsigned char *Previous, int Width, int *Last);
+
+static int _qoi_hash(kif_rgba_t Color);
+static uint32_t _qoi_read32(const unsigned char *Bytes);
+static unsigned char *_qoi_write32(unsigned char *Out, uint32_t Value);
+static unsigned char *_qoi_write_run(unsigned char *Out, uint32_t Run);
+static unsigned char *_qoi_write_pixel(unsigned char *Out, kif_rgba_t *Index, kif_rgba_t Previous, kif_rgba_t Color);
+#endif
+
+#ifdef KIF_DISK_CACHE
+static _kif_cache_entry *_cache_find(KIFCache *Cache, const char *Path, int BPP, int Add);
+static long long _cache_mtime(const struct stat *Info);
+static int _cache_map(KIFCache *Cache, uint64_t Hash, int BPP, KIFCachedImage *Image);
+static void _cache_store(KIFCache *Cache, uint64_t Hash, int BPP, const KIFCachedImage *Image);
+static void *_cache_read_file(const char *Filename, int *Size);
+static uint64_t _kif_hash64(const void *Data, int Size);
+#endif
+
+#ifndef KIF_FREESTANDING
 
 /**
  * 
@@ -99,8 +582,10 @@ int kif_write(const char *Filename, const void *Data, KIFHeader *Header){
 		return 0;
 	}
 
+	KIF_TRACE_BEGIN("kif_write_file");
 	fwrite(Encoded, 1, Size, OpenedFile);
 	fclose(OpenedFile);
+	KIF_TRACE_END("kif_write_file");
 
 	free(Encoded);
 	return Size;
@@ -134,8 +619,10 @@ void *kif_read(const char *Filename, KIFHeader *Header, int OutputBPP){
 		return 0;
 	}
 
+	KIF_TRACE_BEGIN("kif_read_file");
 	BytesRead = fread(Data, 1, Size, OpenedFile);
 	fclose(OpenedFile);
+	KIF_TRACE_END("kif_read_file");
 
 	Decoded = kif_decode(Data, Header, OutputBPP);
 	free(Data);
@@ -143,225 +630,4573 @@ void *kif_read(const char *Filename, KIFHeader *Header, int OutputBPP){
 	return Decoded;
 }
 
+#endif
+
 /**
- * Decode a .kif icon
+ * Decode a .kif icon into a caller provided buffer. Nothing is allocated, the palette is read straight from the input.
  * @param Data Pointer to input data
  * @param Header Pointer to a KIFHeader struct
- * @param OutputBPP Set output bits per pixel
- * @return void Returns a pointer to a buffer containing raw icon data (RGB or RGBA)
+ * @param Output Pointer to the first pixel of the first row
+ * @param Stride Bytes from one row to the next
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @return int Returns 1 on success, 0 on invalid input
 */
-void *kif_decode(const void *Data, KIFHeader *Header, int OutputBPP){
-	if(Data == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32)){
-		return NULL;
+int kif_decode_into(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+
+	if(Output == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return 0;
 	}
 
-	const unsigned char* data_bytes = (const unsigned char*)Data; // Cast data to unsigned char pointer
+	_kif_decode_runs(Header, Palette, Runs, (unsigned char *)Output, Stride, OutputBPP / 8);
+	return 1;
+}
 
-	// Fill the header struct
-	Header->Magic = _read32bit(data_bytes);
-	Header->BPP = data_bytes[4];
-	Header->Compressed = data_bytes[5];
-	Header->palEntries = _read16bit(data_bytes + 6);
-	Header->Width = _read16bit(data_bytes + 8);
-	Header->Height = _read16bit(data_bytes + 10);
-	Header->RLEEntries = _read32bit(data_bytes + 12);
+/* --- Palette variants --- */
+
+/**
+ * Decode one palette variant of a .kif icon into a caller provided buffer, see kif_decode_into()
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Variant 0 for the main palette, up to kif_variant_count() - 1 for the others
+ * @param Output Pointer to the first pixel of the first row
+ * @param Stride Bytes from one row to the next
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @return int Returns 1 on success, 0 on invalid input or an unknown variant
+*/
+int kif_decode_variant_into(const void *Data, KIFHeader *Header, int Variant, void *Output, int Stride, int OutputBPP){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
 
-    // Allocate memory for palette data
-    kif_rgba_t* Palette = (kif_rgba_t*)malloc(Header->palEntries * sizeof(kif_rgba_t));
+	if(Output == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return 0;
+	}
 
-    // Read palette data from data buffer
-	for(int i = 0; i < Header->palEntries; i++){
-		Palette[i].rgba.r = data_bytes[sizeof(KIFHeader) + (i * 4)];     // Read R component
-		Palette[i].rgba.g = data_bytes[sizeof(KIFHeader) + (i * 4) + 1]; // Read G component
-		Palette[i].rgba.b = data_bytes[sizeof(KIFHeader) + (i * 4) + 2]; // Read B component
-		Palette[i].rgba.a = data_bytes[sizeof(KIFHeader) + (i * 4) + 3]; // Read A component
-    }
+	Palette = kif_variant_palette(Data, Variant, NULL);
 
-	// Allocate memory for pixel buffer / decoded image
-	unsigned char* Decoded;
+	if(Palette == NULL){
+		return 0;
+	}
+
+	_kif_decode_runs(Header, Palette, Runs, (unsigned char *)Output, Stride, OutputBPP / 8);
+	return 1;
+}
 
-	Decoded = (unsigned char*)malloc(Header->Width * Header->Height * 4);    // 4 Bytes per pixel
+/**
+ * Get the number of palette variants of an icon, plain icons have just their main palette
+ * @param Data Pointer to .kif data
+ * @return int Returns the number of variants including the main palette, 0 on invalid data
+*/
+int kif_variant_count(const void *Data){
+	const unsigned char *Chunk;
 
-	int DecodedIndex = 0; // Index for writing to pixel buffer
+	return _kif_variants(Data, &Chunk);
+}
 
-    for(int i = 0; i < Header->RLEEntries; i++){
-        unsigned char index = data_bytes[sizeof(KIFHeader) + Header->palEntries * 4 + i * 2];			// Read index from image data
-        unsigned char RunLength = data_bytes[sizeof(KIFHeader) + Header->palEntries * 4 + i * 2 + 1];	// Read run length from image data
+/**
+ * Get the palette of a variant. Switching variants only switches palettes, the runs are shared, so a
+ * KIFSpanIter or a cached decode can move to another variant by swapping the palette pointer.
+ * @param Data Pointer to .kif data
+ * @param Variant 0 for the main palette, up to kif_variant_count() - 1 for the others
+ * @param Name Pointer to store the variant name, "" for the main palette of a plain icon (may be NULL)
+ * @return const kif_rgba_t Returns a pointer to palEntries colors inside the data, or NULL for an unknown variant
+*/
+const kif_rgba_t *kif_variant_palette(const void *Data, int Variant, const char **Name){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+	const unsigned char *Chunk;
+	int Count = _kif_variants(Data, &Chunk);
 
-        for(int j = 0; j < RunLength; j++){
-            // Copy RGBA values from palette to pixel buffer
-            Decoded[DecodedIndex++] = Palette[index].rgba.r; // R component
-            Decoded[DecodedIndex++] = Palette[index].rgba.g; // G component
-            Decoded[DecodedIndex++] = Palette[index].rgba.b; // B component
+	if(Variant < 0 || Variant >= Count){
+		return NULL;
+	}
 
-            if(OutputBPP == 32){
-                Decoded[DecodedIndex++] = Palette[index].rgba.a; // A component
-            }
-        }
-    }
+	// Names only come from a chunk that holds all of them, a malformed one leaves just the main palette.
+	if(Name){
+		*Name = Chunk ? (const char *)(Chunk + 4 + Variant * KIF_VARIANT_NAME) : "";
+	}
 
-    // We no longer need the Palette.
-    free(Palette);
+	if(Variant == 0){
+		return (const kif_rgba_t *)(data_bytes + _kif_palette_offset(data_bytes));
+	}
 
-    // Needs to be free()d after use.
-    return Decoded;
+	return (const kif_rgba_t *)(Chunk + 4 + Count * KIF_VARIANT_NAME + (Variant - 1) * _read16bit(data_bytes + 6) * sizeof(kif_rgba_t));
 }
 
 /**
- * Encode raw image data into a .kif icon
- * @param data Pointer to input data (raw image data)
- * @param Header Pointer to a KIFHeader struct
- * @param OutputLength Pointer to an integer to store the output data length
- * @return void Returns a pointer to a buffer containing the encoded .kif icon data
- */
-void *kif_encode(const void *Data, KIFHeader *Header, int *OutputLength){
-    // Check for valid inputs
-    if(Data == NULL || Header == NULL || OutputLength == NULL){
-        return NULL;
-    }
+ * Find a palette variant by name
+ * @param Data Pointer to .kif data
+ * @param Name Variant name
+ * @return int Returns the variant index, -1 if the icon has no variant of that name
+*/
+int kif_variant_find(const void *Data, const char *Name){
+	int Count = kif_variant_count(Data);
 
-    int NumberOfColors = 0; // Number of colors in the palette
+	for(int v = 0; v < Count && Name; v++){
+		const char *VariantName;
+		int i = 0;
 
-	// Create palette
-	// TODO: The kif_rle_t stuct which holds the palette ID of the encoded data only supports 256 colors!!
-	kif_rgba_t Palette[65536];	// Max number of palette entries is 65536 (16-bit int)
+		kif_variant_palette(Data, v, &VariantName);
 
-    // Generate palette of unique RGBA colors
-    _generate_palette(Data, Header, Palette, &NumberOfColors);
+		while(i < KIF_VARIANT_NAME - 1 && VariantName[i] && VariantName[i] == Name[i]){
+			i++;
+		}
 
-    // Copy number of palette entries to header
-    Header->palEntries = NumberOfColors;
+		if((i == KIF_VARIANT_NAME - 1 || VariantName[i] == Name[i]) && Name[i] == 0){
+			return v;
+		}
+	}
 
-    // Allocate memory for encoded data
-	kif_rle_t *Encoded = (kif_rle_t *)malloc(Header->Width * Header->Height * sizeof(kif_rle_t));
+	return -1;
+}
 
-	// Return if malloc failed
-    if(Encoded == NULL){
-        return NULL;
-    }
+/**
+ * Decode a .kif icon into a caller provided buffer that has room to spare. Every run is written as whole
+ * fixed-size blocks (8 pixels, or 10 at 24 bpp with SSE2) and the position advances by the true run length,
+ * so the short runs most icons are made of cost a single branch-free block store. The bytes a block writes
+ * past its run are overwritten by the next run or row, or land in the KIF_DECODE_SLACK bytes after the last row.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Output Pointer to the first pixel of the first row, aligned to KIF_DECODE_ALIGN bytes
+ * @param Stride Bytes from one row to the next, a multiple of KIF_DECODE_ALIGN (see KIF_DECODE_STRIDE)
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @return int Returns 1 on success, 0 on invalid input or a misaligned buffer
+*/
+int kif_decode_padded(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP){
+	if(((uintptr_t)Output % KIF_DECODE_ALIGN) != 0 || Stride <= 0 || (Stride % KIF_DECODE_ALIGN) != 0){
+		return 0;
+	}
+
+	return _kif_decode_padded(Data, Header, (unsigned char *)Output, Stride, OutputBPP);
+}
+
+/* --- YUV output --- */
 
-    int EncodedIndex = 0; // Index for encoded data buffer
+/**
+ * Decode a .kif icon into YUV 4:2:0 planes for video overlays. The palette is converted to Y, U, V and alpha
+ * once, runs then fill the luma and alpha planes directly. Each chroma sample is the alpha weighted average of
+ * its 2x2 block, where a whole block lies inside one run per row it is computed once for the entire run.
+ * Pixels missing from truncated data come out transparent black (Y 16, U and V 128, alpha 0), like
+ * kif_decode_into(). Nothing is allocated.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Planes Pointer to a KIFYUVPlanes struct describing the output planes
+ * @return int Returns 1 on success, 0 on invalid input
+*/
+int kif_decode_yuv(const void *Data, KIFHeader *Header, const KIFYUVPlanes *Planes){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	_kif_yuv_t Lut[257];	// Entry 256 is transparent black, for pixels the runs do not cover
 
-    // Run-length encode pixels
-    int num_rle_entries = 0; // Number of run length encoded pixels
+	if(Planes == NULL || Planes->Y == NULL || Planes->U == NULL || (Planes->Format == KIF_YUV_I420 && Planes->V == NULL) ||
+		(Planes->Format != KIF_YUV_I420 && Planes->Format != KIF_YUV_NV12) || Header == NULL || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return 0;
+	}
 
-	int DataLen = Header->Width * Header->Height;
-	
-	uint32_t *px_data = (uint32_t *)Data;
+	// Limited range, coefficients scaled by 256
+	static const int Coefficients[2][9] = {
+		{ 66, 129, 25, -38, -74, 112, 112, -94, -18 },		// BT.601
+		{ 47, 157, 16, -26, -87, 112, 112, -102, -10 }		// BT.709
+	};
+	const int *K = Coefficients[Planes->Matrix == KIF_YUV_BT709];
 
-	for(int i = 0; i < DataLen; i++){
+	for(int i = 0; i < 257; i++){
 		kif_rgba_t Color;
-		kif_rle_t px_rle;
+		Color.v = i < 256 && i < Header->palEntries ? Palette[i].v : 0;
 
-		Color.v = px_data[i];
-		px_rle.pID = _in_palette(Color, Palette, &NumberOfColors);
-		int rl = 0; // Move run length counter inside the loop
+		int R = Color.rgba.r, G = Color.rgba.g, B = Color.rgba.b;
 
-		// TODO: Looks like this RLE encoding caps the palette at 255 colors, all colors are in the palette, but only indexes 0-255 used.
-		for(int Count = 0; Count < 255; Count++){
-			if(Color.v == px_data[i]){
-				rl++;
-				i++;
-			}else{
-				break;
-			}
+		// The offsets keep the sums positive before the shift
+		Lut[i].Y = (uint8_t)(((K[0] * R + K[1] * G + K[2] * B + 128) >> 8) + 16);
+		Lut[i].U = (uint8_t)((K[3] * R + K[4] * G + K[5] * B + 128 + (128 << 8)) >> 8);
+		Lut[i].V = (uint8_t)((K[6] * R + K[7] * G + K[8] * B + 128 + (128 << 8)) >> 8);
+		Lut[i].A = Color.rgba.a;
+	}
+
+	int Width = Header->Width, Height = Header->Height;
+	_kif_run_cursor Top = { Runs, Header->RLEEntries, 0, 0 };
+
+	for(int y = 0; y < Height; y += 2){
+		uint8_t *Y0 = Planes->Y + (size_t)y * Planes->YStride;
+		uint8_t *A0 = Planes->A ? Planes->A + (size_t)y * Planes->AStride : NULL;
+		int HasBottom = y + 1 < Height;
+
+		// The bottom row of an odd height icon repeats the top row for its chroma
+		_kif_run_cursor Bottom = Top;
+
+		if(HasBottom){
+			_kif_cursor_skip(&Bottom, Width);
 		}
-		
-		i--;
 
-		px_rle.rle = rl;
-		Encoded[num_rle_entries] = px_rle;
-		num_rle_entries++;
+		int x = 0, LeftTop = 0, LeftBottom = 0;
 
-		rl = 0; // Reset run length counter to 0
+		while(x < Width){
+			int TopLength = _kif_cursor_peek(&Top, Width - x);
+			int Length = TopLength ? TopLength : Width - x;
+			int BottomLength = _kif_cursor_peek(&Bottom, Length);
 
-		// Update encoded data index
-		EncodedIndex++;
-	}
-	
-	Header->Magic =  0x6B696631;	// 'kif1'
-	Header->BPP = 4;
-	Header->Compressed = 0;
+			// Out of runs, the rest of the planes is filled with transparent black
+			Length = BottomLength ? BottomLength : Length;
+
+			int pTop = TopLength ? Top.pID : 256, pBottom = BottomLength ? Bottom.pID : 256;
+
+			for(int i = 0; i < Length; i++){
+				Y0[x + i] = Lut[pTop].Y;
+			}
 
-    // Write number of run length encoded pixels to header
-    Header->RLEEntries = num_rle_entries;
+			if(A0){
+				for(int i = 0; i < Length; i++){
+					A0[x + i] = Lut[pTop].A;
+				}
+			}
 
-    // Calculate total size of the output buffer
-    int TotalSize = sizeof(KIFHeader) + (sizeof(kif_rgba_t) * NumberOfColors) + (EncodedIndex * sizeof(kif_rle_t));
+			if(HasBottom){
+				for(int i = 0; i < Length; i++){
+					Y0[Planes->YStride + x + i] = Lut[pBottom].Y;
+				}
 
-    // Allocate memory for the final output buffer
-    unsigned char *OutputBuffer = (unsigned char *)malloc(TotalSize);
+				if(A0){
+					for(int i = 0; i < Length; i++){
+						A0[Planes->AStride + x + i] = Lut[pBottom].A;
+					}
+				}
+			}
 
-    // Copy header to output buffer
-    memcpy(OutputBuffer, Header, sizeof(KIFHeader));
+			int Start = x, End = x + Length;
 
-    // Copy palette to output buffer
-    memcpy(OutputBuffer + sizeof(KIFHeader), Palette, (sizeof(kif_rgba_t) * NumberOfColors));	
+			// Finish the block the previous run left half done
+			if(Start & 1){
+				_kif_yuv_put_chroma(Planes, y / 2, Start / 2, 1, _kif_yuv_average(Lut, LeftTop, pTop, LeftBottom, pBottom));
+				Start++;
+			}
 
-    // Copy encoded data to output buffer
-    memcpy(OutputBuffer +  sizeof(KIFHeader) + (sizeof(kif_rgba_t) * NumberOfColors), Encoded, (EncodedIndex * sizeof(kif_rle_t)));
+			// Whole blocks inside the run, plus the last column of an odd width icon
+			int Blocks = (End - Start) / 2 + (End == Width && ((End - Start) & 1));
 
-    // Update output length
-	*OutputLength = TotalSize;
+			if(Blocks > 0){
+				_kif_yuv_put_chroma(Planes, y / 2, Start / 2, Blocks, _kif_yuv_average(Lut, pTop, pTop, pBottom, pBottom));
+			}
 
-	// Free allocated memory
-	free(Encoded);
+			LeftTop = pTop;
+			LeftBottom = pBottom;
 
-    // Return pointer to the output buffer
-    return OutputBuffer;
+			_kif_cursor_skip(&Top, Length);
+			_kif_cursor_skip(&Bottom, Length);
+			x = End;
+		}
+
+		Top = Bottom;
+	}
+
+	return 1;
 }
 
-/* --- Internal functions --- */
+/* --- Color statistics --- */
 
 /**
- * Find and return the index of a color in the palette.
- */
-static int _in_palette(kif_rgba_t Color, kif_rgba_t *Palette, int *NumberOfColors){
-	for(int Index = 0; Index < *NumberOfColors; Index++){
-		if(Palette[Index].v == Color.v){
-			return Index;
+ * Count the pixels of every palette entry by summing run lengths, without decoding. Runs are added to four
+ * interleaved count tables so that consecutive runs of the same entry do not wait on each other's stores.
+ * Pixels past the last row are not counted.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Counts Pointer to 256 integers to store the pixel count of every palette entry (runs can only address 256)
+ * @return int Returns the number of palette entries counted, 0 on invalid input
+*/
+int kif_histogram(const void *Data, KIFHeader *Header, uint32_t *Counts){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	uint32_t Tables[4][256] = {{ 0 }};
+
+	if(Counts == NULL || Header == NULL || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return 0;
+	}
+
+	uint32_t Entries = Header->RLEEntries, i = 0;
+	uint64_t Total = 0;
+
+	for(; i + 4 <= Entries; i += 4){
+		Tables[0][Runs[i].pID] += Runs[i].rle;
+		Tables[1][Runs[i + 1].pID] += Runs[i + 1].rle;
+		Tables[2][Runs[i + 2].pID] += Runs[i + 2].rle;
+		Tables[3][Runs[i + 3].pID] += Runs[i + 3].rle;
+	}
+
+	for(; i < Entries; i++){
+		Tables[0][Runs[i].pID] += Runs[i].rle;
+	}
+
+	for(int p = 0; p < 256; p++){
+		Counts[p] = Tables[0][p] + Tables[1][p] + Tables[2][p] + Tables[3][p];
+		Total += Counts[p];
+	}
+
+	// Take back the pixels that run past the last row, from the end
+	uint64_t Excess = Total > (uint64_t)Header->Width * Header->Height ? Total - (uint64_t)Header->Width * Header->Height : 0;
+
+	for(i = Entries; i > 0 && Excess > 0; i--){
+		uint32_t Length = Runs[i - 1].rle < Excess ? Runs[i - 1].rle : (uint32_t)Excess;
+
+		Counts[Runs[i - 1].pID] -= Length;
+		Excess -= Length;
+	}
+
+	return Header->palEntries < 256 ? Header->palEntries : 256;
+}
+
+/**
+ * Find the dominant colors of a .kif icon from its histogram. Every palette entry weighs its pixel count times its
+ * alpha, so transparent pixels never count and translucent ones count less. Colors whose channels all lie within
+ * Distance of a heavier color are merged into it, which keeps antialiased shades from crowding out other colors.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Colors Pointer to MaxColors colors to fill, heaviest first
+ * @param Weights Pointer to MaxColors integers to store the alpha weighted pixel count of every color (may be NULL)
+ * @param MaxColors Maximum number of colors to return
+ * @param Distance Largest per channel difference (RGB) to merge colors at, 0 to only merge equal colors
+ * @return int Returns the number of colors found, 0 for invalid input or a fully transparent icon
+*/
+int kif_dominant_colors(const void *Data, KIFHeader *Header, kif_rgba_t *Colors, uint32_t *Weights, int MaxColors, int Distance){
+	uint32_t Counts[256], Weight[256];
+	uint8_t Order[256];
+	int Entries = kif_histogram(Data, Header, Counts), Sorted = 0, Found = 0;
+
+	if(Entries == 0 || Colors == NULL || MaxColors <= 0){
+		return 0;
+	}
+
+	const kif_rgba_t *Palette = (const kif_rgba_t *)((const unsigned char *)Data + _kif_palette_offset((const unsigned char *)Data));
+	uint32_t Merged[256];
+
+	// Insertion sort the visible entries by weight, there are at most 256
+	for(int p = 0; p < Entries; p++){
+		Weight[p] = (uint32_t)(((uint64_t)Counts[p] * Palette[p].rgba.a + 127) / 255);
+
+		if(Weight[p] == 0){
+			continue;
+		}
+
+		int j = Sorted++;
+
+		for(; j > 0 && Weight[Order[j - 1]] < Weight[p]; j--){
+			Order[j] = Order[j - 1];
+		}
+
+		Order[j] = (uint8_t)p;
+	}
+
+	for(int s = 0; s < Sorted; s++){
+		kif_rgba_t Color = Palette[Order[s]];
+		int c = 0;
+
+		for(; c < Found; c++){
+			int R = Colors[c].rgba.r - Color.rgba.r, G = Colors[c].rgba.g - Color.rgba.g, B = Colors[c].rgba.b - Color.rgba.b;
+
+			if(R <= Distance && R >= -Distance && G <= Distance && G >= -Distance && B <= Distance && B >= -Distance){
+				break;
+			}
+		}
+
+		if(c < Found){
+			Merged[c] += Weight[Order[s]];
+		}else if(Found < MaxColors){
+			Colors[Found] = Color;
+			Merged[Found++] = Weight[Order[s]];
 		}
 	}
-	return -1;	// For some odd reason, we could not find the color in the palette.
+
+	// Merging can reorder the colors that were kept
+	for(int s = 1; s < Found; s++){
+		kif_rgba_t Color = Colors[s];
+		uint32_t W = Merged[s];
+		int j = s;
+
+		for(; j > 0 && Merged[j - 1] < W; j--){
+			Colors[j] = Colors[j - 1];
+			Merged[j] = Merged[j - 1];
+		}
+
+		Colors[j] = Color;
+		Merged[j] = W;
+	}
+
+	for(int c = 0; c < Found && Weights; c++){
+		Weights[c] = Merged[c];
+	}
+
+	return Found;
 }
 
+/* --- Resource limits --- */
+
 /**
- * Generate a palette from a raw image. Array of RGBa values.
- */
-static void _generate_palette(const void *Data, KIFHeader *Header, kif_rgba_t *Palette, int *NumberOfColors){
-	kif_rgba_t *PaletteData = (kif_rgba_t *)Data;
+ * Check a .kif header against resource limits before anything is allocated or decoded. Only the first
+ * 16 bytes are read, so untrusted input can be turned away as soon as its header has arrived.
+ * @param Data Pointer to at least the first 16 bytes of .kif data
+ * @param OutputBPP Output bits per pixel the icon would be decoded to (24 or 32)
+ * @param Limits Pointer to a KIFLimits struct, fields set to 0 (or a NULL pointer) are not limited
+ * @param Header Pointer to a KIFHeader struct to fill
+ * @return int Returns KIF_LIMIT_OK, or the KIF_ERROR_* code of the first check that failed
+*/
+int kif_check_header(const void *Data, int OutputBPP, const KIFLimits *Limits, KIFHeader *Header){
+	if(Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_read_header(Data, Header)){
+		return KIF_ERROR_FORMAT;
+	}
+
+	if(Limits == NULL){
+		return KIF_LIMIT_OK;
+	}
+
+	uint64_t Pixels = (uint64_t)Header->Width * Header->Height;
+
+	if(Limits->MaxPixels && Pixels > Limits->MaxPixels){
+		return KIF_ERROR_PIXELS;
+	}
+
+	if(Limits->MaxPaletteEntries && Header->palEntries > Limits->MaxPaletteEntries){
+		return KIF_ERROR_PALETTE;
+	}
 
-    // Initialize palette with transparent black as the first entry
-    Palette[0].v = 0x00000000;
-    (*NumberOfColors)++;
+	if(Limits->MaxEntries && Header->RLEEntries > Limits->MaxEntries){
+		return KIF_ERROR_ENTRIES;
+	}
 
-	int PaletteDataLength = Header->Width * Header->Height;
-	//int palette_index;	//	TODO: Looks like this can be deleted.
-	int Pos;
+	if(Limits->MaxOutputBytes && Pixels * (OutputBPP / 8) > Limits->MaxOutputBytes){
+		return KIF_ERROR_OUTPUT;
+	}
 
-	for(Pos = 0; Pos < PaletteDataLength; Pos++){
-		int i;
+	// Decoding touches every pixel once and every RLE entry once, runs of length 0 included.
+	if(Limits->MaxWork && Pixels + Header->RLEEntries > Limits->MaxWork){
+		return KIF_ERROR_WORK;
+	}
 
-        for(i = 0; i < *NumberOfColors; i++){
-			if(Palette[i].v == PaletteData[Pos].v){
-                //palette_index = i;
-                break;
-            }
-        }
+	return KIF_LIMIT_OK;
+}
 
-        // If color is not in the palette, add it
-        if(i == *NumberOfColors){
-            if(*NumberOfColors < 65536){ // Check if palette is full
-                Palette[*NumberOfColors].v = PaletteData[Pos].v;
-               // palette_index = *NumberOfColors;
-                (*NumberOfColors)++;
-            }/*else{ // If palette is full, use index 0 (reserved for palette overflow)
-                palette_index = 0;
-            }*/
-        }
+/**
+ * Describe a KIF_ERROR_* code
+ * @param Error KIF_LIMIT_OK or a KIF_ERROR_* code
+ * @return const char Returns a static string
+*/
+const char *kif_error_string(int Error){
+	switch(Error){
+		case KIF_LIMIT_OK:			return "ok";
+		case KIF_ERROR_FORMAT:		return "not a .kif icon";
+		case KIF_ERROR_TRUNCATED:	return "data is shorter than the header says";
+		case KIF_ERROR_CORRUPT:		return "runs reference palette entries that do not exist";
+		case KIF_ERROR_PIXELS:		return "too many pixels";
+		case KIF_ERROR_PALETTE:		return "too many palette entries";
+		case KIF_ERROR_ENTRIES:		return "too many RLE entries";
+		case KIF_ERROR_OUTPUT:		return "decoded image too large";
+		case KIF_ERROR_WORK:		return "decode too expensive";
+		case KIF_ERROR_MEMORY:		return "out of memory";
 	}
+
+	return "unknown error";
 }
 
+#ifndef KIF_FREESTANDING
+
+/**
+ * Decode untrusted .kif data. The header is checked against the limits first, then the data is checked to
+ * hold the whole palette and every RLE entry, and every run to use an existing palette entry.
+ * Only then is the output allocated.
+ * @param Data Pointer to input data
+ * @param Size Number of bytes available at Data
+ * @param Header Pointer to a KIFHeader struct
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @param Limits Pointer to a KIFLimits struct, see kif_check_header()
+ * @param Error Pointer to an integer to store KIF_LIMIT_OK or a KIF_ERROR_* code (may be NULL)
+ * @return void Returns a pointer to a buffer containing raw icon data (RGB or RGBA), or NULL on failure
+*/
+void *kif_decode_limited(const void *Data, size_t Size, KIFHeader *Header, int OutputBPP, const KIFLimits *Limits, int *Error){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+	unsigned char *Decoded = NULL;
+	int Result = Size < sizeof(KIFHeader) ? KIF_ERROR_TRUNCATED : kif_check_header(Data, OutputBPP, Limits, Header);
+
+	if(Result == KIF_LIMIT_OK){
+		uint64_t PaletteOffset = sizeof(KIFHeader);
+
+		if(Header->Compressed & KIF_FLAG_CHUNKS){
+			PaletteOffset = Size < sizeof(KIFHeader) + 4 ? (uint64_t)Size + 1 : sizeof(KIFHeader) + 4 + (uint64_t)_read32bit(data_bytes + sizeof(KIFHeader));
+		}
+
+		uint64_t Needed = PaletteOffset + (uint64_t)Header->palEntries * sizeof(kif_rgba_t) + (uint64_t)Header->RLEEntries * sizeof(kif_rle_t);
+
+		if(Needed > Size){
+			Result = KIF_ERROR_TRUNCATED;
+		}
+	}
+
+	if(Result == KIF_LIMIT_OK && Header->palEntries < 256){
+		const kif_rle_t *Runs = (const kif_rle_t *)(data_bytes + _kif_palette_offset(data_bytes) + Header->palEntries * sizeof(kif_rgba_t));
+
+		for(uint32_t i = 0; i < Header->RLEEntries; i++){
+			if(Runs[i].pID >= Header->palEntries){
+				Result = KIF_ERROR_CORRUPT;
+				break;
+			}
+		}
+	}
+
+	if(Result == KIF_LIMIT_OK){
+		Decoded = (unsigned char *)_kif_decode(Data, Header, OutputBPP);
+		Result = Decoded ? KIF_LIMIT_OK : KIF_ERROR_MEMORY;
+	}
+
+	if(Error){
+		*Error = Result;
+	}
+
+	return Decoded;
+}
+
+#endif
+
+/**
+ * Decode a .kif icon rotated and/or flipped into a caller provided buffer, without a separate transform pass.
+ * A vertical flip only starts at the last row with a negative stride. 90 and 270 degree rotations expand
+ * KIF_TILE rows at a time into a small tile on the stack and write it out transposed, so every output row
+ * receives KIF_TILE contiguous pixels instead of a single pixel per cache line.
+ * Pixels past the end of truncated run data are zeroed for every orientation.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Output Pointer to the first pixel of the first output row
+ * @param Stride Bytes from one output row to the next
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @param Orientation One of the KIF_ROTATE_* values, optionally combined with KIF_FLIP_VERTICAL
+ * @return int Returns 1 on success, 0 on invalid input
+*/
+int kif_decode_oriented(const void *Data, KIFHeader *Header, void *Output, int Stride, int OutputBPP, int Orientation){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	KIFSpanIter Iter;
+	KIFSpan Span;
+
+	if(Output == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_parse(Data, Header, &Palette, &Runs) || !kif_span_begin(&Iter, Data, 0)){
+		return 0;
+	}
+
+	int Rotation = Orientation & KIF_ROTATE_270;
+	int OutputHeight = (Rotation & KIF_ROTATE_90) ? Header->Width : Header->Height;
+	int BytesPerPixel = OutputBPP / 8;
+	unsigned char *Base = (unsigned char *)Output;
+
+	if((Orientation & KIF_FLIP_VERTICAL) && OutputHeight > 0){
+		Base += (OutputHeight - 1) * Stride;
+		Stride = -Stride;
+	}
+
+	if(Rotation == 0){
+		return kif_decode_into(Data, Header, Base, Stride, OutputBPP);
+	}
+
+	if(Rotation == KIF_ROTATE_180){
+		int x = 0, y = 0;
+
+		// Rows in reverse order, each span mirrored inside its row.
+		while(kif_span_next(&Iter, &Span)){
+			unsigned char *Row = Base + (Iter.Height - 1 - Span.Y) * Stride;
+
+			_kif_fill(Row + (Iter.Width - Span.X - Span.Length) * BytesPerPixel, Span.Color, Span.Length, BytesPerPixel);
+			x = Span.X + Span.Length;
+			y = Span.Y;
+		}
+
+		if(x == Iter.Width){
+			x = 0;
+			y++;
+		}
+
+		// Truncated data, mirrored the missing pixels are the start of row Height - 1 - y and every row above it.
+		if(y < Iter.Height){
+			kif_rgba_t Zero;
+
+			Zero.v = 0;
+			_kif_fill(Base + (Iter.Height - 1 - y) * Stride, Zero, Iter.Width - x, BytesPerPixel);
+			_kif_clear_rest(Base, 0, 0, Iter.Width, Iter.Height - 1 - y, Stride, BytesPerPixel);
+		}
+		return 1;
+	}
+
+	KIFSpanIter Rows[KIF_TILE];
+	KIFSpan Current[KIF_TILE];
+	int HasSpan[KIF_TILE];
+	kif_rgba_t Tile[KIF_TILE][KIF_TILE];
+	int Clockwise = Rotation == KIF_ROTATE_90;
+
+	for(int y0 = 0; y0 < Iter.Height; y0 += KIF_TILE){
+		int TileRows = Iter.Height - y0 < KIF_TILE ? Iter.Height - y0 : KIF_TILE;
+
+		// Keep an iterator at the start of every row of the band, the main one moves on to the next band.
+		for(int r = 0; r < TileRows; r++){
+			Rows[r] = Iter;
+			HasSpan[r] = kif_span_next(&Rows[r], &Current[r]);
+
+			while(Iter.Y == y0 + r && kif_span_next(&Iter, &Span));
+		}
+
+		for(int x0 = 0; x0 < Iter.Width; x0 += KIF_TILE){
+			int TileColumns = Iter.Width - x0 < KIF_TILE ? Iter.Width - x0 : KIF_TILE;
+
+			for(int r = 0; r < TileRows; r++){
+				for(int x = x0; x < x0 + TileColumns;){
+					while(HasSpan[r] && Current[r].Y == y0 + r && Current[r].X + Current[r].Length <= x){
+						HasSpan[r] = kif_span_next(&Rows[r], &Current[r]);
+					}
+
+					if(!HasSpan[r] || Current[r].Y != y0 + r){
+						for(; x < x0 + TileColumns; x++){
+							Tile[r][x - x0].v = 0;	// Truncated data, see _kif_clear_rest()
+						}
+						break;
+					}
+
+					int End = Current[r].X + Current[r].Length < x0 + TileColumns ? Current[r].X + Current[r].Length : x0 + TileColumns;
+
+					for(; x < End; x++){
+						Tile[r][x - x0] = Current[r].Color;
+					}
+				}
+			}
+
+			// Source column x becomes output row x (clockwise) or Width - 1 - x, source row y becomes output column Height - 1 - y or y.
+			for(int c = 0; c < TileColumns; c++){
+				unsigned char *Row = Base + (Clockwise ? x0 + c : Iter.Width - 1 - x0 - c) * Stride;
+
+				for(int r = 0; r < TileRows; r++){
+					_kif_fill(Row + (Clockwise ? Iter.Height - 1 - y0 - r : y0 + r) * BytesPerPixel, Tile[r][c], 1, BytesPerPixel);
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Reset a progressive decoder before feeding it the first bytes of an icon.
+ * @param State Pointer to a KIFProgressive struct
+*/
+void kif_progressive_init(KIFProgressive *State){
+	State->Stage = KIF_PROGRESS_NONE;
+	State->Entry = 0;
+	State->X = 0;
+	State->Y = 0;
+}
+
+/**
+ * Decode as much of a partially received icon as possible. Call it again whenever more bytes arrive,
+ * always passing the same buffer from the start of the icon. Icons encoded with KIF_FLAG_PROGRESSIVE
+ * paint a 4x upscaled preview as soon as the header, chunks and palette are in, full resolution rows
+ * then replace it from the top down as the runs arrive.
+ * @param State Pointer to a KIFProgressive struct set up with kif_progressive_init()
+ * @param Data Pointer to the bytes received so far
+ * @param Available Number of bytes received so far
+ * @param Output Pointer to the output pixels (Header.Width x Header.Height), may be NULL until the header is known
+ * @param Stride Bytes from one output row to the next
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @return int Returns the KIF_PROGRESS_* stage reached
+*/
+int kif_progressive_update(KIFProgressive *State, const void *Data, uint32_t Available, void *Output, int Stride, int OutputBPP){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+
+	if(State->Stage == KIF_PROGRESS_DONE || State->Stage == KIF_PROGRESS_ERROR){
+		return State->Stage;
+	}
+
+	if(Available < sizeof(KIFHeader) + 4 || (OutputBPP != 24 && OutputBPP != 32)){
+		return State->Stage;
+	}
+
+	if(!_kif_parse(Data, &State->Header, &Palette, &Runs)){
+		return State->Stage = KIF_PROGRESS_ERROR;
+	}
+
+	if(State->Stage == KIF_PROGRESS_NONE){
+		State->Stage = KIF_PROGRESS_HEADER;
+	}
+
+	uint32_t RunsOffset = (uint32_t)((const unsigned char *)Runs - data_bytes);
+	int Width = State->Header.Width, Height = State->Header.Height;
+	int BytesPerPixel = OutputBPP / 8;
+
+	if(Output == NULL || Available < RunsOffset){
+		return State->Stage;
+	}
+
+	int Length;
+	const unsigned char *Layer = (const unsigned char *)kif_find_chunk(Data, "PROG", &Length);
+
+	if(State->Stage == KIF_PROGRESS_HEADER && Layer != NULL && Length >= 8){
+		int LayerWidth = _read16bit(Layer), LayerHeight = _read16bit(Layer + 2);
+		uint32_t LayerEntries = _read32bit(Layer + 4);
+		const kif_rle_t *LayerRuns = (const kif_rle_t *)(Layer + 8);
+		int x = 0, y = 0;
+
+		if(LayerEntries * sizeof(kif_rle_t) > (uint32_t)Length - 8){
+			LayerEntries = 0;
+		}
+
+		// Every preview pixel covers a 4x4 block of the icon.
+		for(uint32_t i = 0; i < LayerEntries && y < LayerHeight && LayerWidth > 0; i++){
+			kif_rgba_t Color = Palette[LayerRuns[i].pID];
+			int RunLength = LayerRuns[i].rle;
+
+			while(RunLength > 0 && y < LayerHeight){
+				int Count = RunLength < LayerWidth - x ? RunLength : LayerWidth - x;
+				int Columns = (x + Count) * 4 < Width ? Count * 4 : Width - x * 4;
+
+				for(int Row = y * 4; Row < y * 4 + 4 && Row < Height; Row++){
+					_kif_fill((unsigned char *)Output + Row * Stride + x * 4 * BytesPerPixel, Color, Columns, BytesPerPixel);
+				}
+
+				x += Count;
+				RunLength -= Count;
+
+				if(x == LayerWidth){
+					x = 0;
+					y++;
+				}
+			}
+		}
+
+		State->Stage = KIF_PROGRESS_PREVIEW;
+	}
+
+	// Refine with every complete RLE entry received so far.
+	uint32_t Entries = (Available - RunsOffset) / sizeof(kif_rle_t);
+	unsigned char *Row = (unsigned char *)Output + State->Y * Stride;
+
+	if(Entries > State->Header.RLEEntries){
+		Entries = State->Header.RLEEntries;
+	}
+
+	for(; State->Entry < Entries && State->Y < Height && Width > 0; State->Entry++){
+		kif_rgba_t Color = Palette[Runs[State->Entry].pID];
+		int RunLength = Runs[State->Entry].rle;
+
+		while(RunLength > 0 && State->Y < Height){
+			int Count = RunLength < Width - State->X ? RunLength : Width - State->X;
+
+			_kif_fill(Row + State->X * BytesPerPixel, Color, Count, BytesPerPixel);
+
+			State->X += Count;
+			RunLength -= Count;
+
+			if(State->X == Width){
+				State->X = 0;
+				State->Y++;
+				Row += Stride;
+			}
+		}
+
+		State->Stage = KIF_PROGRESS_PARTIAL;
+	}
+
+	if(State->Entry == State->Header.RLEEntries || State->Y == Height){
+		State->Stage = KIF_PROGRESS_DONE;
+	}
+
+	return State->Stage;
+}
+
+#ifndef KIF_FREESTANDING
+
+/**
+ * Decode a .kif icon. Headers over KIF_DEFAULT_LIMITS are rejected before anything is allocated,
+ * use kif_decode_limited() to decode larger images or untrusted data.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param OutputBPP Set output bits per pixel
+ * @return void Returns a pointer to a buffer containing raw icon data (RGB or RGBA), or NULL on failure
+*/
+void *kif_decode(const void *Data, KIFHeader *Header, int OutputBPP){
+	const KIFLimits Limits = KIF_DEFAULT_LIMITS;
+
+	if(Data == NULL || kif_check_header(Data, OutputBPP, &Limits, Header) != KIF_LIMIT_OK){
+		return NULL;
+	}
+
+    // Needs to be free()d after use.
+	return _kif_decode(Data, Header, OutputBPP);
+}
+
+/**
+ * Encode raw image data into a .kif icon
+ * @param data Pointer to input data (raw image data)
+ * @param Header Pointer to a KIFHeader struct
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to a buffer containing the encoded .kif icon data, or NULL if the image has more than 255 colors besides transparent black
+ */
+void *kif_encode(const void *Data, KIFHeader *Header, int *OutputLength){
+	KIFEncoder Encoder;
+
+    // Check for valid inputs
+    if(Data == NULL || Header == NULL || OutputLength == NULL || !kif_encode_begin(&Encoder, Data, Header)){
+        return NULL;
+    }
+
+	// Finishing an encoder that has not started encodes the whole image in one go
+	return kif_encode_finish(&Encoder, Header, OutputLength);
+}
+
+/* --- Incremental encoding --- */
+
+/**
+ * Start encoding raw image data in steps, for callers that can only spend a bounded amount of time per call.
+ * @param Encoder Pointer to a KIFEncoder struct to fill
+ * @param Data Pointer to input data (32-bit RGBA pixels), must stay valid until kif_encode_finish()
+ * @param Header Pointer to a KIFHeader struct with Width, Height and the requested KIF_FLAG_* in Compressed
+ * @return int Returns 1 on success, 0 on failure
+*/
+int kif_encode_begin(KIFEncoder *Encoder, const void *Data, const KIFHeader *Header){
+	kif_rgba_t Transparent;
+
+	memset(Encoder, 0, sizeof(KIFEncoder));
+
+	if(Data == NULL || Header == NULL){
+		return 0;
+	}
+
+	_kif_run_writer *Writer = (_kif_run_writer *)malloc(sizeof(_kif_run_writer));
+
+	if(Writer == NULL){
+		return 0;
+	}
+
+	// Transparent black is always palette entry 0
+	Transparent.v = 0;
+	_kif_writer_init(Writer);
+	_kif_writer_put(Writer, Transparent, 0);
+
+	Encoder->Pixels = (const uint32_t *)Data;
+	Encoder->Header = *Header;
+	Encoder->Total = (uint32_t)Header->Width * Header->Height;
+	Encoder->Writer = Writer;
+	return 1;
+}
+
+/**
+ * Encode the next part of the image. The clock is read every KIF_ENCODE_SLICE pixels, so a call returns
+ * at most one slice after its time budget ran out.
+ * @param Encoder Pointer to a KIFEncoder started with kif_encode_begin()
+ * @param MaxPixels Maximum number of pixels to encode in this call, 0 for no limit
+ * @param MaxMicroseconds Time budget for this call, 0 for no limit
+ * @return int Returns KIF_ENCODE_MORE if pixels are left, KIF_ENCODE_DONE when all pixels are encoded,
+ * KIF_ENCODE_ERROR if the image has more than 255 colors besides transparent black or memory ran out
+*/
+int kif_encode_step(KIFEncoder *Encoder, uint32_t MaxPixels, uint32_t MaxMicroseconds){
+	_kif_run_writer *Writer = (_kif_run_writer *)Encoder->Writer;
+
+	if(Writer == NULL || Writer->Failed){
+		return KIF_ENCODE_ERROR;
+	}
+
+	const uint32_t *Pixels = Encoder->Pixels;
+	uint32_t Position = Encoder->Position;
+	uint32_t End = Encoder->Total;
+	uint64_t Deadline = MaxMicroseconds ? _kif_microseconds() + MaxMicroseconds : 0;
+
+	if(MaxPixels > 0 && End - Position > MaxPixels){
+		End = Position + MaxPixels;
+	}
+
+	KIF_TRACE_BEGIN("kif_rle");
+
+	while(Position < End && !Writer->Failed){
+		uint32_t SliceEnd = End - Position > KIF_ENCODE_SLICE ? Position + KIF_ENCODE_SLICE : End;
+
+		// Runs cut at a slice boundary are merged again by the writer
+		while(Position < SliceEnd){
+			kif_rgba_t Color;
+			uint32_t Start = Position;
+
+			Color.v = Pixels[Position];
+
+			while(++Position < SliceEnd && Pixels[Position] == Color.v);
+
+			_kif_writer_put(Writer, Color, Position - Start);
+		}
+
+		if(Deadline && _kif_microseconds() >= Deadline){
+			break;
+		}
+	}
+
+	KIF_TRACE_END("kif_rle");
+
+	Encoder->Position = Position;
+
+	if(Writer->Failed){
+		return KIF_ENCODE_ERROR;
+	}
+
+	return Position == Encoder->Total ? KIF_ENCODE_DONE : KIF_ENCODE_MORE;
+}
+
+/**
+ * Encode any pixels left, then order the palette, add the requested chunks and build the .kif icon.
+ * The encoder is released whether this succeeds or not.
+ * @param Encoder Pointer to a KIFEncoder started with kif_encode_begin()
+ * @param Header Pointer to a KIFHeader struct to receive the final header
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to a buffer containing the encoded .kif icon data, or NULL on failure
+*/
+void *kif_encode_finish(KIFEncoder *Encoder, KIFHeader *Header, int *OutputLength){
+	_kif_run_writer *Writer = (_kif_run_writer *)Encoder->Writer;
+
+	if(Writer == NULL || Header == NULL || OutputLength == NULL || (Encoder->Position < Encoder->Total && kif_encode_step(Encoder, 0, 0) != KIF_ENCODE_DONE)){
+		kif_encode_abort(Encoder);
+		return NULL;
+	}
+
+	// Optional chunks written between the header and the palette
+	_kif_chunk_buffer Chunks = { NULL, 0, 0 };
+	int Flags = Encoder->Header.Compressed & (KIF_FLAG_ALPHA_ORDERED | KIF_FLAG_OPAQUE_RECTS | KIF_FLAG_PROGRESSIVE | KIF_FLAG_PLACEHOLDER);
+	int Failed = 0;
+
+	*Header = Encoder->Header;
+
+	// First in the chunk area, so readers find it right behind the header
+	if(Flags & KIF_FLAG_PLACEHOLDER){
+		KIF_TRACE_BEGIN("kif_chunks");
+		Failed = !_placeholder(Writer->Palette, Writer->Runs, Writer->Count, Header->Width, Header->Height, &Chunks);
+		KIF_TRACE_END("kif_chunks");
+	}
+
+	if(Flags & KIF_FLAG_ALPHA_ORDERED){
+		uint16_t Classes[2];
+		uint8_t Remap[256];
+		int OpaqueStart = 0, TranslucentStart = 0;
+
+		KIF_TRACE_BEGIN("kif_palette");
+		Failed |= !_order_palette(Writer->Palette, Writer->Colors, &OpaqueStart, &TranslucentStart, Remap);
+
+		// The runs were written against the palette in first use order
+		for(int i = 0; i < Writer->Count && !Failed; i++){
+			Writer->Runs[i].pID = Remap[Writer->Runs[i].pID];
+		}
+
+		KIF_TRACE_END("kif_palette");
+
+		Classes[0] = OpaqueStart;
+		Classes[1] = TranslucentStart;
+		Failed |= !_kif_chunk_add(&Chunks, "ACLS", Classes, sizeof(Classes));
+	}
+
+	KIF_TRACE_BEGIN("kif_chunks");
+
+	if(Flags & KIF_FLAG_OPAQUE_RECTS){
+		KIFRect Rects[KIF_MAX_OPAQUE_RECTS + 1];
+		int NumberOfRects = _opaque_rects(Writer->Palette, Writer->Runs, Writer->Count, Header->Width, Header->Height, Rects + 1);
+
+		// The payload starts with the number of rectangles, padded to the size of a KIFRect.
+		memset(Rects, 0, sizeof(KIFRect));
+		Rects[0].X = NumberOfRects;
+		Failed |= !_kif_chunk_add(&Chunks, "OPAQ", Rects, (NumberOfRects + 1) * sizeof(KIFRect));
+	}
+
+	if((Flags & KIF_FLAG_PROGRESSIVE) && !_progressive_layer(Writer->Runs, Writer->Count, Header->Width, Header->Height, &Chunks)){
+		Flags &= ~KIF_FLAG_PROGRESSIVE;
+	}
+
+	KIF_TRACE_END("kif_chunks");
+
+	Header->Compressed = Flags;
+
+    // Copy header, chunks, palette and encoded data to the output buffer, this also fills in the rest of the header
+	unsigned char *OutputBuffer = NULL;
+
+	if(!Failed){
+		KIF_TRACE_BEGIN("kif_assemble");
+		OutputBuffer = (unsigned char *)_kif_assemble(Header, &Chunks, Writer->Palette, Writer->Colors, Writer->Runs, Writer->Count, OutputLength);
+		KIF_TRACE_END("kif_assemble");
+	}
+
+	free(Chunks.Data);
+	kif_encode_abort(Encoder);
+    return OutputBuffer;
+}
+
+/**
+ * Release an encoder without finishing it
+ * @param Encoder Pointer to a KIFEncoder started with kif_encode_begin()
+*/
+void kif_encode_abort(KIFEncoder *Encoder){
+	_kif_run_writer *Writer = (_kif_run_writer *)Encoder->Writer;
+
+	if(Writer){
+		free(Writer->Runs);
+		free(Writer);
+	}
+
+	Encoder->Writer = NULL;
+}
+
+/* --- Multi-size encoding --- */
+
+/**
+ * Resample 32-bit RGBA pixels to another size. Every output pixel is the alpha weighted average of the source
+ * area it covers (a box filter), which is exact for downscaling and falls back to nearest/linear for upscaling.
+ * @param Data Pointer to input data (32-bit RGBA pixels)
+ * @param Width Input width
+ * @param Height Input height
+ * @param Output Pointer to OutputWidth * OutputHeight 32-bit pixels
+ * @param OutputWidth Output width
+ * @param OutputHeight Output height
+ * @return int Returns 1 on success, 0 on failure
+*/
+int kif_resize(const void *Data, int Width, int Height, void *Output, int OutputWidth, int OutputHeight){
+	if(Data == NULL || Output == NULL || Width <= 0 || Height <= 0 || OutputWidth <= 0 || OutputHeight <= 0){
+		return 0;
+	}
+
+	float *Premultiplied = (float *)malloc((size_t)Width * Height * 4 * sizeof(float));
+
+	if(Premultiplied == NULL){
+		return 0;
+	}
+
+	_kif_premultiply((const uint32_t *)Data, (size_t)Width * Height, Premultiplied);
+
+	int Resized = _kif_resample(Premultiplied, Width, Height, (uint32_t *)Output, OutputWidth, OutputHeight);
+
+	free(Premultiplied);
+	return Resized;
+}
+
+/**
+ * Prepare a master image for encoding at several sizes. The master is premultiplied and its colors hashed
+ * once, kif_master_encode() only reads the master afterwards and may be called from several threads at once.
+ * @param Master Pointer to a KIFMaster struct to fill
+ * @param Data Pointer to input data (32-bit RGBA pixels), only used during this call
+ * @param Width Master width
+ * @param Height Master height
+ * @return int Returns 1 on success, 0 on failure
+*/
+int kif_master_begin(KIFMaster *Master, const void *Data, int Width, int Height){
+	memset(Master, 0, sizeof(KIFMaster));
+
+	if(Data == NULL || Width <= 0 || Height <= 0 || Width > 65535 || Height > 65535){
+		return 0;
+	}
+
+	const uint32_t *Pixels = (const uint32_t *)Data;
+	size_t Count = (size_t)Width * Height;	// 65535 x 65535 does not fit an int
+	_kif_run_writer *Colors = (_kif_run_writer *)malloc(sizeof(_kif_run_writer));
+
+	Master->Width = Width;
+	Master->Height = Height;
+	Master->Colors = Colors;
+	Master->Pixels = (float *)malloc(Count * 4 * sizeof(float));
+
+	if(Colors == NULL || Master->Pixels == NULL){
+		kif_master_end(Master);
+		return 0;
+	}
+
+	// Length 0 only adds the color
+	_kif_writer_init(Colors);
+
+	for(size_t i = 0; i < Count && !Colors->Failed; i++){
+		if(i == 0 || Pixels[i] != Pixels[i - 1]){
+			kif_rgba_t Color;
+
+			Color.v = Pixels[i];
+			_kif_writer_put(Colors, Color, 0);
+		}
+	}
+
+	// A master with more than 256 colors has too many to keep, its sizes are quantized on their own
+	if(Colors->Failed){
+		_kif_writer_init(Colors);
+	}
+
+	_kif_premultiply(Pixels, Count, Master->Pixels);
+	return 1;
+}
+
+/**
+ * Encode a master image at one size. The longest side becomes Size pixels, the other keeps the aspect ratio.
+ * Colors of the master are kept, then the most frequent blended colors, and any color past what a .kif palette
+ * holds becomes the nearest kept color. Every size gets a palette of its own, built from the colors it ends up with.
+ * @param Master Pointer to a KIFMaster prepared with kif_master_begin()
+ * @param Size Size of the longest side in pixels
+ * @param Flags KIF_FLAG_* to encode with, see kif_encode()
+ * @param Header Pointer to a KIFHeader struct to receive the header
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to a buffer containing the encoded .kif icon data, or NULL on failure
+*/
+void *kif_master_encode(const KIFMaster *Master, int Size, int Flags, KIFHeader *Header, int *OutputLength){
+	if(Master->Pixels == NULL || Size <= 0 || Size > 65535 || Header == NULL || OutputLength == NULL){
+		return NULL;
+	}
+
+	int Longest = Master->Width > Master->Height ? Master->Width : Master->Height;
+	int Width = (int)(((int64_t)Master->Width * Size + Longest / 2) / Longest);
+	int Height = (int)(((int64_t)Master->Height * Size + Longest / 2) / Longest);
+
+	Width = Width > 0 ? Width : 1;
+	Height = Height > 0 ? Height : 1;
+
+	uint32_t *Pixels = (uint32_t *)malloc((size_t)Width * Height * sizeof(uint32_t));
+	void *OutputBuffer = NULL;
+
+	KIF_TRACE_BEGIN("kif_resample");
+	int Resized = Pixels && _kif_resample(Master->Pixels, Master->Width, Master->Height, Pixels, Width, Height);
+	KIF_TRACE_END("kif_resample");
+
+	if(Resized && _kif_quantize(Pixels, (size_t)Width * Height, (const _kif_run_writer *)Master->Colors)){
+		memset(Header, 0, sizeof(KIFHeader));
+		Header->Width = Width;
+		Header->Height = Height;
+		Header->Compressed = Flags;
+		OutputBuffer = kif_encode(Pixels, Header, OutputLength);
+	}
+
+	free(Pixels);
+	return OutputBuffer;
+}
+
+/**
+ * Release a master image
+ * @param Master Pointer to a KIFMaster prepared with kif_master_begin()
+*/
+void kif_master_end(KIFMaster *Master){
+	free(Master->Pixels);
+	free(Master->Colors);
+	Master->Pixels = NULL;
+	Master->Colors = NULL;
+}
+
+/**
+ * Encode one master image at several sizes, see kif_master_encode()
+ * @param Data Pointer to input data (32-bit RGBA pixels)
+ * @param Width Master width
+ * @param Height Master height
+ * @param Sizes Sizes of the longest side in pixels
+ * @param Count Number of sizes
+ * @param Flags KIF_FLAG_* to encode with
+ * @param Outputs Pointer to Count pointers to receive the encoded .kif icons, free() each of them
+ * @param Lengths Pointer to Count integers to store the output data lengths
+ * @return int Returns 1 on success, 0 on failure (no outputs are returned then)
+*/
+int kif_encode_sizes(const void *Data, int Width, int Height, const int *Sizes, int Count, int Flags, void **Outputs, int *Lengths){
+	KIFMaster Master;
+	KIFHeader Header;
+	int i;
+
+	if(Sizes == NULL || Outputs == NULL || Lengths == NULL || !kif_master_begin(&Master, Data, Width, Height)){
+		return 0;
+	}
+
+	for(i = 0; i < Count; i++){
+		Outputs[i] = kif_master_encode(&Master, Sizes[i], Flags, &Header, &Lengths[i]);
+
+		if(Outputs[i] == NULL){
+			break;
+		}
+	}
+
+	kif_master_end(&Master);
+
+	if(i < Count){
+		while(i-- > 0){
+			free(Outputs[i]);
+			Outputs[i] = NULL;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/* --- Image diff --- */
+
+/**
+ * Compare two .kif icons of the same size pixel by pixel without decoding them. Both RLE streams are walked in
+ * lockstep and palette colors are only compared where the runs differ, icons with the same palette and runs
+ * are recognized with a single memcmp. Pixels that are fully transparent in both icons never differ, whatever
+ * their RGB, and MaxDelta is measured on the straight palette channels.
+ * @param A Pointer to the first .kif icon
+ * @param B Pointer to the second .kif icon
+ * @param Diff Pointer to a KIFDiff struct to fill
+ * @return int Returns 1 on success, 0 on invalid input or if the icons differ in size
+*/
+int kif_diff(const void *A, const void *B, KIFDiff *Diff){
+	return _kif_diff(A, B, Diff, NULL);
+}
+
+/**
+ * Compare two .kif icons like kif_diff() and encode the result as a mask icon: pixels that differ are opaque
+ * magenta, all others transparent.
+ * @param A Pointer to the first .kif icon
+ * @param B Pointer to the second .kif icon
+ * @param Diff Pointer to a KIFDiff struct to fill
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to a buffer containing the encoded .kif mask, or NULL on failure
+*/
+void *kif_diff_encode(const void *A, const void *B, KIFDiff *Diff, int *OutputLength){
+	_kif_run_writer *Writer = (_kif_run_writer *)malloc(sizeof(_kif_run_writer));
+	KIFHeader Header;
+	kif_rgba_t Transparent;
+
+	if(Writer == NULL || OutputLength == NULL){
+		free(Writer);
+		return NULL;
+	}
+
+	// Transparent black is always palette entry 0
+	Transparent.v = 0;
+	_kif_writer_init(Writer);
+	_kif_writer_put(Writer, Transparent, 0);
+
+	if(!_kif_diff(A, B, Diff, Writer)){
+		free(Writer->Runs);
+		free(Writer);
+		return NULL;
+	}
+
+	memset(&Header, 0, sizeof(KIFHeader));
+	Header.Width = Diff->Width;
+	Header.Height = Diff->Height;
+
+	void *OutputBuffer = _kif_writer_finish(Writer, &Header, OutputLength);
+
+	free(Writer);
+	return OutputBuffer;
+}
+
+/* --- Palette variants --- */
+
+/**
+ * Decode one palette variant of a .kif icon, see kif_decode_variant_into(). Like kif_decode(), headers over
+ * KIF_DEFAULT_LIMITS are rejected before anything is allocated.
+ * @param Data Pointer to input data
+ * @param Header Pointer to a KIFHeader struct
+ * @param Variant 0 for the main palette, up to kif_variant_count() - 1 for the others
+ * @param OutputBPP Set output bits per pixel (24 or 32)
+ * @return void Returns a pointer to a buffer containing raw icon data (RGB or RGBA), or NULL on failure
+*/
+void *kif_decode_variant(const void *Data, KIFHeader *Header, int Variant, int OutputBPP){
+	const KIFLimits Limits = KIF_DEFAULT_LIMITS;
+
+	if(Data == NULL || kif_check_header(Data, OutputBPP, &Limits, Header) != KIF_LIMIT_OK){
+		return NULL;
+	}
+
+	int Stride = Header->Width * (OutputBPP / 8);
+	unsigned char *Decoded = (unsigned char *)malloc((size_t)Stride * Header->Height + 1);
+
+	if(Decoded != NULL && !kif_decode_variant_into(Data, Header, Variant, Decoded, Stride, OutputBPP)){
+		free(Decoded);
+		Decoded = NULL;
+	}
+
+	return Decoded;
+}
+
+/**
+ * Encode several color variants of the same icon (light, dark, high contrast...) into one .kif icon. The first
+ * image is encoded as usual and its palette becomes variant 0, the other images only add a palette to a VARS
+ * chunk, so they must have the same shapes: pixels that share a color in the first image must share a color
+ * in every other image. Chunks like ACLS, OPAQ and PREV describe the main palette.
+ * @param Data Pointers to Count images (32-bit RGBA pixels) of Header->Width * Header->Height pixels
+ * @param Names Pointers to Count variant names, shorter than KIF_VARIANT_NAME bytes
+ * @param Count Number of variants
+ * @param Header Pointer to a KIFHeader struct with Width, Height and the requested KIF_FLAG_* in Compressed
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to a buffer containing the encoded .kif icon data, or NULL if the images do not
+ * share their shapes or on failure
+*/
+void *kif_encode_variants(const void *const *Data, const char *const *Names, int Count, KIFHeader *Header, int *OutputLength){
+	if(Data == NULL || Names == NULL || Count < 1 || Header == NULL || OutputLength == NULL){
+		return NULL;
+	}
+
+	for(int v = 0; v < Count; v++){
+		if(Data[v] == NULL || Names[v] == NULL || strlen(Names[v]) >= KIF_VARIANT_NAME){
+			return NULL;
+		}
+	}
+
+	KIFHeader Base = *Header;
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	int Length;
+
+	Base.Compressed &= ~KIF_FLAG_VARIANTS;
+
+	unsigned char *Encoded = (unsigned char *)kif_encode(Data[0], &Base, &Length);
+
+	if(Encoded == NULL || !_kif_parse(Encoded, &Base, &Palette, &Runs)){
+		free(Encoded);
+		return NULL;
+	}
+
+	// Count, names, then a palette for every variant but the first
+	int PaletteSize = Base.palEntries * sizeof(kif_rgba_t);
+	int PayloadSize = 4 + Count * KIF_VARIANT_NAME + (Count - 1) * PaletteSize;
+	unsigned char *Payload = (unsigned char *)calloc(1, PayloadSize);
+	_kif_chunk_buffer Chunks = { NULL, 0, 0 };
+	unsigned char *OutputBuffer = NULL;
+	int Failed = Payload == NULL;
+
+	for(int v = 0; v < Count && !Failed; v++){
+		const uint32_t *Pixels = (const uint32_t *)Data[v];
+		uint8_t Seen[256] = { 0 };
+		uint32_t Position = 0;
+
+		memcpy(Payload + 4 + v * KIF_VARIANT_NAME, Names[v], strlen(Names[v]));
+
+		if(v == 0){
+			continue;
+		}
+
+		kif_rgba_t *VariantPalette = (kif_rgba_t *)(Payload + 4 + Count * KIF_VARIANT_NAME + (v - 1) * PaletteSize);
+
+		// Entries no pixel uses keep the main color
+		memcpy(VariantPalette, Palette, PaletteSize);
+
+		for(uint32_t i = 0; i < Base.RLEEntries && !Failed; i++){
+			int pID = Runs[i].pID;
+
+			for(int j = 0; j < Runs[i].rle; j++, Position++){
+				if(!Seen[pID]){
+					VariantPalette[pID].v = Pixels[Position];
+					Seen[pID] = 1;
+				}else if(VariantPalette[pID].v != Pixels[Position]){
+					Failed = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	if(!Failed){
+		uint32_t VariantCount = Count;
+
+		memcpy(Payload, &VariantCount, 4);
+
+		// Keep the chunks of the main encode in front, the PREV chunk has to stay first
+		if(Base.Compressed & KIF_FLAG_CHUNKS){
+			Chunks.Length = Chunks.Size = _read32bit(Encoded + sizeof(KIFHeader));
+			Chunks.Data = (unsigned char *)malloc(Chunks.Size);
+			Failed = Chunks.Data == NULL;
+
+			if(!Failed){
+				memcpy(Chunks.Data, Encoded + sizeof(KIFHeader) + 4, Chunks.Length);
+			}
+		}
+
+		Failed |= !_kif_chunk_add(&Chunks, "VARS", Payload, PayloadSize);
+	}
+
+	if(!Failed){
+		Base.Compressed |= KIF_FLAG_VARIANTS;
+		OutputBuffer = (unsigned char *)_kif_assemble(&Base, &Chunks, Palette, Base.palEntries, Runs, Base.RLEEntries, OutputLength);
+		*Header = Base;
+	}
+
+	free(Chunks.Data);
+	free(Payload);
+	free(Encoded);
+	return OutputBuffer;
+}
+
+#endif
+
+/* --- Chunks and palette classes --- */
+
+/**
+ * Find a chunk in the chunk area following the header
+ * @param Data Pointer to .kif data
+ * @param Tag 4 character chunk tag
+ * @param Length Pointer to an integer to store the payload length (may be NULL)
+ * @return const void Returns a pointer to the chunk payload, or NULL if the icon has no such chunk
+*/
+const void *kif_find_chunk(const void *Data, const char *Tag, int *Length){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+
+	if(Data == NULL || !(data_bytes[5] & KIF_FLAG_CHUNKS)){
+		return NULL;
+	}
+
+	const unsigned char *Chunk = data_bytes + sizeof(KIFHeader) + 4;
+	const unsigned char *End = Chunk + _read32bit(data_bytes + sizeof(KIFHeader));
+
+	while(Chunk + 8 <= End){
+		unsigned int ChunkLength = _read32bit(Chunk + 4);
+
+		if(ChunkLength > (unsigned int)(End - Chunk - 8)){
+			break;
+		}
+
+		if(Chunk[0] == (unsigned char)Tag[0] && Chunk[1] == (unsigned char)Tag[1] && Chunk[2] == (unsigned char)Tag[2] && Chunk[3] == (unsigned char)Tag[3]){
+			if(Length){
+				*Length = ChunkLength;
+			}
+			return Chunk + 8;
+		}
+
+		Chunk += 8 + ((ChunkLength + 3) & ~3u);
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the palette class boundaries of an icon encoded with KIF_FLAG_ALPHA_ORDERED.
+ * Palette entries [0, OpaqueStart) are fully transparent, [OpaqueStart, TranslucentStart) fully opaque
+ * and [TranslucentStart, palEntries) translucent, so a run is classified with two compares on its pID.
+ * @param Data Pointer to .kif data
+ * @param OpaqueStart Pointer to an integer to store the first opaque palette index
+ * @param TranslucentStart Pointer to an integer to store the first translucent palette index
+ * @return int Returns 1 if the palette is alpha ordered, 0 otherwise (both boundaries are then set to 0)
+*/
+int kif_alpha_classes(const void *Data, int *OpaqueStart, int *TranslucentStart){
+	int Length;
+	const unsigned char *Classes = (const unsigned char *)kif_find_chunk(Data, "ACLS", &Length);
+
+	*OpaqueStart = 0;
+	*TranslucentStart = 0;
+
+	if(Classes == NULL || Length < 4 || !(((const unsigned char *)Data)[5] & KIF_FLAG_ALPHA_ORDERED)){
+		return 0;
+	}
+
+	*OpaqueStart = _read16bit(Classes);
+	*TranslucentStart = _read16bit(Classes + 2);
+	return 1;
+}
+
+/**
+ * Get the fully opaque regions of an icon encoded with KIF_FLAG_OPAQUE_RECTS, without decoding it.
+ * Anything drawn below these rectangles is hidden, so a compositor can cull it. The list is coarse
+ * (thin spans are left out and at most KIF_MAX_OPAQUE_RECTS are kept) and sorted by area, largest first.
+ * @param Data Pointer to .kif data
+ * @param Rects Pointer to store a pointer to the rectangles inside the data
+ * @return int Returns the number of rectangles, 0 if the icon has none or no OPAQ chunk
+*/
+int kif_opaque_rects(const void *Data, const KIFRect **Rects){
+	int Length;
+	const KIFRect *Chunk = (const KIFRect *)kif_find_chunk(Data, "OPAQ", &Length);
+
+	if(Chunk == NULL || Length < (int)sizeof(KIFRect) || Length < (int)((Chunk[0].X + 1) * sizeof(KIFRect))){
+		return 0;
+	}
+
+	*Rects = Chunk + 1;
+	return Chunk[0].X;
+}
+
+/**
+ * Get the placeholder of an icon encoded with KIF_FLAG_PLACEHOLDER, without touching the palette or the runs.
+ * The PREV chunk is written first, so it lies within the first 96 bytes of the icon.
+ * @param Data Pointer to .kif data
+ * @param Average Pointer to a color to store the alpha weighted average color of the icon (may be NULL)
+ * @param Preview Pointer to 16 colors to store the 4x4 preview, row by row (may be NULL)
+ * @return int Returns 1 if the icon has a placeholder, 0 otherwise
+*/
+int kif_placeholder(const void *Data, kif_rgba_t *Average, kif_rgba_t *Preview){
+	int Length;
+	const unsigned char *Chunk = (const unsigned char *)kif_find_chunk(Data, "PREV", &Length);
+
+	if(Chunk == NULL || Length < 17 * (int)sizeof(kif_rgba_t)){
+		return 0;
+	}
+
+	for(int i = 0; i < 17; i++){
+		kif_rgba_t Color;
+
+		Color.rgba.r = Chunk[i * 4];
+		Color.rgba.g = Chunk[i * 4 + 1];
+		Color.rgba.b = Chunk[i * 4 + 2];
+		Color.rgba.a = Chunk[i * 4 + 3];
+
+		if(i == 0 && Average){
+			*Average = Color;
+		}else if(i > 0 && Preview){
+			Preview[i - 1] = Color;
+		}
+	}
+
+	return 1;
+}
+
+/* --- Span iteration --- */
+
+/**
+ * Start iterating over the spans of an icon. A span is a horizontal run of one color clipped to a row,
+ * made straight from the RLE entries (consecutive entries of the same color are merged), so the work
+ * scales with the number of entries and not with the number of pixels.
+ * @param Iter Pointer to a KIFSpanIter struct to initialize
+ * @param Data Pointer to .kif data
+ * @param Flags KIF_SPAN_* flags
+ * @return int Returns 1 on success, 0 on invalid data
+*/
+int kif_span_begin(KIFSpanIter *Iter, const void *Data, int Flags){
+	KIFHeader Header;
+
+	if(Iter == NULL || !_kif_parse(Data, &Header, &Iter->Palette, &Iter->Runs)){
+		return 0;
+	}
+
+	Iter->Entries = Header.RLEEntries;
+	Iter->pID = 0;
+	Iter->Remaining = 0;
+	Iter->Width = Header.Width;
+	Iter->Height = Header.Width ? Header.Height : 0;
+	Iter->X = 0;
+	Iter->Y = 0;
+	Iter->Flags = Flags;
+
+	return 1;
+}
+
+/**
+ * Get the next span, in row order
+ * @param Iter Pointer to a KIFSpanIter started with kif_span_begin()
+ * @param Span Pointer to a KIFSpan struct to fill
+ * @return int Returns 1 if a span was returned, 0 at the end of the image
+*/
+int kif_span_next(KIFSpanIter *Iter, KIFSpan *Span){
+	while(Iter->Y < Iter->Height){
+		int RowLeft = Iter->Width - Iter->X;
+
+		if(Iter->Remaining == 0){
+			if(Iter->Entries == 0){
+				return 0;
+			}
+
+			Iter->pID = Iter->Runs->pID;
+			Iter->Remaining = Iter->Runs->rle;
+			Iter->Runs++;
+			Iter->Entries--;
+		}
+
+		// Runs are capped at 255 pixels, so long spans are split over several entries.
+		while(Iter->Remaining < RowLeft && Iter->Entries > 0 && Iter->Runs->pID == Iter->pID){
+			Iter->Remaining += Iter->Runs->rle;
+			Iter->Runs++;
+			Iter->Entries--;
+		}
+
+		if(Iter->Remaining == 0){
+			continue;
+		}
+
+		Span->Y = Iter->Y;
+		Span->X = Iter->X;
+		Span->Length = Iter->Remaining < RowLeft ? Iter->Remaining : RowLeft;
+		Span->pID = Iter->pID;
+		Span->Color = Iter->Palette[Iter->pID];
+
+		Iter->Remaining -= Span->Length;
+		Iter->X += Span->Length;
+
+		if(Iter->X == Iter->Width){
+			Iter->X = 0;
+			Iter->Y++;
+		}
+
+		if(!(Iter->Flags & KIF_SPAN_SKIP_TRANSPARENT) || Span->Color.rgba.a != 0){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Call a function for every span of an icon
+ * @param Data Pointer to .kif data
+ * @param Flags KIF_SPAN_* flags
+ * @param Callback Function to call, returning non-zero stops the iteration
+ * @param User Pointer passed on to the callback
+ * @return int Returns 1 if all spans were visited, 0 on invalid data or if the callback stopped early
+*/
+int kif_for_each_span(const void *Data, int Flags, int (*Callback)(const KIFSpan *Span, void *User), void *User){
+	KIFSpanIter Iter;
+	KIFSpan Span;
+
+	if(Callback == NULL || !kif_span_begin(&Iter, Data, Flags)){
+		return 0;
+	}
+
+	while(kif_span_next(&Iter, &Span)){
+		if(Callback(&Span, User)){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* --- Run domain operations --- */
+
+/**
+ * Draw an icon onto a 32-bit RGBA surface, blending translucent pixels with what is already there.
+ * Transparent runs are skipped and opaque runs are filled without reading the destination.
+ * With an alpha ordered palette the run class comes from the pID alone, otherwise every run is
+ * treated as translucent and classified by its palette alpha while blending.
+ * @param Data Pointer to .kif data
+ * @param Destination Pointer to the top left pixel of the surface
+ * @param Stride Bytes per surface row
+ * @param DestWidth Surface width, the icon is clipped against it
+ * @param DestHeight Surface height, the icon is clipped against it
+ * @param X Horizontal position of the icon (may be negative)
+ * @param Y Vertical position of the icon (may be negative)
+ * @return int Returns 1 on success, 0 on invalid data
+*/
+int kif_blit(const void *Data, void *Destination, int Stride, int DestWidth, int DestHeight, int X, int Y){
+	KIFSpanIter Iter;
+	KIFSpan Span;
+	int OpaqueStart, TranslucentStart;
+
+	if(Destination == NULL || !kif_span_begin(&Iter, Data, 0)){
+		return 0;
+	}
+
+	kif_alpha_classes(Data, &OpaqueStart, &TranslucentStart);
+
+	while(kif_span_next(&Iter, &Span)){
+		int From = X + Span.X < 0 ? 0 : X + Span.X;
+		int To = X + Span.X + Span.Length > DestWidth ? DestWidth : X + Span.X + Span.Length;
+
+		if(Span.pID < OpaqueStart || Y + Span.Y < 0 || Y + Span.Y >= DestHeight){
+			continue;
+		}
+
+		kif_rgba_t *Row = (kif_rgba_t *)((unsigned char *)Destination + (Y + Span.Y) * Stride);
+
+		if(Span.pID < TranslucentStart){
+			for(int i = From; i < To; i++){
+				Row[i] = Span.Color;
+			}
+		}else{
+			for(int i = From; i < To; i++){
+				Row[i] = _kif_blend(Row[i], Span.Color);
+			}
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Pixel perfect collision test between two sprites, done on their spans instead of bitmasks.
+ * Pixels with a palette alpha above 0 are solid. Returns on the first overlapping pixel.
+ * @param A Pointer to the .kif data of the first sprite
+ * @param AX Horizontal position of the first sprite
+ * @param AY Vertical position of the first sprite
+ * @param B Pointer to the .kif data of the second sprite
+ * @param BX Horizontal position of the second sprite
+ * @param BY Vertical position of the second sprite
+ * @return int Returns 1 if any solid pixels overlap, 0 if not or on invalid data
+*/
+int kif_collide(const void *A, int AX, int AY, const void *B, int BX, int BY){
+	KIFSpanIter IterA, IterB;
+	KIFSpan SpanA, SpanB;
+
+	if(!kif_span_begin(&IterA, A, KIF_SPAN_SKIP_TRANSPARENT) || !kif_span_begin(&IterB, B, KIF_SPAN_SKIP_TRANSPARENT)){
+		return 0;
+	}
+
+	// Bounding boxes first, most pairs are rejected here without touching any runs.
+	if(AX >= BX + IterB.Width || BX >= AX + IterA.Width || AY >= BY + IterB.Height || BY >= AY + IterA.Height){
+		return 0;
+	}
+
+	int HasA = kif_span_next(&IterA, &SpanA);
+	int HasB = kif_span_next(&IterB, &SpanB);
+
+	// Both span streams are sorted by row and then column, so they can be merged like two sorted lists.
+	while(HasA && HasB){
+		int RowA = AY + SpanA.Y, RowB = BY + SpanB.Y;
+
+		if(RowA != RowB){
+			if(RowA < RowB){
+				HasA = kif_span_next(&IterA, &SpanA);
+			}else{
+				HasB = kif_span_next(&IterB, &SpanB);
+			}
+			continue;
+		}
+
+		int EndA = AX + SpanA.X + SpanA.Length;
+		int EndB = BX + SpanB.X + SpanB.Length;
+
+		if(AX + SpanA.X < EndB && BX + SpanB.X < EndA){
+			return 1;
+		}
+
+		if(EndA <= EndB){
+			HasA = kif_span_next(&IterA, &SpanA);
+		}else{
+			HasB = kif_span_next(&IterB, &SpanB);
+		}
+	}
+
+	return 0;
+}
+
+#ifndef KIF_FREESTANDING
+
+/**
+ * Composite an overlay (badge, emblem) onto a base icon without expanding either to pixels.
+ * Both RLE streams are walked row by row, transparent overlay runs pass the base through,
+ * opaque ones replace it and only translucent runs are blended.
+ * @param Base Pointer to the .kif data of the base icon
+ * @param Overlay Pointer to the .kif data of the overlay
+ * @param X Horizontal position of the overlay inside the base (may be negative)
+ * @param Y Vertical position of the overlay inside the base (may be negative)
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to the new .kif icon (same size as Base), or NULL if it would need more than 256 colors
+*/
+void *kif_composite(const void *Base, const void *Overlay, int X, int Y, int *OutputLength){
+	KIFHeader BaseHeader, OverlayHeader;
+	const kif_rgba_t *BasePalette, *OverlayPalette;
+	const kif_rle_t *BaseRuns, *OverlayRuns;
+
+	if(OutputLength == NULL || !_kif_parse(Base, &BaseHeader, &BasePalette, &BaseRuns) || !_kif_parse(Overlay, &OverlayHeader, &OverlayPalette, &OverlayRuns)){
+		return NULL;
+	}
+
+	_kif_run_cursor B = { BaseRuns, BaseHeader.RLEEntries, 0, 0 };
+	_kif_run_cursor O = { OverlayRuns, OverlayHeader.RLEEntries, 0, 0 };
+	_kif_run_writer Writer;
+
+	int Width = BaseHeader.Width, Height = BaseHeader.Height;
+	int OverlayWidth = OverlayHeader.Width, OverlayHeight = OverlayHeader.Height;
+
+	// Columns of the base covered by the overlay, and overlay pixels clipped on the left of each row.
+	int Start = X < 0 ? 0 : X;
+	int End = X + OverlayWidth > Width ? Width : X + OverlayWidth;
+	int Lead = X < 0 ? (-X < OverlayWidth ? -X : OverlayWidth) : 0;
+	int Covered = End > Start ? End - Start : 0;
+
+	_kif_writer_init(&Writer);
+
+	// Overlay rows above the base are never visible.
+	for(int y = Y; y < 0 && y < Y + OverlayHeight; y++){
+		_kif_cursor_skip(&O, OverlayWidth);
+	}
+
+	for(int y = 0; y < Height && !Writer.Failed; y++){
+		int InOverlay = y >= Y && y < Y + OverlayHeight;
+
+		if(InOverlay){
+			_kif_cursor_skip(&O, Lead);
+		}
+
+		for(int x = 0; x < Width && !Writer.Failed;){
+			int Limit = Width - x;
+			int Over = InOverlay && x >= Start && x < End;
+
+			if(InOverlay && x < Start && Start - x < Limit){
+				Limit = Start - x;
+			}else if(Over && End - x < Limit){
+				Limit = End - x;
+			}
+
+			int Length = _kif_cursor_peek(&B, Limit);
+
+			if(Length == 0){
+				Writer.Failed = 1;	// Truncated base
+				break;
+			}
+
+			kif_rgba_t Color = BasePalette[B.pID];
+
+			if(Over){
+				Length = _kif_cursor_peek(&O, Length);
+
+				if(Length == 0){
+					Writer.Failed = 1;	// Truncated overlay
+					break;
+				}
+
+				Color = _kif_blend(Color, OverlayPalette[O.pID]);
+				_kif_cursor_skip(&O, Length);
+			}
+
+			_kif_cursor_skip(&B, Length);
+			_kif_writer_put(&Writer, Color, Length);
+			x += Length;
+		}
+
+		if(InOverlay){
+			_kif_cursor_skip(&O, OverlayWidth - Lead - Covered);
+		}
+	}
+
+	BaseHeader.Compressed = 0;
+	return _kif_writer_finish(&Writer, &BaseHeader, OutputLength);
+}
+
+/* --- Icon packs --- */
+
+/*
+    A pack (.kifp) stores many .kif blobs in one file and is laid out like a log:
+
+        [KIFPackHeader][blob][blob]...[index gen 1][blob]...[index gen 2]
+
+    Adding or replacing icons only appends the new blobs followed by a new index generation, then
+    rewrites the 32 byte header to point at it. Nothing that an existing index refers to is ever
+    overwritten, so readers that mapped the file earlier keep a consistent view of the old generation.
+    Replaced blobs and old indexes are accounted in DeadBytes and reclaimed by kif_pack_compact(),
+    which writes a fresh file and renames it over the old one.
+
+    The blobs and the index are synced to disk before the header is rewritten and the header after it,
+    so after a crash the header points at either the old or the new generation, both complete. Builds
+    without fsync() (plain C outside POSIX and Windows) only flush to the OS and give no such guarantee.
+*/
+
+/**
+ * Open a pack from memory (usually an mmap of the whole file)
+ * @param Pack Pointer to a KIFPack struct to fill
+ * @param Data Pointer to the pack data
+ * @param Size Number of bytes available at Data
+ * @return int Returns 1 on success, 0 if the data is not a valid pack
+*/
+int kif_pack_open(KIFPack *Pack, const void *Data, uint64_t Size){
+	if(Pack == NULL || Data == NULL || Size < sizeof(KIFPackHeader)){
+		return 0;
+	}
+
+	memcpy(&Pack->Header, Data, sizeof(KIFPackHeader));
+
+	if(Pack->Header.Magic != 0x6B696670){	// 'kifp'
+		return 0;
+	}
+
+	// The index must lie completely inside the data we were given.
+	if(Pack->Header.IndexOffset > Size || (uint64_t)Pack->Header.IndexEntries * sizeof(KIFPackEntry) > Size - Pack->Header.IndexOffset){
+		return 0;
+	}
+
+	Pack->Data = (const unsigned char *)Data;
+	Pack->Size = Size;
+	Pack->Index = (const KIFPackEntry *)(Pack->Data + Pack->Header.IndexOffset);
+
+	return 1;
+}
+
+/**
+ * Find an icon in a pack
+ * @param Pack Pointer to an opened KIFPack
+ * @param Name Name of the icon
+ * @param Length Pointer to an integer to store the blob length (may be NULL)
+ * @return const void Returns a pointer to the .kif blob inside the pack, or NULL if not found
+*/
+const void *kif_pack_find(const KIFPack *Pack, const char *Name, int *Length){
+	int Found;
+	int Index = _pack_find_entry(Pack->Index, Pack->Header.IndexEntries, Name, &Found);
+
+	if(!Found){
+		return NULL;
+	}
+
+	const KIFPackEntry *Entry = &Pack->Index[Index];
+
+	if(Entry->Offset > Pack->Size || Entry->Length > Pack->Size - Entry->Offset){
+		return NULL;
+	}
+
+	if(Length){
+		*Length = Entry->Length;
+	}
+
+	return Pack->Data + Entry->Offset;
+}
+
+/**
+ * Add, replace or remove icons in a pack, creating the pack if needed.
+ * Only the given blobs and one new index generation are written.
+ * @param Filename Path of the pack
+ * @param Count Number of icons to update
+ * @param Names Array of icon names (max 47 characters)
+ * @param Data Array of pointers to .kif blobs, a NULL pointer removes the icon from the pack
+ * @param Lengths Array of blob lengths
+ * @return int Returns the number of entries in the new index generation, or -1 on failure or if a name is too long
+*/
+int kif_pack_update(const char *Filename, int Count, const char **Names, const void **Data, const int *Lengths){
+	// Names are stored zero terminated in a fixed size field, refuse the update before touching the file.
+	for(int i = 0; i < Count; i++){
+		if(Names[i] == NULL || strlen(Names[i]) >= sizeof(((KIFPackEntry *)0)->Name) || (Data[i] != NULL && Lengths[i] < 0)){
+			return -1;
+		}
+	}
+
+	FILE *OpenedFile = fopen(Filename, "r+b");
+	KIFPackHeader Header;
+	KIFPackEntry *Index = NULL;
+
+	if(!OpenedFile){
+		// No pack yet, start a new one with an empty index.
+		OpenedFile = fopen(Filename, "w+b");
+
+		if(!OpenedFile){
+			return -1;
+		}
+
+		memset(&Header, 0, sizeof(KIFPackHeader));
+		Header.Magic = 0x6B696670;	// 'kifp'
+		Header.IndexOffset = sizeof(KIFPackHeader);
+
+		if(fwrite(&Header, 1, sizeof(KIFPackHeader), OpenedFile) != sizeof(KIFPackHeader)){
+			fclose(OpenedFile);
+			return -1;
+		}
+	}else if(!_pack_read_index(OpenedFile, &Header, &Index)){
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	int Entries = Header.IndexEntries;
+	KIFPackEntry *NewIndex = (KIFPackEntry *)realloc(Index, (Entries + Count + 1) * sizeof(KIFPackEntry));
+
+	if(NewIndex == NULL){
+		free(Index);
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	Index = NewIndex;
+
+	// Kept to record the space wasted by a failed update in the current generation.
+	KIFPackHeader Previous = Header;
+
+	// The current index generation becomes garbage as soon as the new one is written.
+	Header.DeadBytes += (uint64_t)Entries * sizeof(KIFPackEntry);
+
+	int64_t AppendStart = _kif_fseek(OpenedFile, 0, SEEK_END) == 0 ? _kif_ftell(OpenedFile) : -1;
+	int Failed = AppendStart < 0;
+
+	for(int i = 0; i < Count && !Failed; i++){
+		int Found;
+		int Pos = _pack_find_entry(Index, Entries, Names[i], &Found);
+
+		if(Found){
+			Header.DeadBytes += Index[Pos].Length;
+		}
+
+		if(Data[i] == NULL){
+			if(Found){
+				memmove(&Index[Pos], &Index[Pos + 1], (Entries - Pos - 1) * sizeof(KIFPackEntry));
+				Entries--;
+			}
+			continue;
+		}
+
+		if(!Found){
+			memmove(&Index[Pos + 1], &Index[Pos], (Entries - Pos) * sizeof(KIFPackEntry));
+			memset(&Index[Pos], 0, sizeof(KIFPackEntry));
+			strcpy(Index[Pos].Name, Names[i]);
+			Entries++;
+		}
+
+		int64_t Offset = _kif_ftell(OpenedFile);
+
+		Index[Pos].Offset = Offset;
+		Index[Pos].Length = Lengths[i];
+		Failed = Offset < 0 || fwrite(Data[i], 1, Lengths[i], OpenedFile) != (size_t)Lengths[i];
+	}
+
+	int64_t IndexOffset = Failed ? -1 : _kif_ftell(OpenedFile);
+
+	Failed = IndexOffset < 0 || fwrite(Index, sizeof(KIFPackEntry), Entries, OpenedFile) != (size_t)Entries;
+	free(Index);
+
+	if(Failed){
+		// The old generation stays current, but whatever reached the file is dead space kif_pack_compact() has to know about.
+		int64_t End = _kif_fseek(OpenedFile, 0, SEEK_END) == 0 ? _kif_ftell(OpenedFile) : -1;
+
+		if(AppendStart >= 0 && End > AppendStart){
+			Previous.DeadBytes += (uint64_t)(End - AppendStart);
+			fflush(OpenedFile);
+
+			if(_kif_fseek(OpenedFile, 0, SEEK_SET) == 0){
+				fwrite(&Previous, 1, sizeof(KIFPackHeader), OpenedFile);
+			}
+		}
+
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	Header.Generation++;
+	Header.IndexOffset = IndexOffset;
+	Header.IndexEntries = Entries;
+
+	// The blobs and the index have to be on disk before the header points at them, the header before we report success.
+	if(!_kif_fsync(OpenedFile) || _kif_fseek(OpenedFile, 0, SEEK_SET) != 0 || fwrite(&Header, 1, sizeof(KIFPackHeader), OpenedFile) != sizeof(KIFPackHeader) || !_kif_fsync(OpenedFile)){
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	if(fclose(OpenedFile) != 0){
+		return -1;
+	}
+
+	return Entries;
+}
+
+/**
+ * Add or replace a single icon in a pack
+ * @param Filename Path of the pack
+ * @param Name Name of the icon (max 47 characters)
+ * @param Data Pointer to the .kif blob, NULL removes the icon
+ * @param Length Length of the blob
+ * @return int Returns the number of entries in the pack, or -1 on failure
+*/
+int kif_pack_put(const char *Filename, const char *Name, const void *Data, int Length){
+	return kif_pack_update(Filename, 1, &Name, &Data, &Length);
+}
+
+/**
+ * Rewrite a pack without dead space if it exceeds a threshold.
+ * The new pack is renamed over the old one, so existing mappings of the old file stay valid.
+ * @param Filename Path of the pack
+ * @param DeadPercent Only compact if more than this percentage of the file is dead (0 = always)
+ * @return int Returns the number of bytes reclaimed, 0 if below the threshold, or -1 on failure
+*/
+int kif_pack_compact(const char *Filename, int DeadPercent){
+	FILE *OpenedFile = fopen(Filename, "rb");
+	KIFPackHeader Header;
+	KIFPackEntry *Index;
+
+	if(!OpenedFile){
+		return -1;
+	}
+
+	if(!_pack_read_index(OpenedFile, &Header, &Index)){
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	int64_t Size = _kif_fseek(OpenedFile, 0, SEEK_END) == 0 ? _kif_ftell(OpenedFile) : -1;
+
+	if(Size < 0){
+		free(Index);
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	if(Header.DeadBytes == 0 || Header.DeadBytes * 100 <= (uint64_t)Size * DeadPercent){
+		free(Index);
+		fclose(OpenedFile);
+		return 0;
+	}
+
+	char TempName[4096];
+	snprintf(TempName, sizeof(TempName), "%s.tmp", Filename);
+
+	FILE *Compacted = fopen(TempName, "wb");
+
+	if(!Compacted){
+		free(Index);
+		fclose(OpenedFile);
+		return -1;
+	}
+
+	KIFPackHeader NewHeader;
+	memset(&NewHeader, 0, sizeof(KIFPackHeader));
+	NewHeader.Magic = Header.Magic;
+	NewHeader.Generation = Header.Generation + 1;
+	NewHeader.IndexEntries = Header.IndexEntries;
+
+	int Failed = fwrite(&NewHeader, 1, sizeof(KIFPackHeader), Compacted) != sizeof(KIFPackHeader);
+	unsigned char Buffer[65536];
+
+	for(uint32_t i = 0; i < Header.IndexEntries && !Failed; i++){
+		int64_t Offset = _kif_ftell(Compacted);
+		uint32_t Remaining = Index[i].Length;
+
+		Failed = Offset < 0 || _kif_fseek(OpenedFile, Index[i].Offset, SEEK_SET) != 0;
+
+		while(Remaining > 0 && !Failed){
+			size_t Chunk = Remaining < sizeof(Buffer) ? Remaining : sizeof(Buffer);
+
+			Failed = fread(Buffer, 1, Chunk, OpenedFile) != Chunk || fwrite(Buffer, 1, Chunk, Compacted) != Chunk;
+			Remaining -= Chunk;
+		}
+
+		Index[i].Offset = Offset;
+	}
+
+	int64_t IndexOffset = Failed ? -1 : _kif_ftell(Compacted);
+
+	NewHeader.IndexOffset = IndexOffset;
+	Failed |= IndexOffset < 0;
+
+	if(!Failed){
+		Failed = fwrite(Index, sizeof(KIFPackEntry), Header.IndexEntries, Compacted) != Header.IndexEntries;
+	}
+
+	if(!Failed){
+		Failed = _kif_fseek(Compacted, 0, SEEK_SET) != 0 || fwrite(&NewHeader, 1, sizeof(KIFPackHeader), Compacted) != sizeof(KIFPackHeader);
+	}
+
+	int64_t NewSize = _kif_fseek(Compacted, 0, SEEK_END) == 0 ? _kif_ftell(Compacted) : -1;
+
+	// On disk before the rename, or a crash could replace the pack with an empty file.
+	Failed |= NewSize < 0 || !_kif_fsync(Compacted);
+
+	free(Index);
+	fclose(OpenedFile);
+
+	if(fclose(Compacted) != 0 || Failed || rename(TempName, Filename) != 0){
+		remove(TempName);
+		return -1;
+	}
+
+	// Saturate, packs can outgrow the int return value.
+	return Size - NewSize > 0x7FFFFFFF ? 0x7FFFFFFF : (int)(Size - NewSize);
+}
+
+/* --- Theme lookup index --- */
+
+/*
+    Pack entries following the naming scheme "<context>/<size>[@<scale>]/<name>" (e.g. "apps/48@2/firefox")
+    can be turned into a theme index (.kift) by kif_theme_build(). For every icon and every requested
+    size/scale the index stores the blob that the size fallback and theme inheritance would pick,
+    so resolving an icon at runtime is a single hash probe without touching the filesystem.
+*/
+
+/**
+ * Build a theme lookup index
+ * @param Packs Array of opened packs, in inheritance order (the theme first, then its parents)
+ * @param PackCount Number of packs (max 255)
+ * @param Sizes Array of icon sizes to resolve
+ * @param Scales Array of scales to resolve, one for each size
+ * @param SizeCount Number of size/scale pairs
+ * @param OutputLength Pointer to an integer to store the index length
+ * @return void Returns a pointer to the index, needs to be free()d after use
+*/
+void *kif_theme_build(const KIFPack *Packs, int PackCount, const int *Sizes, const int *Scales, int SizeCount, int *OutputLength){
+	if(Packs == NULL || PackCount <= 0 || PackCount > 255 || Sizes == NULL || Scales == NULL || OutputLength == NULL){
+		return NULL;
+	}
+
+	int Total = 0;
+
+	for(int p = 0; p < PackCount; p++){
+		Total += Packs[p].Header.IndexEntries;
+	}
+
+	// Every pack entry that follows the naming scheme becomes a candidate.
+	_kif_theme_candidate *Candidates = (_kif_theme_candidate *)malloc((Total + 1) * sizeof(_kif_theme_candidate));
+	int CandidateCount = 0;
+
+	if(Candidates == NULL){
+		return NULL;
+	}
+
+	for(int p = 0; p < PackCount; p++){
+		for(uint32_t i = 0; i < Packs[p].Header.IndexEntries; i++){
+			_kif_theme_candidate *C = &Candidates[CandidateCount];
+
+			if(_theme_parse_name(Packs[p].Index[i].Name, C->Key, &C->Size, &C->Scale)){
+				C->Pack = p;
+				C->Entry = &Packs[p].Index[i];
+				CandidateCount++;
+			}
+		}
+	}
+
+	// Group the candidates by icon, keeping inheritance order inside each group.
+	qsort(Candidates, CandidateCount, sizeof(_kif_theme_candidate), _theme_compare_candidates);
+
+	int Icons = 0, StringsSize = 0;
+
+	for(int i = 0; i < CandidateCount; i++){
+		if(i == 0 || strcmp(Candidates[i].Key, Candidates[i - 1].Key) != 0){
+			Icons++;
+			StringsSize += strlen(Candidates[i].Key) + 1;
+		}
+	}
+
+	// Keep the load factor at or below 50% so most lookups hit on the first probe.
+	uint32_t Slots = 16;
+
+	while(Slots < (uint32_t)Icons * SizeCount * 2){
+		Slots *= 2;
+	}
+
+	int TotalSize = sizeof(KIFThemeHeader) + Slots * sizeof(KIFThemeSlot) + StringsSize;
+	unsigned char *OutputBuffer = (unsigned char *)calloc(1, TotalSize);
+
+	if(OutputBuffer == NULL){
+		free(Candidates);
+		return NULL;
+	}
+
+	KIFThemeHeader *Header = (KIFThemeHeader *)OutputBuffer;
+	KIFThemeSlot *Table = (KIFThemeSlot *)(OutputBuffer + sizeof(KIFThemeHeader));
+	char *Strings = (char *)(Table + Slots);
+
+	Header->Magic = 0x6B696674;	// 'kift'
+	Header->Slots = Slots;
+	Header->StringsOffset = sizeof(KIFThemeHeader) + Slots * sizeof(KIFThemeSlot);
+	Header->StringsSize = StringsSize;
+
+	int StringPos = 0;
+
+	for(int First = 0, Last; First < CandidateCount; First = Last){
+		const char *Key = Candidates[First].Key;
+
+		for(Last = First; Last < CandidateCount && strcmp(Candidates[Last].Key, Key) == 0; Last++);
+
+		uint32_t NameOffset = StringPos;
+		strcpy(Strings + StringPos, Key);
+		StringPos += strlen(Key) + 1;
+
+		for(int s = 0; s < SizeCount; s++){
+			// The first pack in the chain that has the icon at all wins, like icon theme inheritance.
+			int Best = -1;
+
+			for(int i = First; i < Last && (Best < 0 || Candidates[i].Pack == Candidates[Best].Pack); i++){
+				if(Best < 0 || _theme_better_size(&Candidates[i], &Candidates[Best], Sizes[s], Scales[s])){
+					Best = i;
+				}
+			}
+
+			uint32_t Hash = _theme_hash(Key, strlen(Key), Sizes[s], Scales[s]);
+			uint32_t Slot = Hash & (Slots - 1);
+
+			while(Table[Slot].Hash != 0){
+				Slot = (Slot + 1) & (Slots - 1);
+			}
+
+			Table[Slot].Hash = Hash;
+			Table[Slot].NameOffset = NameOffset;
+			Table[Slot].Size = Sizes[s];
+			Table[Slot].Scale = Scales[s];
+			Table[Slot].Pack = Candidates[Best].Pack;
+			Table[Slot].BlobLength = Candidates[Best].Entry->Length;
+			Table[Slot].BlobOffset = Candidates[Best].Entry->Offset;
+		}
+	}
+
+	free(Candidates);
+
+	*OutputLength = TotalSize;
+	return OutputBuffer;
+}
+
+/**
+ * Resolve an icon with a theme index. The slot table and the string table are checked against IndexSize
+ * before probing, so a truncated or corrupt index returns NULL instead of reading past the mapping.
+ * @param Index Pointer to the theme index (usually an mmap of the .kift file)
+ * @param IndexSize Number of bytes available at Index
+ * @param Context Icon context, e.g. "apps"
+ * @param Name Icon name, e.g. "firefox"
+ * @param Size Requested size, must be one of the sizes the index was built for
+ * @param Scale Requested scale
+ * @return const KIFThemeSlot Returns the slot pointing at the blob in Packs[Slot->Pack], or NULL if not found
+*/
+const KIFThemeSlot *kif_theme_lookup(const void *Index, uint64_t IndexSize, const char *Context, const char *Name, int Size, int Scale){
+	const KIFThemeHeader *Header = (const KIFThemeHeader *)Index;
+	char Key[48];
+
+	if(Header == NULL || IndexSize < sizeof(KIFThemeHeader) || Header->Magic != 0x6B696674){
+		return NULL;
+	}
+
+	// Slots must be a power of two, the table and the NUL terminated string table must lie inside the index.
+	if(Header->Slots == 0 || (Header->Slots & (Header->Slots - 1)) != 0 ||
+		sizeof(KIFThemeHeader) + (uint64_t)Header->Slots * sizeof(KIFThemeSlot) > IndexSize ||
+		Header->StringsSize == 0 || (uint64_t)Header->StringsOffset + Header->StringsSize > IndexSize ||
+		((const char *)Index)[Header->StringsOffset + Header->StringsSize - 1] != 0){
+		return NULL;
+	}
+
+	int Length = snprintf(Key, sizeof(Key), "%s/%s", Context, Name);
+
+	if(Length < 0 || Length >= (int)sizeof(Key)){
+		return NULL;
+	}
+
+	const KIFThemeSlot *Table = (const KIFThemeSlot *)((const unsigned char *)Index + sizeof(KIFThemeHeader));
+	const char *Strings = (const char *)Index + Header->StringsOffset;
+	uint32_t Hash = _theme_hash(Key, Length, Size, Scale);
+
+	// A corrupt index may have no empty slot, so at most every slot is probed once.
+	for(uint32_t Slot = Hash & (Header->Slots - 1), Probes = 0; Table[Slot].Hash != 0 && Probes < Header->Slots; Slot = (Slot + 1) & (Header->Slots - 1), Probes++){
+		if(Table[Slot].Hash == Hash && Table[Slot].Size == Size && Table[Slot].Scale == Scale &&
+			Table[Slot].NameOffset < Header->StringsSize && strcmp(Strings + Table[Slot].NameOffset, Key) == 0){
+			return &Table[Slot];
+		}
+	}
+
+	return NULL;
+}
+
+/* --- PNG export --- */
+
+/**
+ * Encode a .kif icon as an indexed (PLTE/tRNS) 8-bit PNG straight from its palette and runs, without decoding to RGBA.
+ * Runs become distance 1 deflate matches and rows equal to the row above become one match, coded with the fixed
+ * Huffman tables, so there is no match search. Only icons whose runs use palette entries 0-255 can be written.
+ * @param Data Pointer to .kif data
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to the PNG file data, needs to be free()d after use, or NULL on failure
+*/
+void *kif_encode_png(const void *Data, int *OutputLength){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	KIFHeader Header;
+	KIFSpanIter Iter;
+	KIFSpan Span;
+
+	if(Data == NULL || OutputLength == NULL || !_kif_parse(Data, &Header, &Palette, &Runs) || Header.Width == 0 || Header.Height == 0 || !kif_span_begin(&Iter, Data, 0)){
+		return NULL;
+	}
+
+	// PLTE holds the entries up to the highest one the runs use.
+	int Colors = 0, Alphas = 0;
+
+	for(uint32_t i = 0; i < Header.RLEEntries; i++){
+		if(Runs[i].pID >= Colors){
+			Colors = Runs[i].pID + 1;
+		}
+	}
+
+	if(Colors == 0 || Colors > Header.palEntries){
+		return NULL;
+	}
+
+	for(int i = 0; i < Colors; i++){
+		if(Palette[i].rgba.a != 255){
+			Alphas = i + 1;
+		}
+	}
+
+	int Width = Header.Width;
+	unsigned char *Rows = (unsigned char *)malloc(Width * 2);
+	_kif_png_writer Writer;
+
+	if(Rows == NULL){
+		return NULL;
+	}
+
+	_png_writer_init(&Writer);
+
+	static const unsigned char Signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	unsigned char IHDR[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, 3, 0, 0, 0 };	// 8-bit indexed, no interlace
+
+	IHDR[2] = Header.Width >> 8;
+	IHDR[3] = Header.Width & 0xFF;
+	IHDR[6] = Header.Height >> 8;
+	IHDR[7] = Header.Height & 0xFF;
+
+	_png_bytes(&Writer, Signature, 8);
+	size_t Chunk = _png_chunk_begin(&Writer, "IHDR");
+	_png_bytes(&Writer, IHDR, 13);
+	_png_chunk_end(&Writer, Chunk);
+
+	Chunk = _png_chunk_begin(&Writer, "PLTE");
+
+	for(int i = 0; i < Colors; i++){
+		_png_bytes(&Writer, &Palette[i], 3);
+	}
+
+	_png_chunk_end(&Writer, Chunk);
+
+	if(Alphas){
+		Chunk = _png_chunk_begin(&Writer, "tRNS");
+
+		for(int i = 0; i < Alphas; i++){
+			_png_bytes(&Writer, &Palette[i].rgba.a, 1);
+		}
+
+		_png_chunk_end(&Writer, Chunk);
+	}
+
+	// zlib header, then a single final deflate block with the fixed Huffman codes
+	Chunk = _png_chunk_begin(&Writer, "IDAT");
+	_png_bytes(&Writer, "\x78\x01", 2);
+	_png_bits(&Writer, 1, 1);
+	_png_bits(&Writer, 1, 2);
+
+	unsigned char *Row = Rows, *Previous = Rows + Width;
+	int Last = -1;
+	int Pending = kif_span_next(&Iter, &Span);
+
+	KIF_TRACE_BEGIN("kif_png_deflate");
+
+	for(int y = 0; y < Header.Height; y++){
+		unsigned char *Swap;
+
+		memset(Row, 0, Width);
+
+		while(Pending && Span.Y == y){
+			memset(Row + Span.X, Span.pID, Span.Length);
+			Pending = kif_span_next(&Iter, &Span);
+		}
+
+		_png_row(&Writer, Row, y > 0 ? Previous : NULL, Width, &Last);
+
+		Swap = Row;
+		Row = Previous;
+		Previous = Swap;
+	}
+
+	KIF_TRACE_END("kif_png_deflate");
+
+	_png_symbol(&Writer, 256);	// End of block
+	_png_bits(&Writer, 0, (8 - Writer.Count) & 7);
+
+	uint32_t Adler = (Writer.B << 16) | Writer.A;
+	_png_u32(&Writer, Adler);
+	_png_chunk_end(&Writer, Chunk);
+
+	Chunk = _png_chunk_begin(&Writer, "IEND");
+	_png_chunk_end(&Writer, Chunk);
+
+	free(Rows);
+
+	if(Writer.Failed){
+		free(Writer.Data);
+		return NULL;
+	}
+
+	*OutputLength = (int)Writer.Length;
+	return Writer.Data;
+}
+
+/**
+ * Write a .kif icon to a file as an indexed PNG, see kif_encode_png()
+ * @param Filename Path of the PNG file
+ * @param Data Pointer to .kif data
+ * @return int Returns the number of bytes written, 0 on failure
+*/
+int kif_write_png(const char *Filename, const void *Data){
+	int Size, Written = 0;
+	void *Encoded = kif_encode_png(Data, &Size);
+	FILE *OpenedFile = Encoded ? fopen(Filename, "wb") : NULL;
+
+	if(OpenedFile){
+		KIF_TRACE_BEGIN("kif_write_file");
+		Written = fwrite(Encoded, 1, Size, OpenedFile) == (size_t)Size;
+		Written &= fclose(OpenedFile) == 0;
+		KIF_TRACE_END("kif_write_file");
+	}
+
+	free(Encoded);
+	return Written ? Size : 0;
+}
+
+/* --- QOI transcoding --- */
+
+/**
+ * Convert a .kif icon to QOI (https://qoiformat.org/) in a single pass over its runs. Each run is one
+ * QOI_OP_INDEX/DIFF/LUMA/RGB/RGBA op for its first pixel followed by QOI_OP_RUN ops, no pixels are decoded.
+ * @param Data Pointer to .kif data
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to the QOI file data, needs to be free()d after use, or NULL on failure
+*/
+void *kif_to_qoi(const void *Data, int *OutputLength){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+	KIFHeader Header;
+
+	if(Data == NULL || OutputLength == NULL || !_kif_parse(Data, &Header, &Palette, &Runs)){
+		return NULL;
+	}
+
+	// At most one pixel op (5 bytes) and one RUN op per KIF run plus the uncovered tail, RUN ops for every 62 pixels
+	uint32_t Left = (uint32_t)Header.Width * Header.Height;
+	size_t Size = 14 + 8 + ((size_t)Header.RLEEntries + 1) * 6 + Left / 62 + 1;
+	unsigned char *Output = (unsigned char *)malloc(Size);
+
+	if(Output == NULL){
+		return NULL;
+	}
+
+	unsigned char *Out = Output;
+	kif_rgba_t Index[64];
+	kif_rgba_t Previous = { { 0, 0, 0, 255 } };
+	uint32_t Run = 0;
+
+	memset(Index, 0, sizeof(Index));
+	memcpy(Out, "qoif", 4);
+	Out = _qoi_write32(Out + 4, Header.Width);
+	Out = _qoi_write32(Out, Header.Height);
+	*Out++ = 4;		// RGBA
+	*Out++ = 0;		// sRGB with linear alpha
+
+	for(uint32_t i = 0; i <= Header.RLEEntries && Left > 0; i++){
+		kif_rgba_t Color;
+		uint32_t Length;
+
+		if(i < Header.RLEEntries){
+			Color = Palette[Runs[i].pID];
+			Length = Runs[i].rle < Left ? Runs[i].rle : Left;
+		}else{
+			Color.v = 0;	// Pixels the runs do not cover are transparent
+			Length = Left;
+		}
+
+		if(Length == 0){
+			continue;
+		}
+
+		Left -= Length;
+
+		if(Color.v != Previous.v){
+			Out = _qoi_write_run(Out, Run);
+			Out = _qoi_write_pixel(Out, Index, Previous, Color);
+			Previous = Color;
+			Run = 0;
+			Length--;
+		}
+
+		Run += Length;
+	}
+
+	Out = _qoi_write_run(Out, Run);
+	memcpy(Out, "\0\0\0\0\0\0\0\1", 8);	// End marker
+	Out += 8;
+
+	*OutputLength = (int)(Out - Output);
+	return Output;
+}
+
+/**
+ * Convert a QOI image to a .kif icon in a single pass over its ops. QOI_OP_RUN ops become KIF runs directly,
+ * the palette is built from the colors as they appear in the stream.
+ * @param Data Pointer to QOI file data
+ * @param Size Size of the QOI data in bytes
+ * @param OutputLength Pointer to an integer to store the output data length
+ * @return void Returns a pointer to the .kif icon data, or NULL if the image is invalid, larger than 65535
+ * pixels on a side or has more than 256 colors
+*/
+void *qoi_to_kif(const void *Data, int Size, int *OutputLength){
+	const unsigned char *Bytes = (const unsigned char *)Data;
+	_kif_run_writer Writer;
+	KIFHeader Header;
+
+	if(Data == NULL || OutputLength == NULL || Size < 14 + 8 || memcmp(Bytes, "qoif", 4) != 0){
+		return NULL;
+	}
+
+	uint32_t Width = _qoi_read32(Bytes + 4), Height = _qoi_read32(Bytes + 8);
+
+	if(Width == 0 || Height == 0 || Width > 65535 || Height > 65535){
+		return NULL;
+	}
+
+	kif_rgba_t Index[64];
+	kif_rgba_t Pixel = { { 0, 0, 0, 255 } };
+	uint32_t Left = Width * Height;
+	int Position = 14, End = Size - 8;
+
+	memset(Index, 0, sizeof(Index));
+	_kif_writer_init(&Writer);
+
+	while(Left > 0 && !Writer.Failed){
+		uint32_t Length = 1;
+		int Op = Position < End ? Bytes[Position++] : -1;
+
+		if(Op < 0){
+			Writer.Failed = 1;	// Truncated
+			break;
+		}
+
+		if(Op == 0xFE || Op == 0xFF){
+			int Channels = Op == 0xFE ? 3 : 4;
+
+			if(Position + Channels > End){
+				Writer.Failed = 1;
+				break;
+			}
+
+			memcpy(&Pixel, Bytes + Position, Channels);
+			Position += Channels;
+		}else if((Op >> 6) == 0){		// QOI_OP_INDEX
+			Pixel = Index[Op];
+		}else if((Op >> 6) == 1){		// QOI_OP_DIFF
+			Pixel.rgba.r += ((Op >> 4) & 3) - 2;
+			Pixel.rgba.g += ((Op >> 2) & 3) - 2;
+			Pixel.rgba.b += (Op & 3) - 2;
+		}else if((Op >> 6) == 2){		// QOI_OP_LUMA
+			if(Position >= End){
+				Writer.Failed = 1;
+				break;
+			}
+
+			int Green = (Op & 0x3F) - 32;
+			int Next = Bytes[Position++];
+
+			Pixel.rgba.r += Green - 8 + (Next >> 4);
+			Pixel.rgba.g += Green;
+			Pixel.rgba.b += Green - 8 + (Next & 0x0F);
+		}else{							// QOI_OP_RUN
+			Length = (Op & 0x3F) + 1;
+		}
+
+		Index[_qoi_hash(Pixel)] = Pixel;
+
+		if(Length > Left){
+			Length = Left;
+		}
+
+		_kif_writer_put(&Writer, Pixel, Length);
+		Left -= Length;
+	}
+
+	memset(&Header, 0, sizeof(KIFHeader));
+	Header.Width = Width;
+	Header.Height = Height;
+	return _kif_writer_finish(&Writer, &Header, OutputLength);
+}
+
+#endif
+
+#ifdef KIF_DISK_CACHE
+
+/* --- Decoded pixel cache --- */
+
+/*
+    A cache directory holds decoded icons as raw blobs named after the hash of the .kif file and the
+    output format ("<hash>-<bpp>.raw"), each starting with a KIFCacheBlob header. An index file maps
+    source paths to their mtime (in nanoseconds), size and hash, so a warm lookup is a stat() and an mmap().
+*/
+
+/**
+ * Open a decoded pixel cache, loading its index
+ * @param Cache Pointer to a KIFCache struct to fill
+ * @param CacheDir Path of an existing directory to keep the cache in
+ * @return int Returns 1 on success, 0 on failure
+*/
+int kif_cache_open(KIFCache *Cache, const char *CacheDir){
+	char Path[4096], Line[4096 + 64];
+	long long MTime, Size;
+	unsigned long long Hash;
+	int BPP, Offset;
+
+	memset(Cache, 0, sizeof(KIFCache));
+
+	if(snprintf(Cache->Dir, sizeof(Cache->Dir), "%s", CacheDir) >= (int)sizeof(Cache->Dir)){
+		return 0;
+	}
+
+	snprintf(Path, sizeof(Path), "%s/index", CacheDir);
+	FILE *Index = fopen(Path, "r");
+
+	if(!Index){
+		return 1;	// Empty cache
+	}
+
+	while(fgets(Line, sizeof(Line), Index)){
+		size_t Length = strlen(Line);
+
+		// A line longer than the buffer is skipped whole, its path cut short could match another file.
+		if(Length > 0 && Line[Length - 1] != '\n' && !feof(Index)){
+			int c;
+
+			while((c = fgetc(Index)) != EOF && c != '\n');
+			continue;
+		}
+
+		Line[strcspn(Line, "\n")] = 0;
+
+		if(sscanf(Line, "%lld %lld %llx %d %n", &MTime, &Size, &Hash, &BPP, &Offset) != 4 || Line[Offset] == 0){
+			break;
+		}
+
+		_kif_cache_entry *Entry = _cache_find(Cache, Line + Offset, BPP, 1);
+
+		if(Entry == NULL){
+			break;
+		}
+
+		Entry->MTime = MTime;
+		Entry->Size = Size;
+		Entry->Hash = Hash;
+	}
+
+	fclose(Index);
+	Cache->Dirty = 0;
+	return 1;
+}
+
+/**
+ * Get the decoded pixels of a .kif file, from the cache if the file has not changed since it was cached,
+ * otherwise by decoding it and storing the result for the next time.
+ * @param Cache Pointer to a KIFCache opened with kif_cache_open()
+ * @param Filename Path of the .kif file
+ * @param OutputBPP Set output bits per pixel
+ * @param Image Pointer to a KIFCachedImage struct to fill, release it with kif_cache_release()
+ * @return int Returns 1 on success, 0 on failure
+*/
+int kif_cache_read(KIFCache *Cache, const char *Filename, int OutputBPP, KIFCachedImage *Image){
+	struct stat Info;
+
+	memset(Image, 0, sizeof(KIFCachedImage));
+
+	if(stat(Filename, &Info) != 0 || (OutputBPP != 24 && OutputBPP != 32)){
+		return 0;
+	}
+
+	_kif_cache_entry *Entry = _cache_find(Cache, Filename, OutputBPP, 0);
+
+	// Warm path: the source is unchanged, map the blob and hand out a pointer into it.
+	if(Entry && Entry->MTime == _cache_mtime(&Info) && Entry->Size == (long long)Info.st_size && _cache_map(Cache, Entry->Hash, OutputBPP, Image)){
+		return 1;
+	}
+
+	int Size;
+	void *Data = _cache_read_file(Filename, &Size);
+
+	if(Data == NULL){
+		return 0;
+	}
+
+	uint64_t Hash = _kif_hash64(Data, Size);
+
+	Entry = _cache_find(Cache, Filename, OutputBPP, 1);
+
+	if(Entry){
+		Entry->MTime = _cache_mtime(&Info);
+		Entry->Size = Info.st_size;
+		Entry->Hash = Hash;
+		Cache->Dirty = 1;
+	}
+
+	// The file may only have been touched, or another file has the same content.
+	if(_cache_map(Cache, Hash, OutputBPP, Image)){
+		free(Data);
+		return 1;
+	}
+
+	Image->Pixels = kif_decode(Data, &Image->Header, OutputBPP);
+	free(Data);
+
+	if(Image->Pixels == NULL){
+		return 0;
+	}
+
+	_cache_store(Cache, Hash, OutputBPP, Image);
+	return 1;
+}
+
+/**
+ * Release the pixels returned by kif_cache_read()
+ * @param Image Pointer to a KIFCachedImage struct
+*/
+void kif_cache_release(KIFCachedImage *Image){
+	if(Image->Mapping){
+		munmap(Image->Mapping, Image->MappingSize);
+	}else{
+		free(Image->Pixels);
+	}
+
+	memset(Image, 0, sizeof(KIFCachedImage));
+}
+
+/**
+ * Write the index if it changed and free the cache
+ * @param Cache Pointer to a KIFCache opened with kif_cache_open()
+ * @return int Returns 1 on success, 0 if the index could not be written
+*/
+int kif_cache_close(KIFCache *Cache){
+	char Path[4096], Temp[4096];
+	int Result = 1;
+
+	if(Cache->Dirty){
+		snprintf(Path, sizeof(Path), "%s/index", Cache->Dir);
+		snprintf(Temp, sizeof(Temp), "%s/index.%ld", Cache->Dir, (long)getpid());
+
+		FILE *Index = fopen(Temp, "w");
+		Result = Index != NULL;
+
+		for(int i = 0; i < Cache->Count && Index; i++){
+			_kif_cache_entry *Entry = &Cache->Entries[i];
+
+			fprintf(Index, "%lld %lld %016llx %d %s\n", Entry->MTime, Entry->Size, (unsigned long long)Entry->Hash, Entry->BPP, Entry->Path);
+		}
+
+		// Written to a temporary file and renamed, so readers never see a half written index.
+		if(Index && (fclose(Index) != 0 || rename(Temp, Path) != 0)){
+			remove(Temp);
+			Result = 0;
+		}
+	}
+
+	for(int i = 0; i < Cache->Count; i++){
+		free(Cache->Entries[i].Path);
+	}
+
+	free(Cache->Entries);
+	memset(Cache, 0, sizeof(KIFCache));
+	return Result;
+}
+
+#endif
+
+/* --- Internal functions --- */
+
+#ifndef KIF_FREESTANDING
+
+/**
+ * Microseconds from a monotonic clock when the platform has one, processor time otherwise.
+ */
+static uint64_t _kif_microseconds(void){
+#ifdef CLOCK_MONOTONIC
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (uint64_t)Now.tv_sec * 1000000 + Now.tv_nsec / 1000;
+#else
+	return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+#endif
+
+/**
+ * Returns the offset of the palette, behind the chunk area if there is one.
+ */
+static unsigned int _kif_palette_offset(const unsigned char *data_bytes){
+	if(data_bytes[5] & KIF_FLAG_CHUNKS){
+		return sizeof(KIFHeader) + 4 + _read32bit(data_bytes + sizeof(KIFHeader));
+	}
+	return sizeof(KIFHeader);
+}
+
+#ifndef KIF_FREESTANDING
+
+/**
+ * Append a chunk (tag, length, payload padded to 4 bytes) to a chunk buffer.
+ */
+static int _kif_chunk_add(_kif_chunk_buffer *Chunks, const char *Tag, const void *Payload, int Length){
+	int Padded = (Length + 3) & ~3;
+
+	if(Chunks->Length + 8 + Padded > Chunks->Size){
+		int Size = (Chunks->Length + 8 + Padded) * 2;
+		unsigned char *Data = (unsigned char *)realloc(Chunks->Data, Size);
+
+		if(Data == NULL){
+			return 0;
+		}
+
+		Chunks->Data = Data;
+		Chunks->Size = Size;
+	}
+
+	uint32_t ChunkLength = Length;
+	unsigned char *Chunk = Chunks->Data + Chunks->Length;
+
+	memcpy(Chunk, Tag, 4);
+	memcpy(Chunk + 4, &ChunkLength, 4);
+	memcpy(Chunk + 8, Payload, Length);
+	memset(Chunk + 8 + Length, 0, Padded - Length);
+
+	Chunks->Length += 8 + Padded;
+	return 1;
+}
+
+#endif
+
+/**
+ * Read the 16 byte header of a .kif icon, without looking any further.
+ */
+static int _kif_read_header(const void *Data, KIFHeader *Header){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+
+	if(Data == NULL || _read32bit(data_bytes) != 0x6B696631){	// 'kif1'
+		return 0;
+	}
+
+	Header->Magic = _read32bit(data_bytes);
+	Header->BPP = data_bytes[4];
+	Header->Compressed = data_bytes[5];
+	Header->palEntries = _read16bit(data_bytes + 6);
+	Header->Width = _read16bit(data_bytes + 8);
+	Header->Height = _read16bit(data_bytes + 10);
+	Header->RLEEntries = _read32bit(data_bytes + 12);
+
+	return 1;
+}
+
+/**
+ * Read the header of a .kif icon and locate its palette and RLE data.
+ */
+static int _kif_parse(const void *Data, KIFHeader *Header, const kif_rgba_t **Palette, const kif_rle_t **Runs){
+	const unsigned char *data_bytes = (const unsigned char *)Data;
+
+	if(!_kif_read_header(Data, Header)){
+		return 0;
+	}
+
+	*Palette = (const kif_rgba_t *)(data_bytes + _kif_palette_offset(data_bytes));
+	*Runs = (const kif_rle_t *)((const unsigned char *)*Palette + Header->palEntries * sizeof(kif_rgba_t));
+
+	return 1;
+}
+
+/**
+ * Write Count pixels of one color in 24 or 32-bit format.
+ */
+static void _kif_fill(unsigned char *Pixel, kif_rgba_t Color, int Count, int BytesPerPixel){
+	if(BytesPerPixel == 4){
+		kif_rgba_t *Pixel32 = (kif_rgba_t *)Pixel;
+
+		for(int i = 0; i < Count; i++){
+			Pixel32[i] = Color;
+		}
+	}else{
+		for(int i = 0; i < Count; i++){
+			Pixel[i * 3] = Color.rgba.r;
+			Pixel[i * 3 + 1] = Color.rgba.g;
+			Pixel[i * 3 + 2] = Color.rgba.b;
+		}
+	}
+}
+
+/**
+ * Write Count pixels of one color as whole fixed-size blocks, writing up to 28 bytes past the last pixel.
+ */
+static void _kif_fill_blocks(unsigned char *Pixel, kif_rgba_t Color, int Count, int BytesPerPixel){
+#ifdef KIF_SSE2
+	if(BytesPerPixel == 4){
+		__m128i Block = _mm_set1_epi32((int)Color.v);
+
+		do{
+			_mm_storeu_si128((__m128i *)Pixel, Block);
+			_mm_storeu_si128((__m128i *)(Pixel + 16), Block);
+			Pixel += 32;
+			Count -= 8;
+		}while(Count > 0);
+	}else{
+		// 16 bytes of RGBRGB... hold 5 whole pixels, so two stores 15 bytes apart write 10 pixels.
+		uint64_t RGB = Color.rgba.r | (Color.rgba.g << 8) | ((uint64_t)Color.rgba.b << 16);
+		uint64_t Low = RGB | (RGB << 24) | (RGB << 48);
+		uint64_t High = (RGB >> 16) | (RGB << 8) | (RGB << 32) | (RGB << 56);
+		__m128i Block = _mm_set_epi64x((long long)High, (long long)Low);
+
+		do{
+			_mm_storeu_si128((__m128i *)Pixel, Block);
+			_mm_storeu_si128((__m128i *)(Pixel + 15), Block);
+			Pixel += 30;
+			Count -= 10;
+		}while(Count > 0);
+	}
+#else
+	if(BytesPerPixel == 4){
+		kif_rgba_t *Pixel32 = (kif_rgba_t *)Pixel;
+
+		do{
+			for(int i = 0; i < 8; i++){
+				Pixel32[i] = Color;
+			}
+
+			Pixel32 += 8;
+			Count -= 8;
+		}while(Count > 0);
+	}else{
+		do{
+			for(int i = 0; i < 8; i++){
+				Pixel[i * 3] = Color.rgba.r;
+				Pixel[i * 3 + 1] = Color.rgba.g;
+				Pixel[i * 3 + 2] = Color.rgba.b;
+			}
+
+			Pixel += 24;
+			Count -= 8;
+		}while(Count > 0);
+	}
+#endif
+}
+
+/**
+ * Expand RLE entries with the given palette into a caller provided buffer.
+ */
+static void _kif_decode_runs(const KIFHeader *Header, const kif_rgba_t *Palette, const kif_rle_t *Runs, unsigned char *Output, int Stride, int BytesPerPixel){
+	int Width = Header->Width, Height = Header->Height;
+	unsigned char *Row = Output;
+	int x = 0, y = 0;
+
+	if(Width == 0){
+		return;
+	}
+
+	// Runs are not aligned to rows, split them where a row ends. Pixels past the last row are dropped.
+	for(uint32_t i = 0; i < Header->RLEEntries && y < Height; i++){
+		kif_rgba_t Color = Palette[Runs[i].pID];
+		int RunLength = Runs[i].rle;
+
+		while(RunLength > 0 && y < Height){
+			int Length = RunLength < Width - x ? RunLength : Width - x;
+
+			_kif_fill(Row + x * BytesPerPixel, Color, Length, BytesPerPixel);
+
+			x += Length;
+			RunLength -= Length;
+
+			if(x == Width){
+				x = 0;
+				y++;
+				Row += Stride;
+			}
+		}
+	}
+
+	_kif_clear_rest(Row, x, y, Width, Height, Stride, BytesPerPixel);
+}
+
+/**
+ * Find and validate the VARS chunk. Returns the number of variants including the main palette, or 0 if Data is not
+ * a .kif icon. Chunk is set to NULL when the icon has no VARS chunk or it is too short for the names and palettes
+ * it claims, the icon then only has its main palette.
+ */
+static int _kif_variants(const void *Data, const unsigned char **Chunk){
+	int Length;
+
+	*Chunk = NULL;
+
+	if(Data == NULL || _read32bit((const unsigned char *)Data) != 0x6B696631){
+		return 0;
+	}
+
+	const unsigned char *Found = (const unsigned char *)kif_find_chunk(Data, "VARS", &Length);
+
+	if(Found == NULL || Length < 4){
+		return 1;
+	}
+
+	uint32_t Count = _read32bit(Found);
+	uint64_t Needed = 4 + (uint64_t)Count * KIF_VARIANT_NAME + (Count ? (uint64_t)(Count - 1) * _read16bit((const unsigned char *)Data + 6) * sizeof(kif_rgba_t) : 0);
+
+	if(Count == 0 || Needed > (uint64_t)Length){
+		return 1;
+	}
+
+	*Chunk = Found;
+	return (int)Count;
+}
+
+/**
+ * Zero the pixels from (x, y) to the end of the image, truncated run data decodes as transparent black.
+ * Row points at row y.
+ */
+static void _kif_clear_rest(unsigned char *Row, int x, int y, int Width, int Height, int Stride, int BytesPerPixel){
+	kif_rgba_t Zero;
+
+	Zero.v = 0;
+
+	for(; y < Height; y++, x = 0, Row += Stride){
+		_kif_fill(Row + x * BytesPerPixel, Zero, Width - x, BytesPerPixel);
+	}
+}
+
+/**
+ * kif_decode_padded() without the alignment checks, Output needs KIF_DECODE_SLACK bytes after the last row.
+ */
+static int _kif_decode_padded(const void *Data, KIFHeader *Header, unsigned char *Output, int Stride, int OutputBPP){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+
+	if(Output == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return 0;
+	}
+
+	int Width = Header->Width, Height = Header->Height;
+	int BytesPerPixel = OutputBPP / 8;
+	unsigned char *Row = Output;
+	int x = 0, y = 0;
+
+	if(Width == 0){
+		return 1;
+	}
+
+	// Rows are written in order, so a block running past the end of a row is overwritten by the next one.
+	for(uint32_t i = 0; i < Header->RLEEntries && y < Height; i++){
+		kif_rgba_t Color = Palette[Runs[i].pID];
+		int RunLength = Runs[i].rle;
+
+		while(RunLength > 0 && y < Height){
+			int Length = RunLength < Width - x ? RunLength : Width - x;
+
+			_kif_fill_blocks(Row + x * BytesPerPixel, Color, Length, BytesPerPixel);
+
+			x += Length;
+			RunLength -= Length;
+
+			if(x == Width){
+				x = 0;
+				y++;
+				Row += Stride;
+			}
+		}
+	}
+
+	_kif_clear_rest(Row, x, y, Width, Height, Stride, BytesPerPixel);
+	return 1;
+}
+
+/**
+ * Source-over blend of a non-premultiplied RGBA color onto another.
+ */
+static kif_rgba_t _kif_blend(kif_rgba_t Dst, kif_rgba_t Src){
+	if(Src.rgba.a == 255 || Dst.rgba.a == 0){
+		return Src.rgba.a ? Src : Dst;
+	}
+
+	if(Src.rgba.a == 0){
+		return Dst;
+	}
+
+	int DstWeight = Dst.rgba.a * (255 - Src.rgba.a);				// Scaled by 255
+	int Alpha = Src.rgba.a * 255 + DstWeight;						// Scaled by 255
+	kif_rgba_t Out;
+
+	Out.rgba.r = (Src.rgba.r * Src.rgba.a * 255 + Dst.rgba.r * DstWeight + Alpha / 2) / Alpha;
+	Out.rgba.g = (Src.rgba.g * Src.rgba.a * 255 + Dst.rgba.g * DstWeight + Alpha / 2) / Alpha;
+	Out.rgba.b = (Src.rgba.b * Src.rgba.a * 255 + Dst.rgba.b * DstWeight + Alpha / 2) / Alpha;
+	Out.rgba.a = (Alpha + 127) / 255;
+
+	return Out;
+}
+
+/**
+ * Return how many pixels of the current run are available (at most Max), loading the next entry if needed.
+ * Returns 0 when the stream is exhausted.
+ */
+static int _kif_cursor_peek(_kif_run_cursor *Cursor, int Max){
+	while(Cursor->Length == 0){
+		if(Cursor->Entries == 0){
+			return 0;
+		}
+
+		Cursor->pID = Cursor->Runs->pID;
+		Cursor->Length = Cursor->Runs->rle;
+		Cursor->Runs++;
+		Cursor->Entries--;
+	}
+
+	return Cursor->Length < Max ? Cursor->Length : Max;
+}
+
+/**
+ * Consume Count pixels from a run stream.
+ */
+static void _kif_cursor_skip(_kif_run_cursor *Cursor, int Count){
+	while(Count > 0){
+		int Length = _kif_cursor_peek(Cursor, Count);
+
+		if(Length == 0){
+			return;
+		}
+
+		Cursor->Length -= Length;
+		Count -= Length;
+	}
+}
+
+/**
+ * Alpha weighted average of the chroma of four palette entries, plain average when all of them are transparent.
+ */
+static _kif_yuv_t _kif_yuv_average(const _kif_yuv_t *Lut, int A, int B, int C, int D){
+	if(A == B && A == C && A == D){
+		return Lut[A];
+	}
+
+	const _kif_yuv_t *P[4] = { &Lut[A], &Lut[B], &Lut[C], &Lut[D] };
+	int Weight = 0, U = 0, V = 0;
+	_kif_yuv_t Out;
+
+	for(int i = 0; i < 4; i++){
+		Weight += P[i]->A;
+		U += P[i]->U * P[i]->A;
+		V += P[i]->V * P[i]->A;
+	}
+
+	if(Weight == 0){
+		Out.U = (uint8_t)((P[0]->U + P[1]->U + P[2]->U + P[3]->U + 2) / 4);
+		Out.V = (uint8_t)((P[0]->V + P[1]->V + P[2]->V + P[3]->V + 2) / 4);
+	}else{
+		Out.U = (uint8_t)((U + Weight / 2) / Weight);
+		Out.V = (uint8_t)((V + Weight / 2) / Weight);
+	}
+
+	Out.Y = 0;
+	Out.A = 0;
+	return Out;
+}
+
+/**
+ * Write Count chroma samples starting at Column of chroma row Row.
+ */
+static void _kif_yuv_put_chroma(const KIFYUVPlanes *Planes, int Row, int Column, int Count, _kif_yuv_t Chroma){
+	uint8_t *U = Planes->U + (size_t)Row * Planes->UStride;
+
+	if(Planes->Format == KIF_YUV_NV12){
+		for(int i = Column; i < Column + Count; i++){
+			U[i * 2] = Chroma.U;
+			U[i * 2 + 1] = Chroma.V;
+		}
+	}else{
+		uint8_t *V = Planes->V + (size_t)Row * Planes->VStride;
+
+		for(int i = Column; i < Column + Count; i++){
+			U[i] = Chroma.U;
+			V[i] = Chroma.V;
+		}
+	}
+}
+
+#ifndef KIF_FREESTANDING
+
+/**
+ * kif_decode() without the limits, the output is Width * Height pixels with KIF_DECODE_SLACK bytes to spare.
+ */
+static void *_kif_decode(const void *Data, KIFHeader *Header, int OutputBPP){
+	const kif_rgba_t *Palette;
+	const kif_rle_t *Runs;
+
+	if(Data == NULL || Header == NULL || (OutputBPP != 24 && OutputBPP != 32) || !_kif_parse(Data, Header, &Palette, &Runs)){
+		return NULL;
+	}
+
+	// Allocate memory for pixel buffer / decoded image, with slack so runs can be written as whole blocks.
+	// Sized in size_t, 65535 x 65535 pixels overflow an int.
+	size_t Stride = (size_t)Header->Width * (OutputBPP / 8);
+	unsigned char *Decoded = (unsigned char *)malloc(Stride * Header->Height + KIF_DECODE_SLACK);
+
+	if(Decoded == NULL){
+		return NULL;
+	}
+
+	KIF_TRACE_BEGIN("kif_decode");
+	_kif_decode_padded(Data, Header, Decoded, (int)Stride, OutputBPP);
+	KIF_TRACE_END("kif_decode");
+
+	return Decoded;
+}
+
+static void _kif_writer_init(_kif_run_writer *Writer){
+	memset(Writer, 0, sizeof(_kif_run_writer));
+
+	for(int i = 0; i < 1024; i++){
+		Writer->Slots[i] = -1;
+	}
+}
+
+/**
+ * Returns the hash slot of Color, either holding its palette index or the empty slot it would go in.
+ */
+static uint32_t _kif_writer_slot(const _kif_run_writer *Writer, kif_rgba_t Color){
+	uint32_t Slot = (Color.v * 2654435761u) >> 22;	// Fibonacci hash into 1024 slots
+
+	while(Writer->Slots[Slot] >= 0 && Writer->Palette[Writer->Slots[Slot]].v != Color.v){
+		Slot = (Slot + 1) & 1023;
+	}
+
+	return Slot;
+}
+
+/**
+ * Append Length pixels of Color, adding the color to the palette on first use and merging with the previous run.
+ */
+static void _kif_writer_put(_kif_run_writer *Writer, kif_rgba_t Color, int Length){
+	uint32_t Slot = _kif_writer_slot(Writer, Color);
+
+	if(Writer->Slots[Slot] < 0){
+		if(Writer->Colors == 256){	// kif_rle_t can only address 256 palette entries
+			Writer->Failed = 1;
+			return;
+		}
+
+		Writer->Palette[Writer->Colors] = Color;
+		Writer->Slots[Slot] = Writer->Colors++;
+	}
+
+	int pID = Writer->Slots[Slot];
+
+	while(Length > 0){
+		if(Writer->Count > 0 && Writer->Runs[Writer->Count - 1].pID == pID && Writer->Runs[Writer->Count - 1].rle < 255){
+			int Room = 255 - Writer->Runs[Writer->Count - 1].rle;
+			int Add = Length < Room ? Length : Room;
+
+			Writer->Runs[Writer->Count - 1].rle += Add;
+			Length -= Add;
+			continue;
+		}
+
+		if(Writer->Count == Writer->Size){
+			int Size = Writer->Size ? Writer->Size * 2 : 1024;
+			kif_rle_t *Runs = (kif_rle_t *)realloc(Writer->Runs, Size * sizeof(kif_rle_t));
+
+			if(Runs == NULL){
+				Writer->Failed = 1;
+				return;
+			}
+
+			Writer->Runs = Runs;
+			Writer->Size = Size;
+		}
+
+		Writer->Runs[Writer->Count].pID = pID;
+		Writer->Runs[Writer->Count].rle = 0;
+		Writer->Count++;
+	}
+}
+
+/**
+ * Build the final .kif buffer from a run writer and free its run buffer.
+ */
+static void *_kif_writer_finish(_kif_run_writer *Writer, KIFHeader *Header, int *OutputLength){
+	void *OutputBuffer = NULL;
+
+	if(!Writer->Failed){
+		OutputBuffer = _kif_assemble(Header, NULL, Writer->Palette, Writer->Colors, Writer->Runs, Writer->Count, OutputLength);
+	}
+
+	free(Writer->Runs);
+	return OutputBuffer;
+}
+
+/**
+ * Convert 32-bit RGBA pixels to floats with the color premultiplied by alpha (all channels 0 - 255).
+ */
+static void _kif_premultiply(const uint32_t *Pixels, size_t Count, float *Output){
+	for(size_t i = 0; i < Count; i++){
+		kif_rgba_t Color;
+		Color.v = Pixels[i];
+
+		float Alpha = Color.rgba.a * (1.0f / 255.0f);
+
+		Output[i * 4 + 0] = Color.rgba.r * Alpha;
+		Output[i * 4 + 1] = Color.rgba.g * Alpha;
+		Output[i * 4 + 2] = Color.rgba.b * Alpha;
+		Output[i * 4 + 3] = Color.rgba.a;
+	}
+}
+
+/**
+ * Acc += Source * Weight over Count floats, Count is a multiple of 4.
+ */
+static void _kif_scale_add(float *Acc, const float *Source, float Weight, int Count){
+#ifdef KIF_SSE2
+	__m128 W = _mm_set1_ps(Weight);
+
+	for(int i = 0; i < Count; i += 4){
+		_mm_storeu_ps(Acc + i, _mm_add_ps(_mm_loadu_ps(Acc + i), _mm_mul_ps(_mm_loadu_ps(Source + i), W)));
+	}
+#else
+	for(int i = 0; i < Count; i++){
+		Acc[i] += Source[i] * Weight;
+	}
+#endif
+}
+
+/**
+ * Box filter premultiplied pixels into 32-bit RGBA, horizontally first and then vertically. Output pixel x covers
+ * [x * Width, (x + 1) * Width) in units of 1 / OutputWidth source pixels, so all weights are exact overlaps.
+ */
+static int _kif_resample(const float *Source, int Width, int Height, uint32_t *Output, int OutputWidth, int OutputHeight){
+	float *Columns = (float *)calloc((size_t)OutputWidth * Height * 4, sizeof(float));
+	float *Row = (float *)malloc((size_t)OutputWidth * 4 * sizeof(float));
+
+	if(Columns == NULL || Row == NULL){
+		free(Columns);
+		free(Row);
+		return 0;
+	}
+
+	for(int y = 0; y < Height; y++){
+		const float *Line = Source + (size_t)y * Width * 4;
+		float *Column = Columns + (size_t)y * OutputWidth * 4;
+
+		for(int x = 0; x < OutputWidth; x++){
+			int64_t Start = (int64_t)x * Width, End = Start + Width;
+
+			for(int64_t i = Start / OutputWidth; i * OutputWidth < End; i++){
+				int64_t Low = Start > i * OutputWidth ? Start : i * OutputWidth;
+				int64_t High = End < (i + 1) * OutputWidth ? End : (i + 1) * OutputWidth;
+
+				_kif_scale_add(Column + x * 4, Line + i * 4, (float)(High - Low) / Width, 4);
+			}
+		}
+	}
+
+	for(int y = 0; y < OutputHeight; y++){
+		int64_t Start = (int64_t)y * Height, End = Start + Height;
+
+		memset(Row, 0, (size_t)OutputWidth * 4 * sizeof(float));
+
+		for(int64_t i = Start / OutputHeight; i * OutputHeight < End; i++){
+			int64_t Low = Start > i * OutputHeight ? Start : i * OutputHeight;
+			int64_t High = End < (i + 1) * OutputHeight ? End : (i + 1) * OutputHeight;
+
+			_kif_scale_add(Row, Columns + (size_t)i * OutputWidth * 4, (float)(High - Low) / Height, OutputWidth * 4);
+		}
+
+		// Back to straight alpha, fully transparent pixels become transparent black
+		for(int x = 0; x < OutputWidth; x++){
+			const float *Pixel = Row + x * 4;
+			kif_rgba_t Color;
+
+			Color.v = 0;
+
+			if(Pixel[3] >= 0.5f){
+				float Scale = 255.0f / Pixel[3];
+
+				Color.rgba.r = (unsigned char)(Pixel[0] * Scale > 254.5f ? 255 : (int)(Pixel[0] * Scale + 0.5f));
+				Color.rgba.g = (unsigned char)(Pixel[1] * Scale > 254.5f ? 255 : (int)(Pixel[1] * Scale + 0.5f));
+				Color.rgba.b = (unsigned char)(Pixel[2] * Scale > 254.5f ? 255 : (int)(Pixel[2] * Scale + 0.5f));
+				Color.rgba.a = (unsigned char)(Pixel[3] > 254.5f ? 255 : (int)(Pixel[3] + 0.5f));
+			}
+
+			Output[(size_t)y * OutputWidth + x] = Color.v;
+		}
+	}
+
+	free(Columns);
+	free(Row);
+	return 1;
+}
+
+/**
+ * Reduce resampled pixels to transparent black and at most 255 other colors, what fits a .kif palette.
+ * Colors of the master (Shared) are kept first, then the most frequent new colors, and every other color
+ * is replaced by the nearest kept color.
+ */
+static int _kif_quantize(uint32_t *Pixels, size_t Count, const _kif_run_writer *Shared){
+	int Bits = 10;
+
+	while(((size_t)1 << Bits) < Count * 2){
+		Bits++;
+	}
+
+	size_t Slots = (size_t)1 << Bits;
+	_kif_color_count *Table = (_kif_color_count *)calloc(Slots, sizeof(_kif_color_count));
+	_kif_color_count *Distinct = (_kif_color_count *)malloc(Count * sizeof(_kif_color_count));
+	_kif_run_writer *Colors = (_kif_run_writer *)malloc(sizeof(_kif_run_writer));
+	int NumberOfColors = 0, Others = 0;
+
+	if(Table == NULL || Distinct == NULL || Colors == NULL){
+		free(Table);
+		free(Distinct);
+		free(Colors);
+		return 0;
+	}
+
+	// Count is 0 for empty slots, every used slot has counted at least one pixel. The high bits of a
+	// 64-bit Fibonacci hash pick the slot, the low bits of nearby colors would pile up in a few slots.
+	for(size_t i = 0; i < Count; i++){
+		size_t Slot = (size_t)((Pixels[i] * 0x9E3779B97F4A7C15ull) >> (64 - Bits));
+
+		while(Table[Slot].Count && Table[Slot].Color.v != Pixels[i]){
+			Slot = (Slot + 1) & (Slots - 1);
+		}
+
+		Table[Slot].Color.v = Pixels[i];
+		Table[Slot].Count++;
+	}
+
+	for(size_t Slot = 0; Slot < Slots; Slot++){
+		if(Table[Slot].Count){
+			Distinct[NumberOfColors] = Table[Slot];
+
+			if(Shared->Slots[_kif_writer_slot(Shared, Table[Slot].Color)] >= 0){
+				Distinct[NumberOfColors].Count += (uint32_t)Count;
+			}
+
+			Others += Table[Slot].Color.v != 0;
+			NumberOfColors++;
+		}
+	}
+
+	// kif_encode() always puts transparent black in palette entry 0
+	if(Others > 255){
+		kif_rgba_t Transparent;
+
+		Transparent.v = 0;
+		qsort(Distinct, NumberOfColors, sizeof(_kif_color_count), _compare_color_count);
+		_kif_writer_init(Colors);
+		_kif_writer_put(Colors, Transparent, 0);
+
+		for(int i = 0; Colors->Colors < 256; i++){
+			_kif_writer_put(Colors, Distinct[i].Color, 0);
+		}
+
+		// Every distinct color is mapped once, the pixels then only look their color up again.
+		for(size_t Slot = 0; Slot < Slots; Slot++){
+			kif_rgba_t Color = Table[Slot].Color;
+
+			Table[Slot].Mapped = Color;
+
+			if(Table[Slot].Count == 0 || Colors->Slots[_kif_writer_slot(Colors, Color)] >= 0){
+				continue;
+			}
+
+			int BestDistance = 0x7FFFFFFF;
+
+			for(int c = 0; c < 256; c++){
+				const kif_rgba_t *Entry = &Colors->Palette[c];
+				int R = Entry->rgba.r - Color.rgba.r, G = Entry->rgba.g - Color.rgba.g;
+				int B = Entry->rgba.b - Color.rgba.b, A = Entry->rgba.a - Color.rgba.a;
+				int Distance = R * R + G * G + B * B + A * A;
+
+				if(Distance < BestDistance){
+					Table[Slot].Mapped = *Entry;
+					BestDistance = Distance;
+				}
+			}
+		}
+
+		for(size_t i = 0; i < Count; i++){
+			size_t Slot = (size_t)((Pixels[i] * 0x9E3779B97F4A7C15ull) >> (64 - Bits));
+
+			while(Table[Slot].Color.v != Pixels[i]){
+				Slot = (Slot + 1) & (Slots - 1);
+			}
+
+			Pixels[i] = Table[Slot].Mapped.v;
+		}
+	}
+
+	free(Table);
+	free(Distinct);
+	free(Colors);
+	return 1;
+}
+
+/**
+ * qsort callback, sorts colors by descending pixel count.
+ */
+static int _compare_color_count(const void *A, const void *B){
+	uint32_t CountA = ((const _kif_color_count *)A)->Count, CountB = ((const _kif_color_count *)B)->Count;
+
+	return CountA < CountB ? 1 : (CountA > CountB ? -1 : 0);
+}
+
+/**
+ * Walk two RLE streams in lockstep, one row segment at a time, and fill Diff. With a writer every segment is also
+ * written to it as a mask. Pixels missing from a short stream count as transparent black, pixels with alpha 0 in
+ * both icons are equal.
+ */
+static int _kif_diff(const void *A, const void *B, KIFDiff *Diff, _kif_run_writer *Writer){
+	KIFHeader HeaderA, HeaderB;
+	const kif_rgba_t *PaletteA, *PaletteB;
+	const kif_rle_t *RunsA, *RunsB;
+
+	if(Diff == NULL || !_kif_parse(A, &HeaderA, &PaletteA, &RunsA) || !_kif_parse(B, &HeaderB, &PaletteB, &RunsB) ||
+		HeaderA.Width != HeaderB.Width || HeaderA.Height != HeaderB.Height){
+		return 0;
+	}
+
+	memset(Diff, 0, sizeof(KIFDiff));
+	Diff->Width = HeaderA.Width;
+	Diff->Height = HeaderA.Height;
+
+	int Width = HeaderA.Width, Height = HeaderA.Height;
+
+	// Same palette and the same runs, the chunks may still differ
+	if(Writer == NULL && HeaderA.palEntries == HeaderB.palEntries && HeaderA.RLEEntries == HeaderB.RLEEntries &&
+		memcmp(PaletteA, PaletteB, HeaderA.palEntries * sizeof(kif_rgba_t) + HeaderA.RLEEntries * sizeof(kif_rle_t)) == 0){
+		return 1;
+	}
+
+	_kif_run_cursor CursorA = { RunsA, HeaderA.RLEEntries, 0, 0 };
+	_kif_run_cursor CursorB = { RunsB, HeaderB.RLEEntries, 0, 0 };
+	kif_rgba_t Changed, Unchanged;
+	int Left = Width, Top = Height, Right = 0, Bottom = 0;
+
+	Changed.v = 0;
+	Changed.rgba.r = Changed.rgba.b = Changed.rgba.a = 255;
+	Unchanged.v = 0;
+
+	for(int y = 0; y < Height; y++){
+		int x = 0;
+
+		while(x < Width){
+			int LengthA = _kif_cursor_peek(&CursorA, Width - x);
+			int LengthB = _kif_cursor_peek(&CursorB, Width - x);
+			int Length = Width - x;
+			kif_rgba_t ColorA, ColorB;
+
+			ColorA.v = LengthA ? PaletteA[CursorA.pID].v : 0;
+			ColorB.v = LengthB ? PaletteB[CursorB.pID].v : 0;
+			Length = LengthA && LengthA < Length ? LengthA : Length;
+			Length = LengthB && LengthB < Length ? LengthB : Length;
+
+			// Fully transparent pixels are equal whatever color they carry
+			int Differs = ColorA.v != ColorB.v && (ColorA.rgba.a != 0 || ColorB.rgba.a != 0);
+
+			if(Differs){
+				int Delta[4] = {
+					abs(ColorA.rgba.r - ColorB.rgba.r), abs(ColorA.rgba.g - ColorB.rgba.g),
+					abs(ColorA.rgba.b - ColorB.rgba.b), abs(ColorA.rgba.a - ColorB.rgba.a)
+				};
+
+				for(int c = 0; c < 4; c++){
+					Diff->MaxDelta = Delta[c] > Diff->MaxDelta ? Delta[c] : Diff->MaxDelta;
+				}
+
+				Diff->Pixels += Length;
+				Left = x < Left ? x : Left;
+				Right = x + Length > Right ? x + Length : Right;
+				Top = y < Top ? y : Top;
+				Bottom = y + 1;
+			}
+
+			if(Writer){
+				_kif_writer_put(Writer, Differs ? Changed : Unchanged, Length);
+			}
+
+			_kif_cursor_skip(&CursorA, Length);
+			_kif_cursor_skip(&CursorB, Length);
+			x += Length;
+		}
+	}
+
+	if(Diff->Pixels){
+		Diff->Bounds.X = Left;
+		Diff->Bounds.Y = Top;
+		Diff->Bounds.Width = Right - Left;
+		Diff->Bounds.Height = Bottom - Top;
+	}
+
+	return Writer == NULL || !Writer->Failed;
+}
+
+/**
+ * Fill in the header and concatenate header, palette and RLE data into a new buffer.
+ */
+static void *_kif_assemble(KIFHeader *Header, const _kif_chunk_buffer *Chunks, const kif_rgba_t *Palette, int NumberOfColors, const kif_rle_t *Runs, int NumberOfRuns, int *OutputLength){
+	int ChunkArea = (Chunks && Chunks->Length > 0) ? 4 + Chunks->Length : 0;
+
+	Header->Magic = 0x6B696631;	// 'kif1'
+	Header->BPP = 4;
+	Header->Compressed = ChunkArea ? (Header->Compressed | KIF_FLAG_CHUNKS) : (Header->Compressed & ~KIF_FLAG_CHUNKS);
+	Header->palEntries = NumberOfColors;
+	Header->RLEEntries = NumberOfRuns;
+
+	int PaletteOffset = sizeof(KIFHeader) + ChunkArea;
+	int TotalSize = PaletteOffset + (sizeof(kif_rgba_t) * NumberOfColors) + (NumberOfRuns * sizeof(kif_rle_t));
+	unsigned char *OutputBuffer = (unsigned char *)malloc(TotalSize);
+
+	if(OutputBuffer == NULL){
+		return NULL;
+	}
+
+	memcpy(OutputBuffer, Header, sizeof(KIFHeader));
+
+	if(ChunkArea){
+		uint32_t ChunkBytes = Chunks->Length;
+
+		memcpy(OutputBuffer + sizeof(KIFHeader), &ChunkBytes, 4);
+		memcpy(OutputBuffer + sizeof(KIFHeader) + 4, Chunks->Data, Chunks->Length);
+	}
+
+	memcpy(OutputBuffer + PaletteOffset, Palette, sizeof(kif_rgba_t) * NumberOfColors);
+	memcpy(OutputBuffer + PaletteOffset + (sizeof(kif_rgba_t) * NumberOfColors), Runs, NumberOfRuns * sizeof(kif_rle_t));
+
+	*OutputLength = TotalSize;
+	return OutputBuffer;
+}
+
+/**
+ * Build the PREV chunk: the average color of the icon followed by a 4x4 preview, every cell the alpha weighted
+ * average of the pixels it covers. Cells left empty by icons narrower or lower than 4 pixels copy a neighbour.
+ */
+static int _placeholder(const kif_rgba_t *Palette, const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, _kif_chunk_buffer *Chunks){
+	_kif_run_cursor Cursor = { Runs, (uint32_t)NumberOfRuns, 0, 0 };
+	uint64_t Sums[17][5] = {{ 0 }};		// Per cell and for the whole icon: r * a, g * a, b * a, a, pixels
+	kif_rgba_t Payload[17];
+
+	for(int y = 0; y < Height; y++){
+		int Row = y * 4 / Height * 4, x = 0;
+
+		while(x < Width){
+			int Length = _kif_cursor_peek(&Cursor, Width - x);
+
+			if(Length == 0){
+				break;
+			}
+
+			kif_rgba_t Color = Palette[Cursor.pID];
+
+			_kif_cursor_skip(&Cursor, Length);
+
+			// Split the run where it crosses into the next cell
+			while(Length > 0){
+				int Column = x * 4 / Width, Next = ((Column + 1) * Width + 3) / 4;
+				int Count = Length < Next - x ? Length : Next - x;
+				uint64_t *Cell = Sums[1 + Row + Column];
+
+				Cell[0] += (uint64_t)Color.rgba.r * Color.rgba.a * Count;
+				Cell[1] += (uint64_t)Color.rgba.g * Color.rgba.a * Count;
+				Cell[2] += (uint64_t)Color.rgba.b * Color.rgba.a * Count;
+				Cell[3] += (uint64_t)Color.rgba.a * Count;
+				Cell[4] += Count;
+
+				x += Count;
+				Length -= Count;
+			}
+		}
+	}
+
+	for(int Cell = 1; Cell < 17; Cell++){
+		for(int c = 0; c < 5; c++){
+			Sums[0][c] += Sums[Cell][c];
+		}
+	}
+
+	for(int Cell = 0; Cell < 17; Cell++){
+		const uint64_t *Sum = Sums[Cell];
+
+		if(Cell > 0 && Sum[4] == 0){
+			int Row = (Cell - 1) / 4, Column = (Cell - 1) % 4;
+
+			Sum = Sums[1 + (Row * Height / 4) * 4 / Height * 4 + (Column * Width / 4) * 4 / Width];
+		}
+
+		Payload[Cell].v = 0;
+
+		if(Sum[3] > 0){
+			Payload[Cell].rgba.r = (unsigned char)((Sum[0] + Sum[3] / 2) / Sum[3]);
+			Payload[Cell].rgba.g = (unsigned char)((Sum[1] + Sum[3] / 2) / Sum[3]);
+			Payload[Cell].rgba.b = (unsigned char)((Sum[2] + Sum[3] / 2) / Sum[3]);
+			Payload[Cell].rgba.a = (unsigned char)((Sum[3] + Sum[4] / 2) / Sum[4]);
+		}
+	}
+
+	return _kif_chunk_add(Chunks, "PREV", Payload, sizeof(Payload));
+}
+
+/**
+ * Build the PROG chunk: a 1/4 resolution layer sampled from the middle of every 4x4 block, stored as
+ * width, height, number of entries and RLE entries that index the main palette.
+ */
+static int _progressive_layer(const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, _kif_chunk_buffer *Chunks){
+	_kif_run_cursor Cursor = { Runs, (uint32_t)NumberOfRuns, 0, 0 };
+	int LayerWidth = (Width + 3) / 4, LayerHeight = (Height + 3) / 4;
+	unsigned char *Layer = (unsigned char *)malloc(8 + LayerWidth * LayerHeight * sizeof(kif_rle_t));
+	uint32_t Count = 0;
+
+	if(Layer == NULL){
+		return 0;
+	}
+
+	kif_rle_t *LayerRuns = (kif_rle_t *)(Layer + 8);
+
+	for(int y = 0, Pos = 0; y < LayerHeight; y++){
+		int SampleRow = y * 4 + 2 < Height ? y * 4 + 2 : Height - 1;
+
+		for(int x = 0; x < LayerWidth; x++){
+			int Sample = SampleRow * Width + (x * 4 + 2 < Width ? x * 4 + 2 : Width - 1);
+
+			_kif_cursor_skip(&Cursor, Sample - Pos);
+			Pos = Sample;
+
+			int pID = _kif_cursor_peek(&Cursor, 1) ? Cursor.pID : 0;
+
+			if(Count > 0 && LayerRuns[Count - 1].pID == pID && LayerRuns[Count - 1].rle < 255){
+				LayerRuns[Count - 1].rle++;
+			}else{
+				LayerRuns[Count].pID = pID;
+				LayerRuns[Count].rle = 1;
+				Count++;
+			}
+		}
+	}
+
+	uint16_t Size[2] = { (uint16_t)LayerWidth, (uint16_t)LayerHeight };
+
+	memcpy(Layer, Size, 4);
+	memcpy(Layer + 4, &Count, 4);
+
+	int Result = _kif_chunk_add(Chunks, "PROG", Layer, 8 + Count * sizeof(kif_rle_t));
+
+	free(Layer);
+	return Result;
+}
+
+/**
+ * Stable reorder of a palette into [fully transparent | fully opaque | translucent], Remap receives the new index of every old entry.
+ */
+static int _order_palette(kif_rgba_t *Palette, int NumberOfColors, int *OpaqueStart, int *TranslucentStart, uint8_t *Remap){
+	kif_rgba_t *Ordered = (kif_rgba_t *)malloc(NumberOfColors * sizeof(kif_rgba_t));
+	int Count = 0;
+
+	if(Ordered == NULL){
+		return 0;
+	}
+
+	for(int i = 0; i < NumberOfColors; i++){
+		if(Palette[i].rgba.a == 0){
+			Remap[i] = Count;
+			Ordered[Count++] = Palette[i];
+		}
+	}
+
+	*OpaqueStart = Count;
+
+	for(int i = 0; i < NumberOfColors; i++){
+		if(Palette[i].rgba.a == 255){
+			Remap[i] = Count;
+			Ordered[Count++] = Palette[i];
+		}
+	}
+
+	*TranslucentStart = Count;
+
+	for(int i = 0; i < NumberOfColors; i++){
+		if(Palette[i].rgba.a != 0 && Palette[i].rgba.a != 255){
+			Remap[i] = Count;
+			Ordered[Count++] = Palette[i];
+		}
+	}
+
+	memcpy(Palette, Ordered, NumberOfColors * sizeof(kif_rgba_t));
+	free(Ordered);
+	return 1;
+}
+
+/**
+ * Find rectangles of fully opaque pixels in RLE data. Opaque spans of each row are merged with an identical
+ * span in the row above, the KIF_MAX_OPAQUE_RECTS largest rectangles are returned sorted by area.
+ */
+static int _opaque_rects(const kif_rgba_t *Palette, const kif_rle_t *Runs, int NumberOfRuns, int Width, int Height, KIFRect *Rects){
+	_kif_run_cursor Cursor = { Runs, (uint32_t)NumberOfRuns, 0, 0 };
+	int MaxOpen = Width / KIF_MIN_OPAQUE_SPAN + 1;
+	int *Open = (int *)malloc(MaxOpen * 2 * sizeof(int));		// Rectangles touching the previous and current row, sorted by X
+	KIFRect *All = NULL;
+	int Count = 0, Size = 0, OpenCount = 0;
+
+	if(Open == NULL){
+		return 0;
+	}
+
+	for(int y = 0; y < Height; y++){
+		int *Previous = Open + (y & 1) * MaxOpen, *Current = Open + !(y & 1) * MaxOpen;
+		int CurrentCount = 0, Pos = 0;
+
+		for(int x = 0; x < Width;){
+			int SpanStart = -1;
+
+			while(x < Width){
+				int Length = _kif_cursor_peek(&Cursor, Width - x);
+
+				if(Length == 0){
+					x = Width;	// Truncated data, treat the rest as transparent
+					break;
+				}
+
+				if(Palette[Cursor.pID].rgba.a == 255){
+					SpanStart = SpanStart < 0 ? x : SpanStart;
+				}else if(SpanStart >= 0){
+					break;
+				}
+
+				_kif_cursor_skip(&Cursor, Length);
+				x += Length;
+			}
+
+			if(SpanStart < 0 || x - SpanStart < KIF_MIN_OPAQUE_SPAN){
+				continue;
+			}
+
+			while(Pos < OpenCount && All[Previous[Pos]].X < SpanStart){
+				Pos++;
+			}
+
+			if(Pos < OpenCount && All[Previous[Pos]].X == SpanStart && All[Previous[Pos]].Width == x - SpanStart){
+				All[Previous[Pos]].Height++;
+				Current[CurrentCount++] = Previous[Pos++];
+				continue;
+			}
+
+			if(Count == Size){
+				Size = Size ? Size * 2 : 64;
+				KIFRect *Grown = (KIFRect *)realloc(All, Size * sizeof(KIFRect));
+
+				if(Grown == NULL){
+					free(All);
+					free(Open);
+					return 0;
+				}
+
+				All = Grown;
+			}
+
+			All[Count].X = SpanStart;
+			All[Count].Y = y;
+			All[Count].Width = x - SpanStart;
+			All[Count].Height = 1;
+			Current[CurrentCount++] = Count++;
+		}
+
+		OpenCount = CurrentCount;
+	}
+
+	if(Count > 0){
+		qsort(All, Count, sizeof(KIFRect), _compare_rect_area);
+	}
+
+	Count = Count > KIF_MAX_OPAQUE_RECTS ? KIF_MAX_OPAQUE_RECTS : Count;
+
+	if(Count > 0){
+		memcpy(Rects, All, Count * sizeof(KIFRect));
+	}
+
+	free(All);
+	free(Open);
+	return Count;
+}
+
+/**
+ * qsort callback, sorts rectangles by area, largest first.
+ */
+static int _compare_rect_area(const void *A, const void *B){
+	const KIFRect *RA = (const KIFRect *)A, *RB = (const KIFRect *)B;
+	long AreaA = (long)RA->Width * RA->Height, AreaB = (long)RB->Width * RB->Height;
+
+	return AreaA < AreaB ? 1 : AreaA > AreaB ? -1 : 0;
+}
+
+/**
+ * Read the header and current index generation of an open pack. The index needs to be free()d after use.
+ */
+static int _pack_read_index(FILE *Pack, KIFPackHeader *Header, KIFPackEntry **Index){
+	if(_kif_fseek(Pack, 0, SEEK_SET) != 0 || fread(Header, 1, sizeof(KIFPackHeader), Pack) != sizeof(KIFPackHeader) || Header->Magic != 0x6B696670){
+		return 0;
+	}
+
+	// Always allocate at least one entry so an empty pack still returns a valid pointer.
+	*Index = (KIFPackEntry *)malloc((Header->IndexEntries + 1) * sizeof(KIFPackEntry));
+
+	if(*Index == NULL){
+		return 0;
+	}
+
+	if(_kif_fseek(Pack, Header->IndexOffset, SEEK_SET) != 0 || fread(*Index, sizeof(KIFPackEntry), Header->IndexEntries, Pack) != Header->IndexEntries){
+		free(*Index);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Binary search for a name in a sorted pack index. Returns the position of the entry,
+ * or the position where it would have to be inserted if it is not found.
+ */
+static int _pack_find_entry(const KIFPackEntry *Index, int Entries, const char *Name, int *Found){
+	int Low = 0, High = Entries;
+
+	while(Low < High){
+		int Mid = (Low + High) / 2;
+		int Cmp = strncmp(Index[Mid].Name, Name, sizeof(Index[Mid].Name));
+
+		if(Cmp == 0){
+			*Found = 1;
+			return Mid;
+		}else if(Cmp < 0){
+			Low = Mid + 1;
+		}else{
+			High = Mid;
+		}
+	}
+
+	*Found = 0;
+	return Low;
+}
+
+/**
+ * Split a pack entry name "<context>/<size>[@<scale>]/<name>" into the key "<context>/<name>", size and scale.
+ */
+static int _theme_parse_name(const char *Name, char *Key, int *Size, int *Scale){
+	const char *Slash = strchr(Name, '/');
+	char *End;
+
+	if(Slash == NULL || Slash[1] < '0' || Slash[1] > '9'){
+		return 0;
+	}
+
+	*Size = strtol(Slash + 1, &End, 10);
+	*Scale = 1;
+
+	if(*End == '@'){
+		*Scale = strtol(End + 1, &End, 10);
+	}
+
+	if(*End != '/' || End[1] == 0 || *Size <= 0 || *Scale <= 0 || *Scale > 255){
+		return 0;
+	}
+
+	memcpy(Key, Name, Slash - Name + 1);
+	strcpy(Key + (Slash - Name + 1), End + 1);
+	return 1;
+}
+
+/**
+ * qsort callback, groups candidates by key and keeps them in pack order.
+ */
+static int _theme_compare_candidates(const void *A, const void *B){
+	const _kif_theme_candidate *CA = (const _kif_theme_candidate *)A, *CB = (const _kif_theme_candidate *)B;
+	int Cmp = strcmp(CA->Key, CB->Key);
+
+	return Cmp ? Cmp : CA->Pack - CB->Pack;
+}
+
+/**
+ * Returns 1 if candidate A is a better match than B for the requested size. Closest pixel size wins,
+ * then a matching scale, then the larger icon (downscaling looks better than upscaling).
+ */
+static int _theme_better_size(const _kif_theme_candidate *A, const _kif_theme_candidate *B, int Size, int Scale){
+	int DistA = abs(A->Size * A->Scale - Size * Scale);
+	int DistB = abs(B->Size * B->Scale - Size * Scale);
+
+	if(DistA != DistB){
+		return DistA < DistB;
+	}
+
+	if((A->Scale == Scale) != (B->Scale == Scale)){
+		return A->Scale == Scale;
+	}
+
+	return A->Size * A->Scale > B->Size * B->Scale;
+}
+
+/**
+ * FNV-1a hash of a theme key, size and scale. Never returns 0, which marks an empty slot.
+ */
+static uint32_t _theme_hash(const char *Key, int Length, int Size, int Scale){
+	uint32_t Hash = 2166136261u;
+
+	for(int i = 0; i < Length; i++){
+		Hash = (Hash ^ (unsigned char)Key[i]) * 16777619u;
+	}
+
+	Hash = (Hash ^ (Size & 0xFF)) * 16777619u;
+	Hash = (Hash ^ (Size >> 8)) * 16777619u;
+	Hash = (Hash ^ Scale) * 16777619u;
+
+	return Hash ? Hash : 1;
+}
+
+static void _png_writer_init(_kif_png_writer *Writer){
+	memset(Writer, 0, sizeof(_kif_png_writer));
+	Writer->A = 1;
+
+	for(uint32_t i = 0; i < 256; i++){
+		uint32_t Crc = i;
+
+		for(int k = 0; k < 8; k++){
+			Crc = (Crc & 1) ? 0xEDB88320u ^ (Crc >> 1) : Crc >> 1;
+		}
+
+		Writer->Crc[i] = Crc;
+	}
+}
+
+/**
+ * Make room for Length more bytes. Once an allocation failed every write is dropped.
+ */
+static int _png_reserve(_kif_png_writer *Writer, size_t Length){
+	if(Writer->Failed){
+		return 0;
+	}
+
+	if(Writer->Length + Length > Writer->Size){
+		size_t Size = (Writer->Length + Length) * 2 + 1024;
+		unsigned char *Data = (unsigned char *)realloc(Writer->Data, Size);
+
+		if(Data == NULL){
+			Writer->Failed = 1;
+			return 0;
+		}
+
+		Writer->Data = Data;
+		Writer->Size = Size;
+	}
+
+	return 1;
+}
+
+static void _png_bytes(_kif_png_writer *Writer, const void *Bytes, size_t Length){
+	if(_png_reserve(Writer, Length)){
+		memcpy(Writer->Data + Writer->Length, Bytes, Length);
+		Writer->Length += Length;
+	}
+}
+
+// PNG and zlib integers are big endian
+static void _png_u32(_kif_png_writer *Writer, uint32_t Value){
+	unsigned char Bytes[4] = { (unsigned char)(Value >> 24), (unsigned char)(Value >> 16), (unsigned char)(Value >> 8), (unsigned char)Value };
+
+	_png_bytes(Writer, Bytes, 4);
+}
+
+/**
+ * Start a chunk with a placeholder length, returns its offset for _png_chunk_end().
+ */
+static size_t _png_chunk_begin(_kif_png_writer *Writer, const char *Tag){
+	size_t Start = Writer->Length;
+
+	_png_u32(Writer, 0);
+	_png_bytes(Writer, Tag, 4);
+	return Start;
+}
+
+/**
+ * Fill in the length of the chunk at Start and append the CRC of its tag and data.
+ */
+static void _png_chunk_end(_kif_png_writer *Writer, size_t Start){
+	uint32_t Crc = 0xFFFFFFFFu;
+
+	if(Writer->Failed){
+		return;
+	}
+
+	uint32_t Length = (uint32_t)(Writer->Length - Start - 8);
+	unsigned char *Chunk = Writer->Data + Start;
+
+	Chunk[0] = Length >> 24;
+	Chunk[1] = Length >> 16;
+	Chunk[2] = Length >> 8;
+	Chunk[3] = Length;
+
+	for(size_t i = Start + 4; i < Writer->Length; i++){
+		Crc = Writer->Crc[(Crc ^ Writer->Data[i]) & 0xFF] ^ (Crc >> 8);
+	}
+
+	_png_u32(Writer, Crc ^ 0xFFFFFFFFu);
+}
+
+/**
+ * Append Count bits of Value to the deflate stream, least significant bit first.
+ */
+static void _png_bits(_kif_png_writer *Writer, uint32_t Value, int Count){
+	Writer->Bits |= Value << Writer->Count;
+	Writer->Count += Count;
+
+	while(Writer->Count >= 8){
+		unsigned char Byte = Writer->Bits & 0xFF;
+
+		_png_bytes(Writer, &Byte, 1);
+		Writer->Bits >>= 8;
+		Writer->Count -= 8;
+	}
+}
+
+/**
+ * Append a Huffman code, which deflate stores most significant bit first.
+ */
+static void _png_code(_kif_png_writer *Writer, uint32_t Code, int Length){
+	uint32_t Reversed = 0;
+
+	for(int i = 0; i < Length; i++){
+		Reversed = (Reversed << 1) | ((Code >> i) & 1);
+	}
+
+	_png_bits(Writer, Reversed, Length);
+}
+
+/**
+ * Append a literal/length symbol with the fixed Huffman code.
+ */
+static void _png_symbol(_kif_png_writer *Writer, int Symbol){
+	if(Symbol < 144){
+		_png_code(Writer, 0x30 + Symbol, 8);
+	}else if(Symbol < 256){
+		_png_code(Writer, 0x190 + Symbol - 144, 9);
+	}else if(Symbol < 280){
+		_png_code(Writer, Symbol - 256, 7);
+	}else{
+		_png_code(Writer, 0xC0 + Symbol - 280, 8);
+	}
+}
+
+/**
+ * Append a match of 3 to 258 bytes, Distance bytes back (1 to 32768).
+ */
+static void _png_match(_kif_png_writer *Writer, int Length, int Distance){
+	static const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	int i = 28, d = 29;
+
+	while(LengthBase[i] > Length){
+		i--;
+	}
+
+	while(DistanceBase[d] > Distance){
+		d--;
+	}
+
+	_png_symbol(Writer, 257 + i);
+	_png_bits(Writer, Length - LengthBase[i], LengthExtra[i]);
+	_png_code(Writer, d, 5);
+	_png_bits(Writer, Distance - DistanceBase[d], DistanceExtra[d]);
+}
+
+/**
+ * Append Length bytes equal to the bytes Distance back, split into matches. A tail below 3 bytes can only
+ * happen for runs (Distance 1) and is written as literals of Value.
+ */
+static void _png_copy(_kif_png_writer *Writer, int Value, int Length, int Distance){
+	while(Length >= 3){
+		int Match = Length > 258 ? 258 : Length;
+
+		// Never leave a tail too short for a match
+		if(Length - Match > 0 && Length - Match < 3){
+			Match = Length - 3;
+		}
+
+		_png_match(Writer, Match, Distance);
+		Length -= Match;
+	}
+
+	while(Length-- > 0){
+		_png_symbol(Writer, Value);
+	}
+}
+
+/**
+ * Add Count copies of Byte to the Adler-32 of the uncompressed data, in closed form so a run costs the same as a byte.
+ */
+static void _png_adler_run(_kif_png_writer *Writer, int Byte, int Count){
+	uint64_t N = Count;
+
+	Writer->B = (uint32_t)((Writer->B + N * Writer->A + Byte * (N * (N + 1) / 2)) % 65521);
+	Writer->A = (uint32_t)((Writer->A + N * Byte) % 65521);
+}
+
+/**
+ * Add Length bytes to the Adler-32 of the uncompressed data.
+ */
+static void _png_adler_bytes(_kif_png_writer *Writer, const unsigned char *Bytes, int Length){
+	uint32_t A = Writer->A, B = Writer->B;
+
+	while(Length > 0){
+		int Block = Length < 5552 ? Length : 5552;	// Largest block that can not overflow B
+
+		for(int i = 0; i < Block; i++){
+			A += *Bytes++;
+			B += A;
+		}
+
+		A %= 65521;
+		B %= 65521;
+		Length -= Block;
+	}
+
+	Writer->A = A;
+	Writer->B = B;
+}
+
+/**
+ * Deflate one filter type 0 scanline. Last is the previous uncompressed byte, or -1 at the start.
+ */
+static void _png_row(_kif_png_writer *Writer, const unsigned char *Row, const unsigned char *Previous, int Width, int *Last){
+	int Distance = Width + 1;
+
+	// A row equal to the one above (filter byte included) is a single copy of the previous scanline.
+	if(Previous && Distance >= 3 && Distance <= 32768 && memcmp(Row, Previous, Width) == 0){
+		_png_copy(Writer, 0, Distance, Distance);
+		_png_adler_run(Writer, 0, 1);
+		_png_adler_bytes(Writer, Row, Width);
+
+		*Last = Row[Width - 1];
+		return;
+	}
+
+	// Filter byte, then every run of equal indexes as a literal followed by a distance 1 match
+	for(int x = -1; x < Width;){
+		int Value = x < 0 ? 0 : Row[x];
+		int Length = 1;
+
+		while(x + Length < Width && Row[x + Length] == Value){
+			Length++;
+		}
+
+		_png_adler_run(Writer, Value, Length);
+		x += Length;
+
+		if(*Last != Value){
+			_png_symbol(Writer, Value);
+			Length--;
+		}
+
+		_png_copy(Writer, Value, Length, 1);
+		*Last = Value;
+	}
+}
+
+static int _qoi_hash(kif_rgba_t Color){
+	return (Color.rgba.r * 3 + Color.rgba.g * 5 + Color.rgba.b * 7 + Color.rgba.a * 11) % 64;
+}
+
+// QOI integers are big endian
+static uint32_t _qoi_read32(const unsigned char *Bytes){
+	return ((uint32_t)Bytes[0] << 24) | ((uint32_t)Bytes[1] << 16) | ((uint32_t)Bytes[2] << 8) | Bytes[3];
+}
+
+static unsigned char *_qoi_write32(unsigned char *Out, uint32_t Value){
+	Out[0] = Value >> 24;
+	Out[1] = Value >> 16;
+	Out[2] = Value >> 8;
+	Out[3] = Value;
+	return Out + 4;
+}
+
+/**
+ * Write Run repeats of the previous pixel as QOI_OP_RUN ops of up to 62 pixels.
+ */
+static unsigned char *_qoi_write_run(unsigned char *Out, uint32_t Run){
+	while(Run > 0){
+		int Length = Run > 62 ? 62 : Run;
+
+		*Out++ = 0xC0 | (Length - 1);
+		Run -= Length;
+	}
+
+	return Out;
+}
+
+/**
+ * Write the smallest op for a pixel that differs from the previous one, updating the color index.
+ */
+static unsigned char *_qoi_write_pixel(unsigned char *Out, kif_rgba_t *Index, kif_rgba_t Previous, kif_rgba_t Color){
+	int Hash = _qoi_hash(Color);
+
+	if(Index[Hash].v == Color.v){
+		*Out++ = Hash;		// QOI_OP_INDEX
+		return Out;
+	}
+
+	Index[Hash] = Color;
+
+	if(Color.rgba.a != Previous.rgba.a){
+		*Out++ = 0xFF;		// QOI_OP_RGBA
+		memcpy(Out, &Color, 4);
+		return Out + 4;
+	}
+
+	// Channel differences wrap around like the decoder's 8-bit arithmetic
+	int Red = (signed char)(Color.rgba.r - Previous.rgba.r);
+	int Green = (signed char)(Color.rgba.g - Previous.rgba.g);
+	int Blue = (signed char)(Color.rgba.b - Previous.rgba.b);
+
+	if(Red >= -2 && Red <= 1 && Green >= -2 && Green <= 1 && Blue >= -2 && Blue <= 1){
+		*Out++ = 0x40 | ((Red + 2) << 4) | ((Green + 2) << 2) | (Blue + 2);	// QOI_OP_DIFF
+	}else if(Green >= -32 && Green <= 31 && Red - Green >= -8 && Red - Green <= 7 && Blue - Green >= -8 && Blue - Green <= 7){
+		*Out++ = 0x80 | (Green + 32);	// QOI_OP_LUMA
+		*Out++ = ((Red - Green + 8) << 4) | (Blue - Green + 8);
+	}else{
+		*Out++ = 0xFE;		// QOI_OP_RGB
+		memcpy(Out, &Color, 3);
+		Out += 3;
+	}
+
+	return Out;
+}
+
+#endif
+
+#ifdef KIF_DISK_CACHE
+
+/**
+ * Binary search for the index entry of a source path and output format, optionally inserting it.
+ * Inserting moves the entries after it, so pointers from earlier calls are invalidated.
+ */
+static _kif_cache_entry *_cache_find(KIFCache *Cache, const char *Path, int BPP, int Add){
+	int Low = 0, High = Cache->Count;
+
+	while(Low < High){
+		int Mid = (Low + High) / 2;
+		int Cmp = strcmp(Cache->Entries[Mid].Path, Path);
+
+		if(Cmp == 0){
+			Cmp = Cache->Entries[Mid].BPP - BPP;
+		}
+
+		if(Cmp == 0){
+			return &Cache->Entries[Mid];
+		}else if(Cmp < 0){
+			Low = Mid + 1;
+		}else{
+			High = Mid;
+		}
+	}
+
+	if(!Add){
+		return NULL;
+	}
+
+	if(Cache->Count == Cache->Size){
+		int Size = Cache->Size ? Cache->Size * 2 : 256;
+		_kif_cache_entry *Entries = (_kif_cache_entry *)realloc(Cache->Entries, Size * sizeof(_kif_cache_entry));
+
+		if(Entries == NULL){
+			return NULL;
+		}
+
+		Cache->Entries = Entries;
+		Cache->Size = Size;
+	}
+
+	size_t Length = strlen(Path) + 1;
+	char *Copy = (char *)malloc(Length);
+
+	if(Copy == NULL){
+		return NULL;
+	}
+
+	_kif_cache_entry *Entry = &Cache->Entries[Low];
+
+	// The index is written in order, so loading it only ever appends.
+	memmove(Entry + 1, Entry, (Cache->Count - Low) * sizeof(_kif_cache_entry));
+	memset(Entry, 0, sizeof(_kif_cache_entry));
+	memcpy(Copy, Path, Length);
+	Entry->Path = Copy;
+	Entry->BPP = BPP;
+	Cache->Count++;
+	return Entry;
+}
+
+/**
+ * Modification time of a file in nanoseconds, so a rewrite within the same second still invalidates the cache.
+ * Falls back to whole seconds where struct stat has no nanosecond field.
+ */
+static long long _cache_mtime(const struct stat *Info){
+#if defined(__APPLE__)
+	return (long long)Info->st_mtimespec.tv_sec * 1000000000 + Info->st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+	// st_mtime is a macro for st_mtim.tv_sec wherever the timespec field exists.
+	return (long long)Info->st_mtim.tv_sec * 1000000000 + Info->st_mtim.tv_nsec;
+#else
+	return (long long)Info->st_mtime * 1000000000;
+#endif
+}
+
+/**
+ * Map a cached blob and point the image at its pixels. Returns 0 if there is no valid blob.
+ */
+static int _cache_map(KIFCache *Cache, uint64_t Hash, int BPP, KIFCachedImage *Image){
+	char Path[4096];
+	struct stat Info;
+	KIFCacheBlob Blob;
+
+	snprintf(Path, sizeof(Path), "%s/%016llx-%d.raw", Cache->Dir, (unsigned long long)Hash, BPP);
+	int File = open(Path, O_RDONLY);
+
+	if(File < 0){
+		return 0;
+	}
+
+	if(fstat(File, &Info) != 0 || Info.st_size < (off_t)sizeof(KIFCacheBlob)){
+		close(File);
+		return 0;
+	}
+
+	void *Mapping = mmap(NULL, Info.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+	close(File);
+
+	if(Mapping == MAP_FAILED){
+		return 0;
+	}
+
+	memcpy(&Blob, Mapping, sizeof(KIFCacheBlob));
+
+	if(Blob.Magic != 0x6B696663 || Blob.BPP != (uint32_t)BPP || Blob.Hash != Hash || (off_t)(sizeof(KIFCacheBlob) + (size_t)Blob.Header.Width * Blob.Header.Height * (BPP / 8)) > Info.st_size){
+		munmap(Mapping, Info.st_size);
+		return 0;
+	}
+
+	Image->Pixels = (unsigned char *)Mapping + sizeof(KIFCacheBlob);
+	Image->Header = Blob.Header;
+	Image->Mapping = Mapping;
+	Image->MappingSize = Info.st_size;
+	return 1;
+}
+
+/**
+ * Write decoded pixels as a blob. Failures are ignored, the pixels just will not be cached.
+ */
+static void _cache_store(KIFCache *Cache, uint64_t Hash, int BPP, const KIFCachedImage *Image){
+	char Path[4096], Temp[4096];
+	KIFCacheBlob Blob;
+	size_t Size = (size_t)Image->Header.Width * Image->Header.Height * (BPP / 8);
+
+	memset(&Blob, 0, sizeof(KIFCacheBlob));
+	Blob.Magic = 0x6B696663;	// 'kifc'
+	Blob.BPP = BPP;
+	Blob.Hash = Hash;
+	Blob.Header = Image->Header;
+
+	snprintf(Path, sizeof(Path), "%s/%016llx-%d.raw", Cache->Dir, (unsigned long long)Hash, BPP);
+	snprintf(Temp, sizeof(Temp), "%s/%016llx-%d.%ld", Cache->Dir, (unsigned long long)Hash, BPP, (long)getpid());
+
+	FILE *File = fopen(Temp, "wb");
+
+	if(!File){
+		return;
+	}
+
+	int Written = fwrite(&Blob, 1, sizeof(KIFCacheBlob), File) == sizeof(KIFCacheBlob) && fwrite(Image->Pixels, 1, Size, File) == Size;
+
+	if(fclose(File) != 0 || !Written || rename(Temp, Path) != 0){
+		remove(Temp);
+	}
+}
+
+/**
+ * Read a whole file into memory, needs to be free()d after use.
+ */
+static void *_cache_read_file(const char *Filename, int *Size){
+	FILE *OpenedFile = fopen(Filename, "rb");
+	void *Data;
+
+	if(!OpenedFile){
+		return NULL;
+	}
+
+	// Files that can not be sized, or are too large for an int, are not cached.
+	int64_t FileSize = _kif_fseek(OpenedFile, 0, SEEK_END) == 0 ? _kif_ftell(OpenedFile) : -1;
+
+	*Size = FileSize > 0 && FileSize <= 0x7FFFFFFF ? (int)FileSize : 0;
+	Data = *Size > 0 && _kif_fseek(OpenedFile, 0, SEEK_SET) == 0 ? malloc(*Size) : NULL;
+
+	if(Data && fread(Data, 1, *Size, OpenedFile) != (size_t)*Size){
+		free(Data);
+		Data = NULL;
+	}
+
+	fclose(OpenedFile);
+	return Data;
+}
+
+/**
+ * FNV-1a, 64 bit
+ */
+static uint64_t _kif_hash64(const void *Data, int Size){
+	const unsigned char *Bytes = (const unsigned char *)Data;
+	uint64_t Hash = 0xcbf29ce484222325ULL;
+
+	for(int i = 0; i < Size; i++){
+		Hash = (Hash ^ Bytes[i]) * 0x100000001b3ULL;
+	}
+
+	return Hash;
+}
+
+#endif
+
 // Function to read a 16-bit little-endian value from a buffer
 static unsigned short _read16bit(const unsigned char *buffer) {
     return (buffer[1] << 8) | buffer[0];
@@ -369,5 +5204,5 @@ static unsigned short _read16bit(const unsigned char *buffer) {
 
 // Function to read a 32-bit little-endian value from a buffer
 static unsigned int _read32bit(const unsigned char *buffer) {
-    return (buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | buffer[0];
+    return ((unsigned int)buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | buffer[0];
 }
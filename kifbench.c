@@ -0,0 +1,381 @@
+/*
+
+Copyright (c) 1998 - 2023, Philipe Rubio
+SPDX-License-Identifier: MIT
+
+Benchmark for the kif.h kernels with hardware performance counters
+
+Requires:
+	-"kif.h" (https://github.com/Masq666/kif/blob/main/kif.h)
+
+Usage:
+	kifbench [-n iterations] <icon.kif|directory>...
+
+	Every .kif file (directories are searched recursively) is run through each kernel, then the results are
+	summed per kernel and corpus class. Corpus classes are the icon sizes themes ship: up to 32, 64 and 128
+	pixels on the longest side, and larger.
+
+	On Linux cycles, instructions, branch misses and L1D/LLC read misses are collected through
+	perf_event_open() for user space code. Counters that can not be opened (no PMU, perf_event_paranoid,
+	containers) are shown as "-", wall clock time is always reported.
+
+Kernels:
+	decode32	kif_decode() to 32 bpp, including the allocation
+	decode24	kif_decode() to 24 bpp, including the allocation
+	decode_into	kif_decode_into() a preallocated 32 bpp buffer
+	spans		kif_span_next() over all runs
+	blit		kif_blit() onto an RGBA surface the size of the icon
+	encode		kif_encode() of the decoded 32 bpp pixels
+
+Compile with:
+	gcc kifbench.c -std=c99 -O3 -o kifbench
+
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "kif.h"
+
+#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+enum { KERNEL_DECODE32, KERNEL_DECODE24, KERNEL_DECODE_INTO, KERNEL_SPANS, KERNEL_BLIT, KERNEL_ENCODE, KERNELS };
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_BRANCH_MISSES, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTERS };
+
+static const char *kernel_names[KERNELS] = { "decode32", "decode24", "decode_into", "spans", "blit", "encode" };
+static const char *class_names[] = { "<=32px", "<=64px", "<=128px", "larger" };
+
+#define CLASSES (int)(sizeof(class_names) / sizeof(class_names[0]))
+
+typedef struct {
+	int icons;
+	double pixels, entries;			// Summed over all iterations
+	double seconds;
+	double counters[COUNTERS];
+} bench_result;
+
+static bench_result results[KERNELS][CLASSES];
+static int counter_fds[COUNTERS] = { -1, -1, -1, -1, -1 };
+static int iterations = 100;
+
+static double now_seconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Open every counter on its own, so a missing one does not take the others with it.
+static int counters_open(void) {
+	int opened = 0;
+
+#ifdef __linux__
+	uint64_t l1d = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	uint64_t llc = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+	counter_fds[COUNTER_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	counter_fds[COUNTER_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	counter_fds[COUNTER_BRANCH_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	counter_fds[COUNTER_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE, l1d);
+	counter_fds[COUNTER_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, llc);
+#endif
+
+	for(int i = 0; i < COUNTERS; i++){
+		opened += counter_fds[i] >= 0;
+	}
+
+	return opened;
+}
+
+static void counters_start(void) {
+#ifdef __linux__
+	for(int i = 0; i < COUNTERS; i++){
+		if(counter_fds[i] >= 0){
+			ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+// Adds the counts since counters_start(), scaled up if the kernel multiplexed the counters.
+static void counters_stop(double *counters) {
+#ifdef __linux__
+	for(int i = 0; i < COUNTERS; i++){
+		uint64_t value[3];
+
+		if(counter_fds[i] < 0){
+			continue;
+		}
+
+		ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+		if(read(counter_fds[i], value, sizeof(value)) == sizeof(value) && value[2] > 0){
+			counters[i] += (double)value[0] * ((double)value[1] / value[2]);
+		}
+	}
+#else
+	(void)counters;
+#endif
+}
+
+static void counters_close(void) {
+#ifdef __linux__
+	for(int i = 0; i < COUNTERS; i++){
+		if(counter_fds[i] >= 0){
+			close(counter_fds[i]);
+		}
+	}
+#endif
+}
+
+static void *read_file(const char *filename, int *size) {
+	FILE *f = fopen(filename, "rb");
+	void *data;
+
+	if(!f){
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	data = malloc(*size > 0 ? *size : 1);
+
+	if(data && fread(data, 1, *size, f) != (size_t)*size){
+		free(data);
+		data = NULL;
+	}
+
+	fclose(f);
+	return data;
+}
+
+static int icon_class(const KIFHeader *header) {
+	int side = header->Width > header->Height ? header->Width : header->Height;
+
+	return side <= 32 ? 0 : side <= 64 ? 1 : side <= 128 ? 2 : 3;
+}
+
+// Run one kernel over an icon, returns 0 if the kernel failed.
+static int run_kernel(int kernel, const void *data, KIFHeader *header, void *pixels, void *buffer) {
+	int stride = header->Width * 4;
+	int length;
+	void *output;
+	KIFSpanIter iter;
+	KIFSpan span;
+	KIFHeader encode_header;
+
+	switch(kernel){
+		case KERNEL_DECODE32:
+		case KERNEL_DECODE24:
+			output = kif_decode(data, header, kernel == KERNEL_DECODE32 ? 32 : 24);
+			free(output);
+			return output != NULL;
+
+		case KERNEL_DECODE_INTO:
+			return kif_decode_into(data, header, buffer, stride, 32);
+
+		case KERNEL_SPANS:
+			if(!kif_span_begin(&iter, data, 0)){
+				return 0;
+			}
+
+			length = 0;
+
+			while(kif_span_next(&iter, &span)){
+				length += span.Length;
+			}
+
+			return length == header->Width * header->Height;
+
+		case KERNEL_BLIT:
+			memset(buffer, 0, (size_t)stride * header->Height);
+			return kif_blit(data, buffer, stride, header->Width, header->Height, 0, 0);
+
+		case KERNEL_ENCODE:
+			memset(&encode_header, 0, sizeof(encode_header));
+			encode_header.BPP = 32;
+			encode_header.Width = header->Width;
+			encode_header.Height = header->Height;
+			output = kif_encode(pixels, &encode_header, &length);
+			free(output);
+			return output != NULL;
+	}
+
+	return 0;
+}
+
+static void bench_file(const char *filename) {
+	KIFHeader header;
+	int size;
+	void *data = read_file(filename, &size);
+	void *pixels = data ? kif_decode(data, &header, 32) : NULL;
+	void *buffer = pixels ? malloc((size_t)header.Width * header.Height * 4) : NULL;
+
+	if(buffer == NULL){
+		printf("Couldn't load %s\n", filename);
+		free(pixels);
+		free(data);
+		return;
+	}
+
+	int class = icon_class(&header);
+
+	for(int kernel = 0; kernel < KERNELS; kernel++){
+		bench_result *result = &results[kernel][class];
+
+		// Warm up caches and the branch predictor, so small icons are not dominated by the first run.
+		if(!run_kernel(kernel, data, &header, pixels, buffer)){
+			printf("%s failed on %s\n", kernel_names[kernel], filename);
+			continue;
+		}
+
+		double start = now_seconds();
+		counters_start();
+
+		for(int i = 0; i < iterations; i++){
+			run_kernel(kernel, data, &header, pixels, buffer);
+		}
+
+		counters_stop(result->counters);
+		result->seconds += now_seconds() - start;
+		result->pixels += (double)header.Width * header.Height * iterations;
+		result->entries += (double)header.RLEEntries * iterations;
+		result->icons++;
+	}
+
+	free(buffer);
+	free(pixels);
+	free(data);
+}
+
+static void bench_path(const char *path) {
+	struct stat st;
+
+	if(stat(path, &st) != 0){
+		printf("Couldn't open %s\n", path);
+		return;
+	}
+
+	if(!S_ISDIR(st.st_mode)){
+		bench_file(path);
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+	char child[4096];
+
+	if(!dir){
+		printf("Couldn't open %s\n", path);
+		return;
+	}
+
+	while((entry = readdir(dir)) != NULL){
+		if(entry->d_name[0] == '.'){
+			continue;
+		}
+
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+		if(stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || STR_ENDS_WITH(entry->d_name, ".kif"))){
+			bench_path(child);
+		}
+	}
+
+	closedir(dir);
+}
+
+// Print a per unit counter, or "-" if the counter is not available.
+static void print_rate(int counter, double value, double per, double scale) {
+	if(counter_fds[counter] < 0 || per <= 0){
+		printf(" %11s", "-");
+	}else{
+		printf(" %11.3f", value / per * scale);
+	}
+}
+
+static void print_results(void) {
+	printf("%-12s %-8s %6s %9s %11s %11s %11s %11s %11s %11s\n", "kernel", "class", "icons", "Mpx/s", "cycles/px", "cycles/ent", "IPC", "brmiss/kpx", "L1Dmiss/kpx", "LLCmiss/kpx");
+
+	for(int kernel = 0; kernel < KERNELS; kernel++){
+		for(int class = 0; class < CLASSES; class++){
+			bench_result *result = &results[kernel][class];
+			double *counters = result->counters;
+
+			if(result->icons == 0){
+				continue;
+			}
+
+			printf("%-12s %-8s %6d %9.1f", kernel_names[kernel], class_names[class], result->icons, result->seconds > 0 ? result->pixels / result->seconds / 1e6 : 0.0);
+			print_rate(COUNTER_CYCLES, counters[COUNTER_CYCLES], result->pixels, 1);
+			print_rate(COUNTER_CYCLES, counters[COUNTER_CYCLES], result->entries, 1);
+
+			if(counter_fds[COUNTER_INSTRUCTIONS] < 0){
+				printf(" %11s", "-");
+			}else{
+				print_rate(COUNTER_CYCLES, counters[COUNTER_INSTRUCTIONS], counters[COUNTER_CYCLES], 1);
+			}
+
+			print_rate(COUNTER_BRANCH_MISSES, counters[COUNTER_BRANCH_MISSES], result->pixels, 1000);
+			print_rate(COUNTER_L1D_MISSES, counters[COUNTER_L1D_MISSES], result->pixels, 1000);
+			print_rate(COUNTER_LLC_MISSES, counters[COUNTER_LLC_MISSES], result->pixels, 1000);
+			printf("\n");
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	int first = 1;
+
+	if(argc > 2 && strcmp(argv[1], "-n") == 0){
+		iterations = atoi(argv[2]);
+		first = 3;
+	}
+
+	if(first >= argc || iterations <= 0){
+		puts("Usage: kifbench [-n iterations] <icon.kif|directory>...");
+		exit(1);
+	}
+
+	if(counters_open() == 0){
+		puts("Hardware counters unavailable, reporting wall clock time only");
+	}
+
+	for(int i = first; i < argc; i++){
+		bench_path(argv[i]);
+	}
+
+	print_results();
+	counters_close();
+	return 0;
+}
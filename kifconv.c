@@ -3,18 +3,72 @@
 Copyright (c) 1998 - 2023, Philipe Rubio
 SPDX-License-Identifier: MIT
 
-Command line tool to convert between png <> kif format
+Command line tool to convert between png <> kif and qoi <> kif format
 
 Requires:
 	-"stb_image.h" (https://github.com/nothings/stb/blob/master/stb_image.h)
 	-"stb_image_write.h" (https://github.com/nothings/stb/blob/master/stb_image_write.h)
 	-"kif.h" (https://github.com/Masq666/kif/blob/main/kif.h)
 
+Encoder options (may appear anywhere on the command line):
+	--alpha-order	Order the palette by alpha class (transparent, opaque, translucent)
+	--opaque-rects	Store the fully opaque regions of the icon for compositor culling
+	--progressive	Store a 1/4 resolution preview layer for streaming decoders
+	--placeholder	Store the average color and a 4x4 preview right behind the header for list views
+
+Tracing (may appear anywhere on the command line):
+	--trace <trace.json>	Write per file and per stage timings as Chrome trace JSON (chrome://tracing, ui.perfetto.dev),
+				the KIF_TRACE environment variable does the same
+
+Packs:
+	kifconv --pack <pack.kifp> <icon.kif|icon.png>...	Adds or replaces icons, named after the file without extension
+	kifconv --compact <pack.kifp> [percent]			Compacts the pack if more than percent (default 25) is dead space
+
+Palette variants:
+	kifconv --variants <icon.kif> <name>=<icon.png|icon.kif>...	Stores color variants of the same icon (light=a.png
+								dark=b.png) as one set of runs with a palette per variant,
+								the first one is the main palette
+
+Visual diff:
+	kifconv --diff <a.kif> <b.kif> [diff.kif]		Reports the pixels that differ, their bounding box and the largest
+								channel delta, optionally writes them as a mask. Exits with 0 when
+								the icons match, 1 when they differ and 2 on errors
+
+Multi-size packs:
+	kifconv --sizes <16,24,32,...> <pack.kifp> <context> <master.png|master.kif>...
+								Resamples every master to each size (longest side) on one thread per size
+								and stores the icons as "<context>/<size>/<name>", ready for --theme-index
+
+Theme index:
+	kifconv --theme-index <index.kift> <pack.kifp>...	Precomputes name/size/scale lookups for packs whose icons are
+								named "<context>/<size>[@<scale>]/<name>", packs in inheritance order
+
+Incremental builds:
+	kifconv --incremental <indir> <outdir>	Converts every changed .png in indir to a .kif in outdir
+	kifconv --watch <indir> <outdir>		Same as --incremental, then keeps re-encoding files as they change (Linux)
+
+	Unchanged inputs are skipped using a content hash cache stored in <outdir>/.kifcache
+
 Compile with: 
-	gcc kifconv.c -std=c99 -O3 -o kifconv
+	gcc kifconv.c -std=c99 -O3 -pthread -o kifconv
 
 */
 
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ONLY_PNG
 #define STBI_NO_LINEAR
@@ -23,19 +77,875 @@ Compile with:
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
+// Encoder and decoder stages inside kif.h show up in the trace as well.
+static void trace_event(char phase, const char *name, const char *file);
+static void trace_event_size(char phase, const char *name, const char *file, int size);
+
+#define KIF_TRACE_BEGIN(Name) trace_event('B', Name, NULL)
+#define KIF_TRACE_END(Name) trace_event('E', Name, NULL)
+
 #include "kif.h"
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+// Bump when the encoder output changes, so stale cache entries are re-encoded.
+#define CACHE_VERSION 1
+#define MAX_SIZES 32
+
+// Header flags requested from the encoder, part of the cache key.
+static unsigned encoder_flags = 0;
+
+typedef struct {
+	char name[256];		// Input file name relative to the input directory
+	uint64_t hash;		// FNV-1a hash of the input file
+	unsigned settings;	// Encoder settings the output was produced with
+} cache_entry;
+
+static cache_entry *cache;
+static int cache_count, cache_size;
+
+// Chrome trace output, NULL when tracing is off.
+static FILE *trace_file;
+static double trace_start;
+
+// Read a whole file into memory, needs to be free()d after use.
+// Fails for files that can not be sized (pipes, directories) or do not fit in an int.
+static void *read_file(const char *filename, int *size) {
+	FILE *f = fopen(filename, "rb");
+	void *data = NULL;
+	off_t end;
+
+	if(!f){
+		return NULL;
+	}
+
+	if(fseeko(f, 0, SEEK_END) != 0 || (end = ftello(f)) < 0 || end > INT_MAX || fseeko(f, 0, SEEK_SET) != 0){
+		fclose(f);
+		return NULL;
+	}
+
+	*size = (int)end;
+	data = malloc(*size > 0 ? *size : 1);
+
+	if(data && fread(data, 1, *size, f) != (size_t)*size){
+		free(data);
+		data = NULL;
+	}
+
+	fclose(f);
+	return data;
+}
+
+static int write_file(const char *filename, const void *data, int size) {
+	FILE *f = fopen(filename, "wb");
+	int written = 0;
+
+	if(f){
+		written = fwrite(data, 1, size, f) == (size_t)size;
+		written &= fclose(f) == 0;
+	}
+
+	return written;
+}
+
+// Add or replace icons in a pack with a single new index generation.
+static int pack_icons(const char *pack, int count, char **files) {
+	const char **names = malloc(count * sizeof(char *));
+	const void **blobs = malloc(count * sizeof(void *));
+	int *lengths = malloc(count * sizeof(int));
+	char (*namebuf)[48] = malloc(count * sizeof(*namebuf));
+	int entries = -1, i;
+
+	for(i = 0; i < count; i++){
+		const char *base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+		const char *ext = strrchr(base, '.');
+		int len = ext ? (int)(ext - base) : (int)strlen(base);
+
+		snprintf(namebuf[i], sizeof(namebuf[i]), "%.*s", len, base);
+		names[i] = namebuf[i];
+
+		if(STR_ENDS_WITH(files[i], ".png")){
+			int w, h;
+			trace_event('B', "png_decode", files[i]);
+			void *pixels = stbi_load(files[i], &w, &h, NULL, 4);
+			trace_event('E', "png_decode", files[i]);
+
+			blobs[i] = pixels ? kif_encode(pixels, &(KIFHeader){ .Width = w, .Height = h, .Compressed = encoder_flags }, &lengths[i]) : NULL;
+			free(pixels);
+		}else{
+			trace_event('B', "read", files[i]);
+			blobs[i] = read_file(files[i], &lengths[i]);
+			trace_event('E', "read", files[i]);
+		}
+
+		if(blobs[i] == NULL){
+			printf("Couldn't load/encode %s\n", files[i]);
+			break;
+		}
+	}
+
+	if(i == count){
+		trace_event('B', "pack_update", pack);
+		entries = kif_pack_update(pack, count, names, blobs, lengths);
+		trace_event('E', "pack_update", pack);
+	}
+
+	while(i-- > 0){
+		free((void *)blobs[i]);
+	}
+
+	free(names);
+	free(blobs);
+	free(lengths);
+	free(namebuf);
+	return entries;
+}
+
+typedef struct {
+	const KIFMaster *master;
+	const char *file;
+	int size;
+	void *blob;
+	int length;
+	int started;
+	pthread_t thread;
+} size_job;
+
+static void *encode_size(void *arg) {
+	size_job *job = arg;
+	KIFHeader header;
+
+	trace_event_size('B', "encode_size", job->file, job->size);
+	job->blob = kif_master_encode(job->master, job->size, encoder_flags, &header, &job->length);
+	trace_event_size('E', "encode_size", job->file, job->size);
+	return NULL;
+}
+
+// Encode color variants of one icon into a single .kif, arguments are name=file pairs.
+static int encode_variants(const char *output, int count, char **args) {
+	const void **pixels = calloc(count, sizeof(void *));
+	const char **names = malloc(count * sizeof(char *));
+	int w = 0, h = 0, length, written = 0, i;
+
+	for(i = 0; i < count; i++){
+		char *file = strchr(args[i], '=');
+		int fw = 0, fh = 0;
+
+		if(file == NULL){
+			printf("Expected <name>=<file>, got %s\n", args[i]);
+			break;
+		}
+
+		*file++ = 0;
+		names[i] = args[i];
+
+		trace_event('B', "read", file);
+
+		if(STR_ENDS_WITH(file, ".png")){
+			pixels[i] = stbi_load(file, &fw, &fh, NULL, 4);
+		}else{
+			KIFHeader desc;
+			pixels[i] = kif_read(file, &desc, 32);
+			fw = desc.Width;
+			fh = desc.Height;
+		}
+
+		trace_event('E', "read", file);
+
+		if(pixels[i] == NULL || (i > 0 && (fw != w || fh != h))){
+			printf("Couldn't load %s, or its size differs from the first variant\n", file);
+			break;
+		}
+
+		w = fw;
+		h = fh;
+	}
+
+	if(i == count){
+		void *data = kif_encode_variants(pixels, names, count, &(KIFHeader){ .Width = w, .Height = h, .Compressed = encoder_flags }, &length);
+
+		if(data == NULL){
+			printf("Couldn't encode variants, they must use the same shapes and names up to %d characters\n", KIF_VARIANT_NAME - 1);
+		}
+
+		written = data && write_file(output, data, length);
+		free(data);
+	}
+
+	for(i = 0; i < count; i++){
+		free((void *)pixels[i]);
+	}
+
+	free(pixels);
+	free(names);
+	return written;
+}
+
+// Compare two icons in the run domain, returns 0 when they match, 1 when they differ and 2 on errors.
+static int diff_icons(const char *a, const char *b, const char *output) {
+	int size_a, size_b, length, result = 2;
+	void *data_a = read_file(a, &size_a);
+	void *data_b = read_file(b, &size_b);
+	void *mask = NULL;
+	KIFDiff diff;
+
+	if(data_a && data_b){
+		if(output){
+			mask = kif_diff_encode(data_a, data_b, &diff, &length);
+			result = mask && write_file(output, mask, length) ? 0 : 2;
+		}else{
+			result = kif_diff(data_a, data_b, &diff) ? 0 : 2;
+		}
+	}
+
+	if(result == 2){
+		printf("Couldn't compare %s and %s\n", a, b);
+	}else if(diff.Pixels){
+		printf("%s %s: %u of %d pixels differ in %d,%d %dx%d, max delta %d\n", a, b, diff.Pixels, diff.Width * diff.Height,
+			diff.Bounds.X, diff.Bounds.Y, diff.Bounds.Width, diff.Bounds.Height, diff.MaxDelta);
+		result = 1;
+	}
+
+	free(mask);
+	free(data_a);
+	free(data_b);
+	return result;
+}
+
+// Encode every master at every size, one worker thread per size, and add them all to a pack in one index generation.
+static int pack_sizes(const char *pack, const char *sizelist, const char *context, int count, char **files) {
+	int sizes[MAX_SIZES], nsizes = 0, entries = -1, done = 0, i, s;
+	const char *p = sizelist;
+	char *end;
+
+	while(*p && nsizes < MAX_SIZES){
+		sizes[nsizes] = strtol(p, &end, 10);
+
+		if(end == p || sizes[nsizes] <= 0 || sizes[nsizes] > 65535 || (*end && *end != ',')){
+			printf("Invalid size list %s\n", sizelist);
+			return -1;
+		}
+
+		nsizes++;
+		p = *end ? end + 1 : end;
+	}
+
+	const char **names = malloc(count * nsizes * sizeof(char *));
+	const void **blobs = calloc(count * nsizes, sizeof(void *));
+	int *lengths = malloc(count * nsizes * sizeof(int));
+	char (*namebuf)[48] = malloc(count * nsizes * sizeof(*namebuf));
+
+	for(i = 0; i < count; i++){
+		const char *base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+		const char *ext = strrchr(base, '.');
+		int len = ext ? (int)(ext - base) : (int)strlen(base);
+		void *pixels = NULL;
+		int w = 0, h = 0;
+
+		trace_event('B', "read", files[i]);
+
+		if(STR_ENDS_WITH(files[i], ".png")){
+			pixels = stbi_load(files[i], &w, &h, NULL, 4);
+		}else{
+			KIFHeader desc;
+			pixels = kif_read(files[i], &desc, 32);
+			w = desc.Width;
+			h = desc.Height;
+		}
+
+		trace_event('E', "read", files[i]);
+
+		KIFMaster master;
+		size_job jobs[MAX_SIZES];
+		int prepared = pixels && kif_master_begin(&master, pixels, w, h);
+
+		free(pixels);
+
+		if(!prepared){
+			printf("Couldn't load %s\n", files[i]);
+			break;
+		}
+
+		for(s = 0; s < nsizes; s++){
+			jobs[s] = (size_job){ .master = &master, .file = files[i], .size = sizes[s] };
+
+			// Without a thread the size is encoded right here
+			jobs[s].started = pthread_create(&jobs[s].thread, NULL, encode_size, &jobs[s]) == 0;
+
+			if(!jobs[s].started){
+				encode_size(&jobs[s]);
+			}
+		}
+
+		for(s = 0; s < nsizes; s++){
+			int n = i * nsizes + s;
+
+			if(jobs[s].started){
+				pthread_join(jobs[s].thread, NULL);
+			}
+
+			blobs[n] = jobs[s].blob;
+			lengths[n] = jobs[s].length;
+			names[n] = namebuf[n];
+
+			if(snprintf(namebuf[n], sizeof(namebuf[n]), "%s/%d/%.*s", context, sizes[s], len, base) >= (int)sizeof(namebuf[n])){
+				free((void *)blobs[n]);
+				blobs[n] = NULL;
+			}
+		}
+
+		kif_master_end(&master);
+
+		for(s = 0; s < nsizes && blobs[i * nsizes + s]; s++);
+
+		if(s < nsizes){
+			printf("Couldn't encode %s at size %d (or its name is too long)\n", files[i], sizes[s]);
+			break;
+		}
+
+		done = i + 1;
+	}
+
+	if(done == count){
+		trace_event('B', "pack_update", pack);
+		entries = kif_pack_update(pack, count * nsizes, names, blobs, lengths);
+		trace_event('E', "pack_update", pack);
+	}
+
+	for(i = 0; i < count * nsizes; i++){
+		free((void *)blobs[i]);
+	}
+
+	free(names);
+	free(blobs);
+	free(lengths);
+	free(namebuf);
+	return entries;
+}
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static long thread_id(void) {
+#ifdef __linux__
+	return (long)syscall(SYS_gettid);
+#else
+	return 1;
+#endif
+}
+
+// Copy text into a JSON string body, quotes and backslashes escaped and control characters replaced.
+// Stops early when out runs short, returns the length written.
+static int json_escape(char *out, int space, const char *text) {
+	int length = 0;
+
+	for(const char *c = text; *c && length < space - 2; c++){
+		if(*c == '"' || *c == '\\'){
+			out[length++] = '\\';
+		}
+
+		out[length++] = (unsigned char)*c < 0x20 ? '?' : *c;
+	}
+
+	out[length] = 0;
+	return length;
+}
+
+// Emit a begin ('B') or end ('E') event on the calling thread, file and size (when above 0) are added as arguments.
+// stdio locks the stream per call, so events from several threads do not interleave.
+static void trace_event_size(char phase, const char *name, const char *file, int size) {
+	if(!trace_file){
+		return;
+	}
+
+	char escaped[256], args[4200];
+
+	json_escape(escaped, sizeof(escaped), name);
+	args[0] = 0;
+
+	if(file){
+		int length = snprintf(args, sizeof(args), ",\"args\":{\"file\":\"");
+
+		length += json_escape(args + length, sizeof(args) - length - 32, file);
+		snprintf(args + length, sizeof(args) - length, size > 0 ? "\",\"size\":%d}" : "\"}", size);
+	}
+
+	fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.1f,\"pid\":1,\"tid\":%ld%s}", escaped, phase, (now_ms() - trace_start) * 1000.0, thread_id(), args);
+}
+
+static void trace_event(char phase, const char *name, const char *file) {
+	trace_event_size(phase, name, file, 0);
+}
+
+static void trace_close(void) {
+	if(trace_file){
+		fprintf(trace_file, "\n]\n");
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+static int trace_open(const char *filename) {
+	trace_file = fopen(filename, "w");
+
+	if(!trace_file){
+		printf("Couldn't open trace file %s\n", filename);
+		return 0;
+	}
+
+	trace_start = now_ms();
+	fprintf(trace_file, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"kifconv\"}}");
+	atexit(trace_close);
+	return 1;
+}
+
+// FNV-1a, 64 bit
+static uint64_t hash_bytes(const void *data, int size) {
+	const unsigned char *bytes = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for(int i = 0; i < size; i++){
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static cache_entry *cache_find(const char *name) {
+	for(int i = 0; i < cache_count; i++){
+		if(strcmp(cache[i].name, name) == 0){
+			return &cache[i];
+		}
+	}
+	return NULL;
+}
+
+static cache_entry *cache_add(const char *name) {
+	cache_entry *entry = cache_find(name);
+
+	if(entry){
+		return entry;
+	}
+
+	if(cache_count == cache_size){
+		int size = cache_size ? cache_size * 2 : 256;
+		cache_entry *grown = realloc(cache, size * sizeof(cache_entry));
+
+		// Out of memory, the file just stays uncached.
+		if(!grown){
+			return NULL;
+		}
+
+		cache = grown;
+		cache_size = size;
+	}
+
+	entry = &cache[cache_count++];
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	return entry;
+}
+
+static void cache_load(const char *outdir) {
+	char path[4096], name[256];
+	unsigned long long hash;
+	unsigned settings;
+
+	snprintf(path, sizeof(path), "%s/.kifcache", outdir);
+	FILE *f = fopen(path, "r");
+
+	if(!f){
+		return;
+	}
+
+	while(fscanf(f, "%llx %x %255[^\n]\n", &hash, &settings, name) == 3){
+		cache_entry *entry = cache_add(name);
+
+		if(!entry){
+			break;
+		}
+
+		entry->hash = hash;
+		entry->settings = settings;
+	}
+
+	fclose(f);
+}
+
+// Written to a temporary file first, so an interrupted run never leaves a truncated cache.
+static void cache_save(const char *outdir) {
+	char path[4096], temp[4096];
+
+	snprintf(path, sizeof(path), "%s/.kifcache", outdir);
+	snprintf(temp, sizeof(temp), "%s/.kifcache.tmp", outdir);
+	FILE *f = fopen(temp, "w");
+
+	if(!f){
+		return;
+	}
+
+	for(int i = 0; i < cache_count; i++){
+		fprintf(f, "%016llx %08x %s\n", (unsigned long long)cache[i].hash, cache[i].settings, cache[i].name);
+	}
+
+	fclose(f);
+	rename(temp, path);
+}
+
+// Converts indir/name.png to outdir/name.kif unless the cache says it is up to date.
+// Returns 1 if the file was encoded, 0 if it was skipped and -1 on failure.
+static int sync_file(const char *indir, const char *outdir, const char *name) {
+	char in[4096], out[4096];
+	int size, w, h, length, written = 0;
+	unsigned settings = (CACHE_VERSION << 16) | encoder_flags;
+	struct stat st;
+
+	snprintf(in, sizeof(in), "%s/%s", indir, name);
+	snprintf(out, sizeof(out), "%s/%.*s.kif", outdir, (int)strlen(name) - 4, name);
+
+	double start = now_ms();
+	trace_event('B', "file", in);
+	trace_event('B', "read", NULL);
+	void *data = read_file(in, &size);
+	trace_event('E', "read", NULL);
+
+	if(!data){
+		trace_event('E', "file", in);
+		return -1;
+	}
+
+	uint64_t hash = hash_bytes(data, size);
+	cache_entry *entry = cache_find(name);
+
+	if(entry && entry->hash == hash && entry->settings == settings && stat(out, &st) == 0){
+		free(data);
+		trace_event('E', "file", in);
+		return 0;
+	}
+
+	trace_event('B', "png_decode", NULL);
+	void *pixels = stbi_load_from_memory(data, size, &w, &h, NULL, 4);
+	trace_event('E', "png_decode", NULL);
+	free(data);
+
+	if(pixels){
+		void *encoded = kif_encode(pixels, &(KIFHeader){ .Width = w, .Height = h, .Compressed = encoder_flags }, &length);
+
+		trace_event('B', "write", NULL);
+		FILE *f = encoded ? fopen(out, "wb") : NULL;
+
+		if(f){
+			written = fwrite(encoded, 1, length, f) == (size_t)length;
+			written &= fclose(f) == 0;
+		}
+
+		trace_event('E', "write", NULL);
+		free(encoded);
+		free(pixels);
+	}
+
+	trace_event('E', "file", in);
+
+	if(!written){
+		printf("Couldn't convert %s\n", in);
+		return -1;
+	}
+
+	entry = cache_add(name);
+
+	if(entry){
+		entry->hash = hash;
+		entry->settings = settings;
+	}
+
+	printf("%s -> %s (%.2f ms)\n", in, out, now_ms() - start);
+	return 1;
+}
+
+// One incremental pass over every .png in indir. Returns the number of failures.
+static int sync_dir(const char *indir, const char *outdir) {
+	DIR *dir = opendir(indir);
+	struct dirent *ent;
+	int converted = 0, skipped = 0, failed = 0;
+
+	if(!dir){
+		printf("Couldn't open directory %s\n", indir);
+		return 1;
+	}
+
+	while((ent = readdir(dir)) != NULL){
+		if(strlen(ent->d_name) <= 4 || !STR_ENDS_WITH(ent->d_name, ".png")){
+			continue;
+		}
+
+		switch(sync_file(indir, outdir, ent->d_name)){
+			case 1: converted++; break;
+			case 0: skipped++; break;
+			default: failed++; break;
+		}
+	}
+
+	closedir(dir);
+
+	if(converted){
+		cache_save(outdir);
+	}
+
+	printf("%d converted, %d up to date, %d failed\n", converted, skipped, failed);
+	return failed;
+}
+
+// Re-encode files as soon as they are written or moved into indir.
+static int watch_dir(const char *indir, const char *outdir) {
+#ifdef __linux__
+	char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int fd = inotify_init();
+
+	if(fd < 0 || inotify_add_watch(fd, indir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+		printf("Couldn't watch %s\n", indir);
+		return 1;
+	}
+
+	printf("Watching %s for changes...\n", indir);
+	fflush(stdout);
+
+	for(;;){
+		ssize_t len = read(fd, buffer, sizeof(buffer));
+
+		if(len <= 0){
+			break;
+		}
+
+		for(char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			if(event->len && strlen(event->name) > 4 && STR_ENDS_WITH(event->name, ".png")){
+				if(sync_file(indir, outdir, event->name) > 0){
+					cache_save(outdir);
+				}
+			}
+		}
+
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 1;
+#else
+	printf("--watch is only supported on Linux\n");
+	return 1;
+#endif
+}
+
+// Build a theme index over packs given in inheritance order.
+static int build_theme_index(const char *output, int count, char **files) {
+	static const int sizes[] = { 16, 22, 24, 32, 48, 64, 96, 128, 256, 16, 22, 24, 32, 48, 64, 96, 128, 256 };
+	static const int scales[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2 };
+	KIFPack *packs = calloc(count, sizeof(KIFPack));
+	void *index = NULL;
+	int i, length, written = 0;
+
+	for(i = 0; i < count; i++){
+		int size;
+		trace_event('B', "read", files[i]);
+		void *data = read_file(files[i], &size);
+		trace_event('E', "read", files[i]);
+
+		if(!data || !kif_pack_open(&packs[i], data, size)){
+			printf("Couldn't open pack %s\n", files[i]);
+			free(data);
+			break;
+		}
+	}
+
+	if(i == count){
+		trace_event('B', "theme_build", output);
+		index = kif_theme_build(packs, count, sizes, scales, sizeof(sizes) / sizeof(sizes[0]), &length);
+		trace_event('E', "theme_build", output);
+	}
+
+	FILE *f = index ? fopen(output, "wb") : NULL;
+
+	if(f){
+		written = fwrite(index, 1, length, f) == (size_t)length;
+		written &= fclose(f) == 0;
+	}
+
+	while(i-- > 0){
+		free((void *)packs[i].Data);
+	}
+
+	free(packs);
+	free(index);
+	return written;
+}
+
+// Remove encoder and trace options from the argument list, encoder options turn into header flags.
+static int parse_encoder_options(int argc, char **argv) {
+	const char *trace = getenv("KIF_TRACE");
+	int count = 1;
+
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc){
+			trace = argv[++i];
+		}else if(strcmp(argv[i], "--alpha-order") == 0){
+			encoder_flags |= KIF_FLAG_ALPHA_ORDERED;
+		}else if(strcmp(argv[i], "--opaque-rects") == 0){
+			encoder_flags |= KIF_FLAG_OPAQUE_RECTS;
+		}else if(strcmp(argv[i], "--progressive") == 0){
+			encoder_flags |= KIF_FLAG_PROGRESSIVE;
+		}else if(strcmp(argv[i], "--placeholder") == 0){
+			encoder_flags |= KIF_FLAG_PLACEHOLDER;
+		}else{
+			argv[count++] = argv[i];
+		}
+	}
+
+	argv[count] = NULL;
+
+	if(trace && *trace && !trace_open(trace)){
+		exit(1);
+	}
+
+	return count;
+}
+
 int main(int argc, char **argv) {
+	argc = parse_encoder_options(argc, argv);
+
+	if(argc >= 4 && strcmp(argv[1], "--theme-index") == 0){
+		if(!build_theme_index(argv[2], argc - 3, argv + 3)){
+			printf("Couldn't write theme index %s\n", argv[2]);
+			exit(1);
+		}
+
+		return 0;
+	}
+
+	if(argc >= 4 && (strcmp(argv[1], "--incremental") == 0 || strcmp(argv[1], "--watch") == 0)){
+		cache_load(argv[3]);
+
+		int failed = sync_dir(argv[2], argv[3]);
+
+		if(strcmp(argv[1], "--watch") == 0){
+			failed = watch_dir(argv[2], argv[3]);
+		}
+
+		return failed ? 1 : 0;
+	}
+
+	if(argc >= 3 && strcmp(argv[1], "--pack") == 0){
+		int entries = pack_icons(argv[2], argc - 3, argv + 3);
+
+		if(entries < 0){
+			printf("Couldn't update pack %s\n", argv[2]);
+			exit(1);
+		}
+
+		printf("%s: %d icons\n", argv[2], entries);
+		return 0;
+	}
+
+	if(argc >= 4 && strcmp(argv[1], "--variants") == 0){
+		if(!encode_variants(argv[2], argc - 3, argv + 3)){
+			printf("Couldn't write %s\n", argv[2]);
+			exit(1);
+		}
+
+		return 0;
+	}
+
+	if(argc >= 4 && strcmp(argv[1], "--diff") == 0){
+		return diff_icons(argv[2], argv[3], argc > 4 ? argv[4] : NULL);
+	}
+
+	if(argc >= 6 && strcmp(argv[1], "--sizes") == 0){
+		int entries = pack_sizes(argv[3], argv[2], argv[4], argc - 5, argv + 5);
+
+		if(entries < 0){
+			printf("Couldn't update pack %s\n", argv[3]);
+			exit(1);
+		}
+
+		printf("%s: %d icons\n", argv[3], entries);
+		return 0;
+	}
+
+	if(argc >= 3 && strcmp(argv[1], "--compact") == 0){
+		int reclaimed = kif_pack_compact(argv[2], argc > 3 ? atoi(argv[3]) : 25);
+
+		if(reclaimed < 0){
+			printf("Couldn't compact pack %s\n", argv[2]);
+			exit(1);
+		}
+
+		printf("%s: reclaimed %d bytes\n", argv[2], reclaimed);
+		return 0;
+	}
+
 	if(argc < 3){
 		puts("Usage: kifconv <infile> <outfile>");
+		puts("       kifconv --pack <pack.kifp> <icon.kif|icon.png>...");
+		puts("       kifconv --variants <icon.kif> <name>=<icon.png|icon.kif>...");
+		puts("       kifconv --diff <a.kif> <b.kif> [diff.kif]");
+		puts("       kifconv --sizes <16,24,32,...> <pack.kifp> <context> <master.png|master.kif>...");
+		puts("       kifconv --compact <pack.kifp> [percent]");
+		puts("       kifconv --theme-index <index.kift> <pack.kifp>...");
+		puts("       kifconv --incremental|--watch <indir> <outdir>");
 		puts("Examples:");
 		puts("  kifconv input.png output.kif");
 		puts("  kifconv input.kif output.png");
+		puts("  kifconv input.qoi output.kif");
+		puts("  kifconv --pack theme.kifp folder.kif file.png");
+		puts("  kifconv --sizes 16,24,32,48 theme.kifp places folder.png");
 		exit(1);
 	}
 
+	// Straight from the palette and runs to an indexed PNG, without decoding to RGBA
+	if(STR_ENDS_WITH(argv[1], ".kif") && STR_ENDS_WITH(argv[2], ".png")){
+		int size;
+		void *data = read_file(argv[1], &size);
+
+		trace_event('B', "png_encode", argv[2]);
+		int written = data ? kif_write_png(argv[2], data) : 0;
+		trace_event('E', "png_encode", argv[2]);
+		free(data);
+
+		if(!written){
+			printf("Couldn't write/encode %s\n", argv[2]);
+			exit(1);
+		}
+
+		return 0;
+	}
+
+	// QOI <> KIF in the run domain, neither side is decoded to pixels
+	if((STR_ENDS_WITH(argv[1], ".kif") && STR_ENDS_WITH(argv[2], ".qoi")) || (STR_ENDS_WITH(argv[1], ".qoi") && STR_ENDS_WITH(argv[2], ".kif"))){
+		int size, length, written = 0;
+		void *data = read_file(argv[1], &size);
+		void *converted = NULL;
+
+		if(data){
+			converted = STR_ENDS_WITH(argv[1], ".qoi") ? qoi_to_kif(data, size, &length) : kif_to_qoi(data, &length);
+		}
+
+		if(converted){
+			written = write_file(argv[2], converted, length);
+		}
+
+		free(converted);
+		free(data);
+
+		if(!written){
+			printf("Couldn't convert %s\n", argv[1]);
+			exit(1);
+		}
+
+		return 0;
+	}
+
 	void *pixels = NULL;
 	int w, h, channels, palEntries, RLEEntries;
 
@@ -50,7 +960,9 @@ int main(int argc, char **argv) {
 			channels = 4;
 		}
 
+		trace_event('B', "png_decode", argv[1]);
 		pixels = (void *)stbi_load(argv[1], &w, &h, NULL, channels);
+		trace_event('E', "png_decode", argv[1]);
 	}else if(STR_ENDS_WITH(argv[1], ".kif")){
 		KIFHeader desc;
 		pixels = kif_read(argv[1], &desc, 32);
@@ -70,11 +982,14 @@ int main(int argc, char **argv) {
 	int encoded = 0;
 
 	if(STR_ENDS_WITH(argv[2], ".png")){
+		trace_event('B', "png_encode", argv[2]);
 		encoded = stbi_write_png(argv[2], w, h, channels, pixels, 0);
+		trace_event('E', "png_encode", argv[2]);
 	}else if(STR_ENDS_WITH(argv[2], ".kif")){
 		encoded = kif_write(argv[2], pixels, &(KIFHeader){
 			.Width = w,
-			.Height = h
+			.Height = h,
+			.Compressed = encoder_flags
 		});
 	}
 
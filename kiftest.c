@@ -0,0 +1,1581 @@
+/*
+
+Copyright (c) 1998 - 2023, Philipe Rubio
+SPDX-License-Identifier: MIT
+
+Round-trip and malformed input tests for kif.h
+
+Requires:
+	-"kif.h" (https://github.com/Masq666/kif/blob/main/kif.h)
+
+Usage:
+	kiftest
+
+	Runs every test and prints the checks that failed, the exit code is the number of failed checks.
+	The pack and theme tests create and remove kiftest.kifp in the current directory, the cache test kiftest.cache.
+
+Tests:
+	round_trip		kif_encode() then kif_decode() at 32 and 24 bpp, with every combination of encoder flags
+	padded			kif_decode_padded() stays inside KIF_DECODE_PADDED_SIZE(), which is computed in size_t
+	limits			kif_check_header(), kif_decode_limited() and the KIF_DEFAULT_LIMITS of kif_decode()
+	truncated		Truncated runs decode as transparent black for every orientation
+	pack			kif_pack_update() round-trip, long names, removal and kif_pack_compact()
+	theme			kif_theme_lookup() on a built index, and on truncated or corrupt ones
+	variants		Palette variants, and VARS chunks that are too short for what they claim
+	composite		kif_composite() at offsets inside, across and outside the base, against a blend of the decoded icons
+	blit			kif_blit() onto a padded surface at clipped offsets, with and without an alpha ordered palette
+	spans			kif_for_each_span() painted into a buffer matches the decoded pixels, with long runs merged
+	collide			kif_collide() at every overlapping offset against an AND of the decoded alpha masks
+	progressive		kif_progressive_update() fed a byte at a time ends up with the kif_decode() pixels
+	cache			kif_cache_open() skips index lines whose path is too long for its buffer (POSIX only)
+	png				kif_encode_png() inflated and mapped through PLTE/tRNS matches kif_decode(), kif_write_png() writes the same bytes
+	qoi				kif_to_qoi() read by a plain QOI decoder, and qoi_to_kif() of that, match kif_decode()
+	encode_step		kif_encode_begin(), kif_encode_step() and kif_encode_finish() give the kif_encode() bytes for any budget
+	master			kif_master_encode() of masters with too many colors maps kif_resize() pixels to their nearest palette color
+	yuv				kif_decode_yuv() I420 and NV12 planes against kif_decode(), whole and truncated icons
+	diff			kif_diff() and the kif_diff_encode() mask against a pixel by pixel comparison of the decoded icons
+	histogram		kif_histogram() against a count of the decoded pixels, and kif_dominant_colors() with and without merging
+
+Compile with:
+	gcc kiftest.c -std=c99 -O2 -o kiftest
+
+*/
+
+#include "kif.h"
+
+#define PACK_FILE "kiftest.kifp"
+#define CACHE_DIR "kiftest.cache"
+
+#define CHECK(Condition) check(Condition, #Condition, __func__, __LINE__)
+
+static int failures = 0;
+
+static void check(int condition, const char *text, const char *test, int line) {
+	if(!condition){
+		printf("%s:%d: %s failed\n", test, line, text);
+		failures++;
+	}
+}
+
+// Deterministic pixels with runs of random length over a few colors, some of them translucent.
+static uint32_t *make_image(int w, int h, int colors, unsigned *seed) {
+	uint32_t *pixels = malloc((size_t)w * h * sizeof(uint32_t));
+	uint32_t palette[16];
+
+	for(int i = 0; i < colors; i++){
+		*seed = *seed * 1103515245 + 12345;
+		palette[i] = *seed ^ (*seed >> 15);
+	}
+
+	palette[0] = 0;
+
+	for(int i = 0, c = 0; i < w * h; i++){
+		*seed = *seed * 1103515245 + 12345;
+
+		if((*seed >> 16) % 5 == 0){
+			c = (*seed >> 8) % colors;
+		}
+
+		pixels[i] = palette[c];
+	}
+
+	return pixels;
+}
+
+// Straight alpha source-over, in floating point so it does not share any rounding with kif.h.
+static uint32_t blend_reference(uint32_t dst, uint32_t src) {
+	kif_rgba_t d, s, out;
+	d.v = dst;
+	s.v = src;
+
+	double sa = s.rgba.a / 255.0, da = d.rgba.a / 255.0 * (1 - sa), a = sa + da;
+
+	if(a == 0){
+		return dst;
+	}
+
+	out.rgba.r = (unsigned char)((s.rgba.r * sa + d.rgba.r * da) / a + 0.5);
+	out.rgba.g = (unsigned char)((s.rgba.g * sa + d.rgba.g * da) / a + 0.5);
+	out.rgba.b = (unsigned char)((s.rgba.b * sa + d.rgba.b * da) / a + 0.5);
+	out.rgba.a = (unsigned char)(a * 255 + 0.5);
+
+	return out.v;
+}
+
+// Every channel within 1 of the reference, the color of fully transparent pixels does not matter.
+static int near_rgba(const uint32_t *pixels, const uint32_t *reference, int count) {
+	for(int i = 0; i < count; i++){
+		kif_rgba_t p, r;
+		p.v = pixels[i];
+		r.v = reference[i];
+
+		if(abs(p.rgba.a - r.rgba.a) > 1 || (r.rgba.a != 0 && (abs(p.rgba.r - r.rgba.r) > 1 || abs(p.rgba.g - r.rgba.g) > 1 || abs(p.rgba.b - r.rgba.b) > 1))){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int same_rgb(const unsigned char *rgb, const uint32_t *rgba, int count) {
+	for(int i = 0; i < count; i++){
+		kif_rgba_t color;
+		color.v = rgba[i];
+
+		if(rgb[i * 3] != color.rgba.r || rgb[i * 3 + 1] != color.rgba.g || rgb[i * 3 + 2] != color.rgba.b){
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void test_round_trip(void) {
+	static const int sizes[][2] = { { 1, 1 }, { 16, 16 }, { 33, 7 }, { 7, 61 }, { 300, 2 } };
+	unsigned seed = 1;
+
+	for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++){
+		int w = sizes[s][0], h = sizes[s][1];
+
+		for(int flags = 0; flags < 0x10; flags++){
+			uint32_t *pixels = make_image(w, h, 1 + s * 3, &seed);
+			KIFHeader header = { .Width = w, .Height = h, .Compressed = flags };
+			KIFHeader decoded_header;
+			int length;
+			void *encoded = kif_encode(pixels, &header, &length);
+
+			CHECK(encoded != NULL);
+
+			if(encoded){
+				uint32_t *rgba = kif_decode(encoded, &decoded_header, 32);
+				unsigned char *rgb = kif_decode(encoded, &decoded_header, 24);
+
+				CHECK(rgba != NULL && memcmp(rgba, pixels, (size_t)w * h * 4) == 0);
+				CHECK(rgb != NULL && same_rgb(rgb, pixels, w * h));
+				CHECK(decoded_header.Width == w && decoded_header.Height == h);
+
+				free(rgba);
+				free(rgb);
+			}
+
+			free(encoded);
+			free(pixels);
+		}
+	}
+}
+
+static void test_padded(void) {
+	unsigned seed = 2;
+	int w = 37, h = 11;
+	uint32_t *pixels = make_image(w, h, 6, &seed);
+	KIFHeader header = { .Width = w, .Height = h };
+	int length;
+	void *encoded = kif_encode(pixels, &header, &length);
+	size_t size = KIF_DECODE_PADDED_SIZE(w, h, 32);
+	int stride = KIF_DECODE_STRIDE(w, 32);
+
+	// Guard bytes after the padded size catch block stores that run past KIF_DECODE_SLACK.
+	unsigned char *buffer = malloc(size + KIF_DECODE_ALIGN + 256);
+	unsigned char *output = buffer + (KIF_DECODE_ALIGN - (uintptr_t)buffer % KIF_DECODE_ALIGN) % KIF_DECODE_ALIGN;
+
+	memset(output, 0xCD, size + 256);
+	CHECK(kif_decode_padded(encoded, &header, output, stride, 32) == 1);
+
+	for(int y = 0; y < h; y++){
+		CHECK(memcmp(output + (size_t)y * stride, pixels + y * w, w * 4) == 0);
+	}
+
+	int untouched = 1;
+
+	for(int i = 0; i < 256; i++){
+		untouched &= output[size + i] == 0xCD;
+	}
+
+	CHECK(untouched);
+	CHECK(kif_decode_padded(encoded, &header, output + 4, stride, 32) == 0);
+	CHECK(kif_decode_padded(encoded, &header, output, stride + 4, 32) == 0);
+
+	// 65535 x 65535 at 32 bpp is 16 GB, more than an int or a 32-bit size can hold.
+	CHECK((uint64_t)KIF_DECODE_PADDED_SIZE(65535, 65535, 32) > 0xFFFFFFFFull || sizeof(size_t) < 8);
+
+	free(buffer);
+	free(encoded);
+	free(pixels);
+}
+
+static void test_limits(void) {
+	unsigned char data[sizeof(KIFHeader) + 4 + 2] = { 0 };
+	KIFHeader *header = (KIFHeader *)data;
+	KIFHeader out;
+	KIFLimits icon = KIF_ICON_LIMITS;
+	int error;
+
+	header->Magic = 0x6B696631;
+	header->BPP = 32;
+	header->Width = 65535;
+	header->Height = 65535;
+	header->palEntries = 1;
+	header->RLEEntries = 1;
+	data[sizeof(KIFHeader) + 5] = 255;
+
+	// Rejected before anything is allocated, instead of asking for 17 GB.
+	CHECK(kif_decode(data, &out, 32) == NULL);
+	CHECK(kif_decode_variant(data, &out, 0, 32) == NULL);
+	CHECK(kif_check_header(data, 32, &icon, &out) == KIF_ERROR_PIXELS);
+	CHECK(kif_decode_limited(data, sizeof(data), &out, 32, &icon, &error) == NULL && error == KIF_ERROR_PIXELS);
+
+	header->Width = 16;
+	header->Height = 16;
+	CHECK(kif_check_header(data, 32, &icon, &out) == KIF_LIMIT_OK);
+	CHECK(kif_check_header(data, 16, &icon, &out) == KIF_ERROR_FORMAT);
+	CHECK(kif_decode_limited(data, sizeof(data) - 1, &out, 32, &icon, &error) == NULL && error == KIF_ERROR_TRUNCATED);
+
+	// The run uses palette entry 1, the palette has one entry.
+	data[sizeof(KIFHeader) + 4] = 1;
+	CHECK(kif_decode_limited(data, sizeof(data), &out, 32, &icon, &error) == NULL && error == KIF_ERROR_CORRUPT);
+
+	data[sizeof(KIFHeader) + 4] = 0;
+	void *decoded = kif_decode_limited(data, sizeof(data), &out, 32, &icon, &error);
+
+	CHECK(decoded != NULL && error == KIF_LIMIT_OK);
+	free(decoded);
+
+	header->Magic = 0;
+	CHECK(kif_check_header(data, 32, NULL, &out) == KIF_ERROR_FORMAT);
+	CHECK(kif_decode(data, &out, 32) == NULL);
+}
+
+static void test_truncated(void) {
+	unsigned seed = 3;
+	int w = 19, h = 13;
+	uint32_t *pixels = make_image(w, h, 5, &seed);
+	KIFHeader header = { .Width = w, .Height = h };
+	int length;
+	unsigned char *encoded = kif_encode(pixels, &header, &length);
+	uint32_t expected[19 * 13], output[19 * 13];
+
+	// Drop the second half of the runs.
+	((KIFHeader *)encoded)->RLEEntries /= 2;
+
+	memset(expected, 0xAB, sizeof(expected));
+	CHECK(kif_decode_into(encoded, &header, expected, w * 4, 32) == 1);
+	CHECK(expected[w * h - 1] == 0);
+
+	uint32_t *decoded = kif_decode(encoded, &header, 32);
+
+	CHECK(decoded != NULL && memcmp(decoded, expected, sizeof(expected)) == 0);
+	free(decoded);
+
+	for(int orientation = 0; orientation < 8; orientation++){
+		int rotation = orientation & KIF_ROTATE_270;
+		int ow = (rotation & KIF_ROTATE_90) ? h : w, oh = (rotation & KIF_ROTATE_90) ? w : h;
+		int same = 1;
+
+		memset(output, 0xAB, sizeof(output));
+		CHECK(kif_decode_oriented(encoded, &header, output, ow * 4, 32, rotation | (orientation & 4 ? KIF_FLIP_VERTICAL : 0)) == 1);
+
+		for(int y = 0; y < h; y++){
+			for(int x = 0; x < w; x++){
+				int ox = rotation == KIF_ROTATE_90 ? h - 1 - y : rotation == KIF_ROTATE_180 ? w - 1 - x : rotation == KIF_ROTATE_270 ? y : x;
+				int oy = rotation == KIF_ROTATE_90 ? x : rotation == KIF_ROTATE_180 ? h - 1 - y : rotation == KIF_ROTATE_270 ? w - 1 - x : y;
+
+				oy = orientation & 4 ? oh - 1 - oy : oy;
+				same &= output[oy * ow + ox] == expected[y * w + x];
+			}
+		}
+
+		CHECK(same);
+	}
+
+	free(encoded);
+	free(pixels);
+}
+
+static void *read_pack(int *size) {
+	FILE *f = fopen(PACK_FILE, "rb");
+	void *data = NULL;
+
+	if(f && fseek(f, 0, SEEK_END) == 0 && (*size = (int)ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0){
+		data = malloc(*size);
+
+		if(data && fread(data, 1, *size, f) != (size_t)*size){
+			free(data);
+			data = NULL;
+		}
+	}
+
+	if(f){
+		fclose(f);
+	}
+
+	return data;
+}
+
+static void test_pack(void) {
+	char long_name[49];
+	const char *names[3] = { "actions/16/edit", "apps/16/term", long_name };
+	const void *blobs[3] = { "first", "second", "third" };
+	int lengths[3] = { 5, 6, 5 };
+	KIFPack pack;
+	int size, length;
+
+	remove(PACK_FILE);
+	memset(long_name, 'x', 48);
+	long_name[48] = 0;
+
+	// A name that does not fit the 48 byte field fails the whole update before the file is created.
+	CHECK(kif_pack_update(PACK_FILE, 3, names, blobs, lengths) == -1);
+
+	FILE *f = fopen(PACK_FILE, "rb");
+
+	CHECK(f == NULL);
+
+	if(f){
+		fclose(f);
+	}
+
+	long_name[47] = 0;
+	CHECK(kif_pack_update(PACK_FILE, 3, names, blobs, lengths) == 3);
+	CHECK(kif_pack_put(PACK_FILE, "apps/16/term", "SECOND!", 7) == 3);
+	CHECK(kif_pack_put(PACK_FILE, "actions/16/edit", NULL, 0) == 2);
+	CHECK(kif_pack_put(PACK_FILE, "missing", NULL, 0) == 2);
+
+	unsigned char *data = read_pack(&size);
+
+	CHECK(data != NULL && kif_pack_open(&pack, data, size));
+
+	if(data){
+		const char *blob = kif_pack_find(&pack, "apps/16/term", &length);
+
+		CHECK(blob != NULL && length == 7 && memcmp(blob, "SECOND!", 7) == 0);
+		CHECK(kif_pack_find(&pack, "actions/16/edit", &length) == NULL);
+		CHECK(pack.Header.IndexEntries == 2 && pack.Header.DeadBytes > 0);
+		free(data);
+	}
+
+	// Above the threshold nothing happens, at 0 the dead blobs and old index generations go.
+	CHECK(kif_pack_compact(PACK_FILE, 100) == 0);
+	CHECK(kif_pack_compact(PACK_FILE, 0) > 0);
+
+	data = read_pack(&size);
+	CHECK(data != NULL && kif_pack_open(&pack, data, size));
+
+	if(data){
+		const char *blob = kif_pack_find(&pack, long_name, &length);
+
+		CHECK(blob != NULL && length == 5 && memcmp(blob, "third", 5) == 0);
+		blob = kif_pack_find(&pack, "apps/16/term", &length);
+		CHECK(blob != NULL && length == 7 && memcmp(blob, "SECOND!", 7) == 0);
+		CHECK(pack.Header.IndexEntries == 2 && pack.Header.DeadBytes == 0);
+		CHECK((uint64_t)size == sizeof(KIFPackHeader) + 12 + 2 * sizeof(KIFPackEntry));
+		free(data);
+	}
+
+	remove(PACK_FILE);
+}
+
+static void test_theme(void) {
+	const char *names[4] = { "apps/16/fox", "apps/48/fox", "apps/24/dog", "not-a-theme-name" };
+	const void *blobs[4] = { "A", "B", "C", "D" };
+	int lengths[4] = { 1, 1, 1, 1 };
+	int sizes[2] = { 16, 48 }, scales[2] = { 1, 1 };
+	KIFPack pack;
+	int size, length;
+
+	remove(PACK_FILE);
+	CHECK(kif_pack_update(PACK_FILE, 4, names, blobs, lengths) == 4);
+
+	unsigned char *data = read_pack(&size);
+	unsigned char *index = data && kif_pack_open(&pack, data, size) ? kif_theme_build(&pack, 1, sizes, scales, 2, &length) : NULL;
+
+	CHECK(index != NULL);
+
+	if(index){
+		KIFThemeHeader *header = (KIFThemeHeader *)index;
+		KIFThemeSlot *table = (KIFThemeSlot *)(index + sizeof(KIFThemeHeader));
+		const KIFThemeSlot *slot = kif_theme_lookup(index, length, "apps", "fox", 48, 1);
+
+		CHECK(slot != NULL && data[slot->BlobOffset] == 'B');
+		slot = kif_theme_lookup(index, length, "apps", "dog", 16, 1);
+		CHECK(slot != NULL && data[slot->BlobOffset] == 'C');
+		CHECK(kif_theme_lookup(index, length, "apps", "cow", 16, 1) == NULL);
+
+		// Truncated or corrupt indexes are turned away before probing.
+		CHECK(kif_theme_lookup(index, length - 1, "apps", "fox", 48, 1) == NULL);
+		CHECK(kif_theme_lookup(index, sizeof(KIFThemeHeader), "apps", "fox", 48, 1) == NULL);
+
+		header->Slots *= 4;
+		CHECK(kif_theme_lookup(index, length, "apps", "fox", 48, 1) == NULL);
+		header->Slots = header->Slots / 4 + 1;
+		CHECK(kif_theme_lookup(index, length, "apps", "fox", 48, 1) == NULL);
+		header->Slots -= 1;
+
+		header->StringsOffset += 8;
+		CHECK(kif_theme_lookup(index, length, "apps", "fox", 48, 1) == NULL);
+		header->StringsOffset -= 8;
+
+		for(uint32_t i = 0; i < header->Slots; i++){
+			table[i].NameOffset += header->StringsSize;
+		}
+
+		CHECK(kif_theme_lookup(index, length, "apps", "fox", 48, 1) == NULL);
+	}
+
+	free(index);
+	free(data);
+	remove(PACK_FILE);
+}
+
+static void test_variants(void) {
+	uint32_t light[16], dark[16];
+	const void *images[2] = { light, dark };
+	const char *names[2] = { "light", "dark" };
+	KIFHeader header = { .Width = 4, .Height = 4 };
+	const char *name;
+	int length;
+
+	for(int i = 0; i < 16; i++){
+		light[i] = i < 6 ? 0xFF2040E0 : 0xFFF0F0F0;
+		dark[i] = i < 6 ? 0xFFE04020 : 0xFF101010;
+	}
+
+	unsigned char *encoded = kif_encode_variants(images, names, 2, &header, &length);
+	uint32_t output[16];
+
+	CHECK(encoded != NULL);
+
+	if(encoded == NULL){
+		return;
+	}
+
+	CHECK(kif_variant_count(encoded) == 2);
+	CHECK(kif_variant_find(encoded, "dark") == 1);
+	CHECK(kif_decode_variant_into(encoded, &header, 1, output, 16, 32) == 1 && memcmp(output, dark, sizeof(dark)) == 0);
+
+	unsigned char *chunk = (unsigned char *)kif_find_chunk(encoded, "VARS", &length);
+	unsigned char count[4];
+
+	CHECK(chunk != NULL);
+
+	if(chunk == NULL){
+		free(encoded);
+		return;
+	}
+
+	// A variant count the chunk has no room for leaves just the main palette, named "".
+	memcpy(count, chunk, 4);
+	memset(chunk, 0xFF, 4);
+	CHECK(kif_variant_count(encoded) == 1);
+	CHECK(kif_variant_palette(encoded, 0, &name) != NULL && name[0] == 0);
+	CHECK(kif_variant_palette(encoded, 1, &name) == NULL);
+	CHECK(kif_variant_find(encoded, "dark") == -1);
+	CHECK(kif_decode_variant_into(encoded, &header, 1, output, 16, 32) == 0);
+	CHECK(kif_decode_variant_into(encoded, &header, 0, output, 16, 32) == 1 && memcmp(output, light, sizeof(light)) == 0);
+
+	memcpy(chunk, count, 4);
+	CHECK(kif_variant_palette(encoded, 0, &name) != NULL && strcmp(name, "light") == 0);
+
+	free(encoded);
+}
+
+static void test_composite(void) {
+	static const int offsets[][2] = { { 5, 4 }, { -3, -2 }, { 18, 13 }, { 0, 0 }, { 30, 1 }, { -9, 20 } };
+	unsigned seed = 4;
+	int w = 23, h = 17, ow = 9, oh = 7;
+	uint32_t *base_pixels = make_image(w, h, 6, &seed);
+	uint32_t *overlay_pixels = make_image(ow, oh, 5, &seed);
+	KIFHeader base_header = { .Width = w, .Height = h };
+	KIFHeader overlay_header = { .Width = ow, .Height = oh };
+	int length;
+	void *base = kif_encode(base_pixels, &base_header, &length);
+	void *overlay = kif_encode(overlay_pixels, &overlay_header, &length);
+
+	for(int o = 0; o < (int)(sizeof(offsets) / sizeof(offsets[0])); o++){
+		int x = offsets[o][0], y = offsets[o][1];
+		uint32_t *expected = kif_decode(base, &base_header, 32);
+		uint32_t *top = kif_decode(overlay, &overlay_header, 32);
+		void *composited = kif_composite(base, overlay, x, y, &length);
+		KIFHeader header;
+
+		for(int oy = 0; oy < oh; oy++){
+			for(int ox = 0; ox < ow; ox++){
+				if(x + ox >= 0 && x + ox < w && y + oy >= 0 && y + oy < h){
+					expected[(y + oy) * w + x + ox] = blend_reference(expected[(y + oy) * w + x + ox], top[oy * ow + ox]);
+				}
+			}
+		}
+
+		CHECK(composited != NULL);
+
+		if(composited){
+			uint32_t *output = kif_decode(composited, &header, 32);
+
+			CHECK(output != NULL && header.Width == w && header.Height == h && near_rgba(output, expected, w * h));
+			free(output);
+		}
+
+		free(composited);
+		free(top);
+		free(expected);
+	}
+
+	free(overlay);
+	free(base);
+	free(overlay_pixels);
+	free(base_pixels);
+}
+
+static void test_blit(void) {
+	static const int offsets[][2] = { { 3, 2 }, { -4, -5 }, { 20, 10 }, { 31, 0 }, { 0, -12 } };
+	unsigned seed = 5;
+	int w = 11, h = 9, dw = 25, dh = 14, stride = 32;
+	uint32_t *icon_pixels = make_image(w, h, 7, &seed);
+	uint32_t *surface_pixels = make_image(dw, dh, 4, &seed);
+
+	// Both palette orders, the alpha ordered one takes the opaque fill path without blending.
+	for(int flags = 0; flags <= KIF_FLAG_ALPHA_ORDERED; flags++){
+		KIFHeader header = { .Width = w, .Height = h, .Compressed = flags };
+		int length;
+		void *icon = kif_encode(icon_pixels, &header, &length);
+		uint32_t *decoded = kif_decode(icon, &header, 32);
+
+		CHECK(icon != NULL && decoded != NULL && memcmp(decoded, icon_pixels, (size_t)w * h * 4) == 0);
+
+		for(int o = 0; icon && decoded && o < (int)(sizeof(offsets) / sizeof(offsets[0])); o++){
+			int x = offsets[o][0], y = offsets[o][1];
+			uint32_t surface[14 * 32], expected[14 * 32];
+
+			memset(surface, 0xAB, sizeof(surface));
+
+			for(int sy = 0; sy < dh; sy++){
+				memcpy(surface + sy * stride, surface_pixels + sy * dw, dw * 4);
+			}
+
+			memcpy(expected, surface, sizeof(expected));
+
+			for(int iy = 0; iy < h; iy++){
+				for(int ix = 0; ix < w; ix++){
+					if(x + ix >= 0 && x + ix < dw && y + iy >= 0 && y + iy < dh){
+						expected[(y + iy) * stride + x + ix] = blend_reference(expected[(y + iy) * stride + x + ix], decoded[iy * w + ix]);
+					}
+				}
+			}
+
+			CHECK(kif_blit(icon, surface, stride * 4, dw, dh, x, y) == 1);
+
+			int same = 1;
+
+			// The clipped area and the padding after each row have to stay as they were.
+			for(int sy = 0; sy < dh; sy++){
+				same &= near_rgba(surface + sy * stride, expected + sy * stride, dw);
+				same &= memcmp(surface + sy * stride + dw, expected + sy * stride + dw, (stride - dw) * 4) == 0;
+			}
+
+			CHECK(same);
+		}
+
+		free(decoded);
+		free(icon);
+	}
+
+	free(surface_pixels);
+	free(icon_pixels);
+}
+
+typedef struct {
+	uint32_t *pixels;
+	int width, height, next, ordered, count, stop;
+} span_paint;
+
+// Paints every span and checks they come in row order, without gaps unless transparent ones are skipped.
+static int paint_span(const KIFSpan *span, void *user) {
+	span_paint *paint = user;
+	int start = span->Y * paint->width + span->X;
+
+	if(span->Y >= paint->height || span->Length <= 0 || span->X + span->Length > paint->width || start < paint->next){
+		paint->ordered = 0;
+		return 1;
+	}
+
+	for(int i = 0; i < span->Length; i++){
+		paint->pixels[start + i] = span->Color.v;
+	}
+
+	paint->next = start + span->Length;
+	return ++paint->count == paint->stop;
+}
+
+static void test_spans(void) {
+	static const int sizes[][2] = { { 1, 1 }, { 19, 13 }, { 300, 3 }, { 600, 2 } };
+	unsigned seed = 6;
+
+	for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++){
+		int w = sizes[s][0], h = sizes[s][1];
+		uint32_t *pixels = make_image(w, h, 1 + s * 2, &seed);
+		KIFHeader header = { .Width = w, .Height = h };
+		int length;
+
+		// One color per row for the last size, spans longer than the 255 pixel runs have to be merged.
+		for(int i = 0; s == 3 && i < w * h; i++){
+			pixels[i] = i < w ? 0xFF102030 : 0x80405060;
+		}
+
+		void *encoded = kif_encode(pixels, &header, &length);
+		uint32_t *decoded = kif_decode(encoded, &header, 32);
+
+		CHECK(encoded != NULL && decoded != NULL);
+
+		for(int flags = 0; encoded && decoded && flags <= KIF_SPAN_SKIP_TRANSPARENT; flags++){
+			span_paint paint = { calloc((size_t)w * h, 4), w, h, 0, 1, 0, -1 };
+
+			CHECK(kif_for_each_span(encoded, flags, paint_span, &paint) == 1);
+			CHECK(paint.ordered && (flags || paint.next == w * h));
+			CHECK(flags ? near_rgba(paint.pixels, decoded, w * h) : memcmp(paint.pixels, decoded, (size_t)w * h * 4) == 0);
+			CHECK(s != 3 || paint.count == h);
+
+			// Stopping early reports that not every span was visited.
+			if(paint.count > 1){
+				paint.stop = paint.count / 2;
+				paint.count = 0;
+				paint.next = 0;
+				CHECK(kif_for_each_span(encoded, flags, paint_span, &paint) == 0 && paint.count == paint.stop);
+			}
+
+			free(paint.pixels);
+		}
+
+		free(decoded);
+		free(encoded);
+		free(pixels);
+	}
+}
+
+static void test_collide(void) {
+	unsigned seed = 7;
+	int aw = 13, ah = 9, bw = 7, bh = 11;
+	uint32_t *a_pixels = make_image(aw, ah, 3, &seed);
+	uint32_t *b_pixels = make_image(bw, bh, 3, &seed);
+	KIFHeader a_header = { .Width = aw, .Height = ah };
+	KIFHeader b_header = { .Width = bw, .Height = bh };
+	int length, hits = 0, same = 1;
+	unsigned char garbage[sizeof(KIFHeader) + 8] = { 0 };
+	void *a = kif_encode(a_pixels, &a_header, &length);
+	void *b = kif_encode(b_pixels, &b_header, &length);
+	uint32_t *a_decoded = kif_decode(a, &a_header, 32);
+	uint32_t *b_decoded = kif_decode(b, &b_header, 32);
+
+	CHECK(a_decoded != NULL && b_decoded != NULL);
+
+	// Every offset with any overlap of the bounding boxes, and a ring of offsets just outside them.
+	for(int dy = -bh - 1; a_decoded && b_decoded && dy <= ah + 1; dy++){
+		for(int dx = -bw - 1; dx <= aw + 1; dx++){
+			int expected = 0;
+
+			// AND of the two alpha masks.
+			for(int y = 0; y < ah && !expected; y++){
+				for(int x = 0; x < aw && !expected; x++){
+					int bx = x - dx, by = y - dy;
+
+					if(bx >= 0 && bx < bw && by >= 0 && by < bh){
+						expected = (a_decoded[y * aw + x] >> 24) != 0 && (b_decoded[by * bw + bx] >> 24) != 0;
+					}
+				}
+			}
+
+			same &= kif_collide(a, 5, -3, b, 5 + dx, -3 + dy) == expected;
+			same &= kif_collide(b, 5 + dx, -3 + dy, a, 5, -3) == expected;
+			hits += expected;
+		}
+	}
+
+	CHECK(same);
+	CHECK(hits > 0);
+	CHECK(kif_collide(a, 0, 0, garbage, 0, 0) == 0);
+
+	free(b_decoded);
+	free(a_decoded);
+	free(b);
+	free(a);
+	free(b_pixels);
+	free(a_pixels);
+}
+
+static void test_progressive(void) {
+	unsigned seed = 8;
+	int w = 37, h = 29;
+	uint32_t *pixels = make_image(w, h, 6, &seed);
+
+	for(int flags = 0; flags <= KIF_FLAG_PROGRESSIVE; flags += KIF_FLAG_PROGRESSIVE){
+		KIFHeader header = { .Width = w, .Height = h, .Compressed = flags };
+		int length;
+		unsigned char *encoded = kif_encode(pixels, &header, &length);
+
+		CHECK(encoded != NULL);
+
+		for(int bpp = 24; encoded && bpp <= 32; bpp += 8){
+			int stride = w * (bpp / 8);
+			unsigned char *expected = kif_decode(encoded, &header, bpp);
+			unsigned char *output = calloc(h, stride);
+			KIFProgressive state;
+			int stage = KIF_PROGRESS_NONE, previewed = 0, rows_ok = 1, monotonic = 1;
+
+			kif_progressive_init(&state);
+
+			// Feed the icon a byte at a time, each call gets a copy of exactly the bytes received so far.
+			for(int available = 0; available <= length && stage != KIF_PROGRESS_DONE; available++){
+				unsigned char *received = malloc(available ? available : 1);
+
+				memcpy(received, encoded, available);
+				int next = kif_progressive_update(&state, received, available, output, stride, bpp);
+				free(received);
+
+				monotonic &= next >= stage;
+				previewed |= next == KIF_PROGRESS_PREVIEW;
+				stage = next;
+
+				// Rows above the refinement point are final.
+				if(stage >= KIF_PROGRESS_PARTIAL){
+					rows_ok &= memcmp(output, expected, (size_t)state.Y * stride) == 0;
+				}
+			}
+
+			CHECK(monotonic && rows_ok);
+			CHECK(previewed == ((flags & KIF_FLAG_PROGRESSIVE) != 0));
+			CHECK(stage == KIF_PROGRESS_DONE && state.Header.Width == w && state.Header.Height == h);
+			CHECK(expected != NULL && memcmp(output, expected, (size_t)h * stride) == 0);
+
+			free(output);
+			free(expected);
+		}
+
+		free(encoded);
+	}
+
+	free(pixels);
+}
+
+#ifdef KIF_DISK_CACHE
+
+static void test_cache(void) {
+	KIFCache cache;
+	FILE *f;
+
+	mkdir(CACHE_DIR, 0700);
+	f = fopen(CACHE_DIR "/index", "w");
+	CHECK(f != NULL);
+
+	if(f == NULL){
+		return;
+	}
+
+	// The middle path does not fit the line buffer of kif_cache_open(), it must not come back cut short.
+	fprintf(f, "1 2 00000000000000ab 32 icons/a.kif\n1 2 00000000000000cd 32 icons/");
+
+	for(int i = 0; i < 5000; i++){
+		fputc('b', f);
+	}
+
+	fprintf(f, "\n1 2 00000000000000ef 24 icons/c.kif");
+	fclose(f);
+
+	CHECK(kif_cache_open(&cache, CACHE_DIR) == 1);
+	CHECK(cache.Count == 2);
+
+	if(cache.Count == 2){
+		CHECK(strcmp(cache.Entries[0].Path, "icons/a.kif") == 0 && cache.Entries[0].Hash == 0xab);
+		CHECK(strcmp(cache.Entries[1].Path, "icons/c.kif") == 0 && cache.Entries[1].Hash == 0xef && cache.Entries[1].BPP == 24);
+	}
+
+	CHECK(kif_cache_close(&cache) == 1);
+	remove(CACHE_DIR "/index");
+	rmdir(CACHE_DIR);
+}
+
+#endif
+
+typedef struct {
+	const unsigned char *data;
+	size_t size, bit;
+} bit_reader;
+
+static int read_bits(bit_reader *in, int count) {
+	int value = 0;
+
+	for(int i = 0; i < count; i++, in->bit++){
+		if(in->bit / 8 >= in->size){
+			return -1;
+		}
+
+		value |= ((in->data[in->bit / 8] >> (in->bit % 8)) & 1) << i;
+	}
+
+	return value;
+}
+
+// Huffman codes are packed starting with their most significant bit.
+static int read_code(bit_reader *in, int count) {
+	int value = 0;
+
+	for(int i = 0; i < count; i++){
+		int bit = read_bits(in, 1);
+
+		if(bit < 0){
+			return -1;
+		}
+
+		value = value << 1 | bit;
+	}
+
+	return value;
+}
+
+// Just enough inflate for the PNG writer: stored and fixed Huffman blocks. Returns the output length, or -1.
+static int inflate_fixed(const unsigned char *data, size_t size, unsigned char *out, int space) {
+	static const int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	bit_reader in = { data, size, 0 };
+	int length = 0, final;
+
+	do{
+		final = read_bits(&in, 1);
+		int type = read_bits(&in, 2);
+
+		if(type == 0){
+			in.bit = (in.bit + 7) & ~(size_t)7;
+			int count = read_bits(&in, 16);
+
+			if(count < 0 || read_bits(&in, 16) != (count ^ 0xFFFF) || in.bit / 8 + count > size || length + count > space){
+				return -1;
+			}
+
+			memcpy(out + length, data + in.bit / 8, count);
+			in.bit += count * 8;
+			length += count;
+			continue;
+		}
+
+		if(type != 1){
+			return -1;
+		}
+
+		for(;;){
+			int symbol = read_code(&in, 7);
+
+			if(symbol < 0){
+				return -1;
+			}else if(symbol < 0x18){
+				symbol += 256;
+			}else if((symbol = symbol << 1 | read_bits(&in, 1)) < 0xC0){
+				symbol -= 0x30;
+			}else if(symbol < 0xC8){
+				symbol += 280 - 0xC0;
+			}else{
+				symbol = (symbol << 1 | read_bits(&in, 1)) - 0x190 + 144;
+			}
+
+			if(symbol < 256){
+				if(length == space){
+					return -1;
+				}
+
+				out[length++] = symbol;
+				continue;
+			}
+
+			if(symbol == 256){
+				break;
+			}
+
+			if(symbol > 285){
+				return -1;
+			}
+
+			int i = symbol - 257;
+			int count = length_base[i] + read_bits(&in, i < 8 || i == 28 ? 0 : (i - 4) / 4);
+			int d = read_code(&in, 5);
+
+			if(d < 0 || d > 29){
+				return -1;
+			}
+
+			int distance = distance_base[d] + read_bits(&in, d < 4 ? 0 : (d - 2) / 2);
+
+			if(distance > length || length + count > space){
+				return -1;
+			}
+
+			for(int j = 0; j < count; j++, length++){
+				out[length] = out[length - distance];
+			}
+		}
+	}while(final == 0);
+
+	return final < 0 ? -1 : length;
+}
+
+static uint32_t read_be32(const unsigned char *bytes) {
+	return (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+}
+
+static uint32_t crc32_png(const unsigned char *bytes, size_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+
+	for(size_t i = 0; i < length; i++){
+		crc ^= bytes[i];
+
+		for(int k = 0; k < 8; k++){
+			crc = crc >> 1 ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+// Decode an 8-bit indexed PNG with filter type 0 rows, as written by kif_encode_png(), checking every CRC and the Adler-32.
+static uint32_t *decode_png(const unsigned char *png, int size, int *w, int *h) {
+	static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	kif_rgba_t palette[256];
+	unsigned char idat[1 << 16];
+	int colors = 0, idat_length = 0;
+	uint32_t *pixels = NULL;
+
+	if(size < 8 || memcmp(png, signature, 8) != 0){
+		return NULL;
+	}
+
+	memset(palette, 0, sizeof(palette));
+	*w = *h = 0;
+
+	for(int pos = 8; pos + 12 <= size;){
+		uint32_t length = read_be32(png + pos);
+		const unsigned char *type = png + pos + 4, *body = png + pos + 8;
+
+		if(length > (uint32_t)(size - pos - 12) || crc32_png(type, length + 4) != read_be32(body + length)){
+			return NULL;
+		}
+
+		if(memcmp(type, "IHDR", 4) == 0 && length == 13 && body[8] == 8 && body[9] == 3){
+			*w = read_be32(body);
+			*h = read_be32(body + 4);
+		}else if(memcmp(type, "PLTE", 4) == 0 && length % 3 == 0 && length <= 768){
+			colors = length / 3;
+
+			for(int i = 0; i < colors; i++){
+				palette[i].rgba.r = body[i * 3];
+				palette[i].rgba.g = body[i * 3 + 1];
+				palette[i].rgba.b = body[i * 3 + 2];
+				palette[i].rgba.a = 255;
+			}
+		}else if(memcmp(type, "tRNS", 4) == 0 && (int)length <= colors){
+			for(uint32_t i = 0; i < length; i++){
+				palette[i].rgba.a = body[i];
+			}
+		}else if(memcmp(type, "IDAT", 4) == 0 && idat_length + length <= sizeof(idat)){
+			memcpy(idat + idat_length, body, length);
+			idat_length += length;
+		}else if(memcmp(type, "IEND", 4) == 0){
+			break;
+		}
+
+		pos += length + 12;
+	}
+
+	if(*w <= 0 || *h <= 0 || colors == 0 || idat_length < 6 || (idat[0] * 256 + idat[1]) % 31 != 0){
+		return NULL;
+	}
+
+	int stride = *w + 1;
+	unsigned char *raw = malloc((size_t)stride * *h);
+	int length = raw ? inflate_fixed(idat + 2, idat_length - 6, raw, stride * *h) : -1;
+	uint32_t a = 1, b = 0;
+
+	for(int i = 0; i < length; i++){
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	if(length == stride * *h && (b << 16 | a) == read_be32(idat + idat_length - 4)){
+		pixels = malloc((size_t)*w * *h * 4);
+
+		for(int y = 0; y < *h; y++){
+			for(int x = 0; x < *w; x++){
+				if(raw[y * stride] != 0 || raw[y * stride + 1 + x] >= colors){
+					free(pixels);
+					free(raw);
+					return NULL;
+				}
+
+				pixels[y * *w + x] = palette[raw[y * stride + 1 + x]].v;
+			}
+		}
+	}
+
+	free(raw);
+	return pixels;
+}
+
+static void test_png(void) {
+	static const int sizes[][2] = { { 1, 1 }, { 1, 9 }, { 2, 3 }, { 33, 7 }, { 300, 4 }, { 600, 3 } };
+	unsigned seed = 9;
+
+	for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++){
+		int w = sizes[s][0], h = sizes[s][1], pw, ph, length;
+		uint32_t *pixels = make_image(w, h, 1 + s * 3, &seed);
+
+		// Repeated rows take the copy of the previous scanline, long runs several length 258 matches.
+		for(int i = w; s >= 4 && i < w * h; i++){
+			pixels[i] = pixels[i % w];
+		}
+
+		KIFHeader header = { .Width = w, .Height = h };
+		void *encoded = kif_encode(pixels, &header, &length);
+		uint32_t *decoded = kif_decode(encoded, &header, 32);
+		unsigned char *png = kif_encode_png(encoded, &length);
+		uint32_t *from_png = png ? decode_png(png, length, &pw, &ph) : NULL;
+
+		CHECK(png != NULL);
+		CHECK(from_png != NULL && pw == w && ph == h && decoded != NULL && memcmp(from_png, decoded, (size_t)w * h * 4) == 0);
+
+		// kif_write_png() writes the same bytes.
+		if(png && s == 3){
+			int size;
+			unsigned char *written;
+
+			CHECK(kif_write_png(PACK_FILE, encoded) == length);
+			written = read_pack(&size);
+			CHECK(written != NULL && size == length && memcmp(written, png, length) == 0);
+			free(written);
+			remove(PACK_FILE);
+		}
+
+		free(from_png);
+		free(png);
+		free(decoded);
+		free(encoded);
+		free(pixels);
+	}
+}
+
+// Straight from the QOI specification, sharing no code with kif.h.
+static uint32_t *decode_qoi(const unsigned char *qoi, int size, int *w, int *h) {
+	kif_rgba_t index[64], pixel;
+	int pos = 14, run = 0;
+
+	if(size < 22 || memcmp(qoi, "qoif", 4) != 0 || memcmp(qoi + size - 8, "\0\0\0\0\0\0\0\1", 8) != 0){
+		return NULL;
+	}
+
+	*w = read_be32(qoi + 4);
+	*h = read_be32(qoi + 8);
+
+	uint32_t *pixels = malloc((size_t)*w * *h * 4);
+
+	memset(index, 0, sizeof(index));
+	pixel.v = 0;
+	pixel.rgba.a = 255;
+
+	for(int i = 0; i < *w * *h; i++){
+		if(run > 0){
+			run--;
+		}else if(pos < size - 8){
+			int op = qoi[pos++];
+
+			if(op == 0xFE){
+				memcpy(&pixel, qoi + pos, 3);
+				pos += 3;
+			}else if(op == 0xFF){
+				memcpy(&pixel, qoi + pos, 4);
+				pos += 4;
+			}else if(op >> 6 == 0){
+				pixel = index[op];
+			}else if(op >> 6 == 1){
+				pixel.rgba.r += (op >> 4 & 3) - 2;
+				pixel.rgba.g += (op >> 2 & 3) - 2;
+				pixel.rgba.b += (op & 3) - 2;
+			}else if(op >> 6 == 2){
+				int green = (op & 0x3F) - 32, next = qoi[pos++];
+
+				pixel.rgba.r += green - 8 + (next >> 4);
+				pixel.rgba.g += green;
+				pixel.rgba.b += green - 8 + (next & 0x0F);
+			}else{
+				run = op & 0x3F;
+			}
+
+			index[(pixel.rgba.r * 3 + pixel.rgba.g * 5 + pixel.rgba.b * 7 + pixel.rgba.a * 11) % 64] = pixel;
+		}else{
+			free(pixels);
+			return NULL;
+		}
+
+		pixels[i] = pixel.v;
+	}
+
+	return pixels;
+}
+
+static void test_qoi(void) {
+	static const int sizes[][2] = { { 1, 1 }, { 16, 16 }, { 33, 7 }, { 300, 4 } };
+	unsigned seed = 10;
+
+	for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++){
+		int w = sizes[s][0], h = sizes[s][1], qw, qh, length, qoi_length;
+		uint32_t *pixels = make_image(w, h, 1 + s * 4, &seed);
+
+		// A gradient of 255 colors (the encoder keeps palette entry 0 for transparent black), neighbours
+		// differ by a little and take the DIFF and LUMA ops.
+		for(int i = 0; s == 1 && i < w * h; i++){
+			int k = i % 255;
+
+			pixels[i] = 0xFF000000 | (k % 16 * 2) << 16 | (k / 16 * 9) << 8 | (k * 3 & 0xFF);
+		}
+
+		KIFHeader header = { .Width = w, .Height = h };
+		void *encoded = kif_encode(pixels, &header, &length);
+		uint32_t *decoded = kif_decode(encoded, &header, 32);
+		unsigned char *qoi = kif_to_qoi(encoded, &qoi_length);
+		uint32_t *from_qoi = qoi ? decode_qoi(qoi, qoi_length, &qw, &qh) : NULL;
+
+		CHECK(decoded != NULL && qoi != NULL);
+		CHECK(from_qoi != NULL && qw == w && qh == h && memcmp(from_qoi, decoded, (size_t)w * h * 4) == 0);
+
+		// And back, to a .kif with the same pixels.
+		void *back = qoi ? qoi_to_kif(qoi, qoi_length, &length) : NULL;
+		uint32_t *from_back = back ? kif_decode(back, &header, 32) : NULL;
+
+		CHECK(from_back != NULL && header.Width == w && header.Height == h && memcmp(from_back, decoded, (size_t)w * h * 4) == 0);
+
+		// Cut short, with the last 8 bytes taken for the end marker, the QOI stream is rejected.
+		for(int cut = 1; qoi && cut < qoi_length - 14 - 8; cut *= 2){
+			void *truncated = qoi_to_kif(qoi, 14 + cut + 8, &length);
+
+			CHECK(truncated == NULL);
+			free(truncated);
+		}
+
+		free(from_back);
+		free(back);
+		free(from_qoi);
+		free(qoi);
+		free(decoded);
+		free(encoded);
+		free(pixels);
+	}
+}
+
+static void test_encode_step(void) {
+	static const uint32_t budgets[] = { 1, 7, 255, 256, 4096, 5000 };
+	unsigned seed = 11;
+	int w = 97, h = 61;
+	uint32_t *pixels = make_image(w, h, 9, &seed);
+
+	for(int flags = 0; flags < 0x10; flags++){
+		KIFHeader header = { .Width = w, .Height = h, .Compressed = flags };
+		int length;
+		void *expected = kif_encode(pixels, &header, &length);
+
+		CHECK(expected != NULL);
+
+		for(int b = 0; expected && b < (int)(sizeof(budgets) / sizeof(budgets[0])); b++){
+			KIFHeader step_header = { .Width = w, .Height = h, .Compressed = flags };
+			KIFEncoder encoder;
+			int result, steps = 0, step_length;
+
+			CHECK(kif_encode_begin(&encoder, pixels, &step_header) == 1);
+
+			while((result = kif_encode_step(&encoder, budgets[b], 0)) == KIF_ENCODE_MORE){
+				steps++;
+			}
+
+			void *encoded = kif_encode_finish(&encoder, &step_header, &step_length);
+
+			CHECK(result == KIF_ENCODE_DONE && (uint32_t)steps == (w * h - 1) / budgets[b]);
+			CHECK(encoded != NULL && step_length == length && memcmp(encoded, expected, length) == 0);
+			free(encoded);
+		}
+
+		free(expected);
+	}
+
+	// Only a time budget, and finishing halfway through encodes the rest.
+	KIFHeader header = { .Width = w, .Height = h };
+	KIFEncoder encoder;
+	int length, step_length;
+	void *expected = kif_encode(pixels, &header, &length);
+
+	CHECK(kif_encode_begin(&encoder, pixels, &header) == 1);
+	CHECK(kif_encode_step(&encoder, 0, 1) >= KIF_ENCODE_MORE);
+	CHECK(kif_encode_step(&encoder, 100, 0) >= KIF_ENCODE_MORE);
+
+	void *encoded = kif_encode_finish(&encoder, &header, &step_length);
+
+	CHECK(encoded != NULL && expected != NULL && step_length == length && memcmp(encoded, expected, length) == 0);
+	free(encoded);
+	free(expected);
+
+	// Transparent black and 256 other colors do not fit the palette, on either path.
+	for(int i = 0; i < w * h; i++){
+		pixels[i] = 0xFF000000 | (i % 256) * 0x010101;
+	}
+
+	CHECK(kif_encode(pixels, &header, &length) == NULL);
+	CHECK(kif_encode_begin(&encoder, pixels, &header) == 1);
+	CHECK(kif_encode_step(&encoder, 0, 0) == KIF_ENCODE_ERROR);
+	CHECK(kif_encode_finish(&encoder, &header, &length) == NULL);
+
+	for(int i = 255; i < w * h; i += 256){
+		pixels[i] = 0;
+	}
+
+	CHECK((encoded = kif_encode(pixels, &header, &length)) != NULL);
+	free(encoded);
+
+	// An abandoned encoder is released with kif_encode_abort().
+	CHECK(kif_encode_begin(&encoder, pixels, &header) == 1);
+	CHECK(kif_encode_step(&encoder, 10, 0) == KIF_ENCODE_MORE);
+	kif_encode_abort(&encoder);
+
+	free(pixels);
+}
+
+static int color_distance(kif_rgba_t a, kif_rgba_t b) {
+	int r = a.rgba.r - b.rgba.r, g = a.rgba.g - b.rgba.g, bl = a.rgba.b - b.rgba.b, al = a.rgba.a - b.rgba.a;
+
+	return r * r + g * g + bl * bl + al * al;
+}
+
+static void test_master(void) {
+	static const int sizes[] = { 64, 32, 16, 7 };
+	uint32_t *pixels = malloc(64 * 64 * 4), *resized = malloc(64 * 64 * 4);
+
+	// 256 opaque colors and a 4096 color gradient, both more than fit next to transparent black.
+	for(int colors = 256; colors <= 4096; colors *= 16){
+		KIFMaster master;
+
+		for(int i = 0; i < 64 * 64; i++){
+			int k = i % colors;
+
+			pixels[i] = 0xFF000000 | (k & 15) << 20 | (k >> 4 & 15) << 12 | (k >> 8) << 4;
+		}
+
+		CHECK(kif_master_begin(&master, pixels, 64, 64) == 1);
+
+		for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++){
+			KIFHeader header;
+			int length, nearest = 1;
+			unsigned char *encoded = kif_master_encode(&master, sizes[s], 0, &header, &length);
+			uint32_t *decoded = encoded ? kif_decode(encoded, &header, 32) : NULL;
+			const kif_rgba_t *palette = (const kif_rgba_t *)(encoded + sizeof(KIFHeader));
+
+			CHECK(decoded != NULL && header.Width == sizes[s] && header.Height == sizes[s] && header.palEntries <= 256);
+			CHECK(kif_resize(pixels, 64, 64, resized, sizes[s], sizes[s]) == 1);
+
+			// Every resized pixel either kept its color or got the nearest one in the palette.
+			for(int i = 0; decoded && i < sizes[s] * sizes[s]; i++){
+				kif_rgba_t got, wanted;
+				int best = 0x7FFFFFFF;
+
+				got.v = decoded[i];
+				wanted.v = resized[i];
+
+				for(int c = 0; c < header.palEntries; c++){
+					best = color_distance(palette[c], wanted) < best ? color_distance(palette[c], wanted) : best;
+				}
+
+				nearest &= color_distance(got, wanted) == best;
+			}
+
+			CHECK(nearest);
+
+			free(decoded);
+			free(encoded);
+		}
+
+		kif_master_end(&master);
+	}
+
+	free(resized);
+	free(pixels);
+}
+
+// Limited range RGB to YUV, coefficients scaled by 256.
+static void rgb_to_yuv(uint32_t pixel, int matrix, int *y, int *u, int *v) {
+	static const int k[2][9] = {
+		{ 66, 129, 25, -38, -74, 112, 112, -94, -18 },
+		{ 47, 157, 16, -26, -87, 112, 112, -102, -10 }
+	};
+	const int *m = k[matrix];
+	kif_rgba_t c;
+	c.v = pixel;
+
+	*y = (m[0] * c.rgba.r + m[1] * c.rgba.g + m[2] * c.rgba.b + 128) / 256 + 16;
+	*u = (m[3] * c.rgba.r + m[4] * c.rgba.g + m[5] * c.rgba.b + 128 + 128 * 256) / 256;
+	*v = (m[6] * c.rgba.r + m[7] * c.rgba.g + m[8] * c.rgba.b + 128 + 128 * 256) / 256;
+}
+
+static void test_yuv(void) {
+	unsigned seed = 12;
+	int w = 19, h = 13, cw = (w + 1) / 2, ch = (h + 1) / 2;
+	uint32_t *pixels = make_image(w, h, 6, &seed);
+	KIFHeader header = { .Width = w, .Height = h };
+	int length;
+	unsigned char *encoded = kif_encode(pixels, &header, &length);
+	uint8_t y_plane[13 * 24], u_plane[7 * 24], v_plane[7 * 24], a_plane[13 * 24];
+
+	// The whole icon, then with the second half of the runs cut off, which must come out as transparent black.
+	for(int pass = 0; encoded && pass < 2; pass++){
+		uint32_t *expected = kif_decode(encoded, &header, 32);
+
+		for(int format = KIF_YUV_I420; expected && format <= KIF_YUV_NV12; format++){
+			for(int matrix = KIF_YUV_BT601; matrix <= KIF_YUV_BT709; matrix++){
+				KIFYUVPlanes planes = { y_plane, u_plane, v_plane, a_plane, 24, 24, 24, 24, format, matrix };
+				int luma = 1, alpha = 1, chroma = 1;
+
+				memset(y_plane, 0xAB, sizeof(y_plane));
+				memset(u_plane, 0xAB, sizeof(u_plane));
+				memset(v_plane, 0xAB, sizeof(v_plane));
+				memset(a_plane, 0xAB, sizeof(a_plane));
+				CHECK(kif_decode_yuv(encoded, &header, &planes) == 1);
+
+				for(int py = 0; py < h; py++){
+					for(int px = 0; px < w; px++){
+						int yy, uu, vv;
+
+						rgb_to_yuv(expected[py * w + px], matrix, &yy, &uu, &vv);
+						luma &= y_plane[py * 24 + px] == yy;
+						alpha &= a_plane[py * 24 + px] == expected[py * w + px] >> 24;
+					}
+				}
+
+				// Chroma is the alpha weighted average of each 2x2 block, edge pixels stand in for the missing ones.
+				for(int by = 0; by < ch; by++){
+					for(int bx = 0; bx < cw; bx++){
+						int weight = 0, u_sum = 0, v_sum = 0, u_plain = 0, v_plain = 0, u, v;
+
+						for(int i = 0; i < 4; i++){
+							int px = bx * 2 + (i & 1), py = by * 2 + i / 2, yy, uu, vv;
+							uint32_t pixel = expected[(py < h ? py : h - 1) * w + (px < w ? px : w - 1)];
+
+							rgb_to_yuv(pixel, matrix, &yy, &uu, &vv);
+							weight += pixel >> 24;
+							u_sum += uu * (pixel >> 24);
+							v_sum += vv * (pixel >> 24);
+							u_plain += uu;
+							v_plain += vv;
+						}
+
+						u = weight ? (u_sum + weight / 2) / weight : (u_plain + 2) / 4;
+						v = weight ? (v_sum + weight / 2) / weight : (v_plain + 2) / 4;
+
+						if(format == KIF_YUV_NV12){
+							chroma &= abs(u_plane[by * 24 + bx * 2] - u) <= 1 && abs(u_plane[by * 24 + bx * 2 + 1] - v) <= 1;
+						}else{
+							chroma &= abs(u_plane[by * 24 + bx] - u) <= 1 && abs(v_plane[by * 24 + bx] - v) <= 1;
+						}
+					}
+				}
+
+				CHECK(luma && alpha && chroma);
+			}
+		}
+
+		CHECK(pass == 0 || (expected != NULL && expected[w * h - 1] == 0));
+		free(expected);
+		((KIFHeader *)encoded)->RLEEntries /= 2;
+	}
+
+	free(encoded);
+	free(pixels);
+}
+
+static void test_diff(void) {
+	unsigned seed = 13;
+	int w = 29, h = 17, length;
+	uint32_t *a_pixels = make_image(w, h, 5, &seed);
+	uint32_t *b_pixels = malloc((size_t)w * h * 4);
+	KIFHeader header = { .Width = w, .Height = h };
+	KIFDiff diff;
+
+	memcpy(b_pixels, a_pixels, (size_t)w * h * 4);
+
+	// A few changed pixels, and transparent ones that only differ in their RGB.
+	for(int i = 0; i < w * h; i++){
+		if(i % 37 == 5){
+			b_pixels[i] ^= 0x00300000 | (i & 0xFF);
+		}else if(a_pixels[i] >> 24 == 0){
+			b_pixels[i] = 0x00102030;
+		}
+	}
+
+	void *a = kif_encode(a_pixels, &header, &length);
+	void *b = kif_encode(b_pixels, &header, &length);
+
+	CHECK(kif_diff(a, a, &diff) == 1 && diff.Pixels == 0 && diff.MaxDelta == 0 && diff.Bounds.Width == 0);
+
+	// Compared as is, and with the second half of b's runs missing (transparent black).
+	for(int pass = 0; pass < 2; pass++){
+		uint32_t *a_decoded = kif_decode(a, &header, 32);
+		uint32_t *b_decoded = kif_decode(b, &header, 32);
+		uint32_t pixels = 0;
+		int max_delta = 0, left = w, top = h, right = 0, bottom = 0, same_mask = 1;
+
+		KIFDiff mask_diff;
+		void *mask = kif_diff_encode(a, b, &mask_diff, &length);
+		uint32_t *mask_decoded = mask ? kif_decode(mask, &header, 32) : NULL;
+
+		CHECK(kif_diff(a, b, &diff) == 1 && mask_decoded != NULL && memcmp(&diff, &mask_diff, sizeof(KIFDiff)) == 0);
+
+		for(int y = 0; mask_decoded && y < h; y++){
+			for(int x = 0; x < w; x++){
+				kif_rgba_t pa, pb;
+				pa.v = a_decoded[y * w + x];
+				pb.v = b_decoded[y * w + x];
+
+				int differs = pa.v != pb.v && (pa.rgba.a != 0 || pb.rgba.a != 0);
+
+				if(differs){
+					int deltas[4] = { abs(pa.rgba.r - pb.rgba.r), abs(pa.rgba.g - pb.rgba.g), abs(pa.rgba.b - pb.rgba.b), abs(pa.rgba.a - pb.rgba.a) };
+
+					for(int c = 0; c < 4; c++){
+						max_delta = deltas[c] > max_delta ? deltas[c] : max_delta;
+					}
+
+					pixels++;
+					left = x < left ? x : left;
+					right = x + 1 > right ? x + 1 : right;
+					top = y < top ? y : top;
+					bottom = y + 1;
+				}
+
+				same_mask &= mask_decoded[y * w + x] == (differs ? 0xFFFF00FF : 0);
+			}
+		}
+
+		CHECK(same_mask && pixels > 0);
+		CHECK(diff.Width == w && diff.Height == h && diff.Pixels == pixels && diff.MaxDelta == max_delta);
+		CHECK(diff.Bounds.X == left && diff.Bounds.Y == top && diff.Bounds.Width == right - left && diff.Bounds.Height == bottom - top);
+
+		free(mask_decoded);
+		free(mask);
+		free(b_decoded);
+		free(a_decoded);
+		((KIFHeader *)b)->RLEEntries /= 2;
+	}
+
+	KIFHeader small = { .Width = w, .Height = h - 1 };
+	void *c = kif_encode(a_pixels, &small, &length);
+
+	CHECK(kif_diff(a, c, &diff) == 0);
+
+	free(c);
+	free(b);
+	free(a);
+	free(b_pixels);
+	free(a_pixels);
+}
+
+static void test_histogram(void) {
+	unsigned seed = 14;
+	int w = 300, h = 9, length;
+	uint32_t *pixels = make_image(w, h, 11, &seed);
+	KIFHeader header = { .Width = w, .Height = h };
+	unsigned char *encoded = kif_encode(pixels, &header, &length);
+
+	// As encoded, then with a row less in the header so the runs overshoot the last row.
+	for(int pass = 0; encoded && pass < 2; pass++){
+		const kif_rgba_t *palette = (const kif_rgba_t *)(encoded + sizeof(KIFHeader));
+		uint32_t counts[256], expected[256] = { 0 };
+		uint32_t *decoded = kif_decode(encoded, &header, 32);
+		int found = 1;
+
+		for(int i = 0; decoded && i < header.Width * header.Height; i++){
+			int p = 0;
+
+			while(p < header.palEntries && palette[p].v != decoded[i]){
+				p++;
+			}
+
+			found &= p < header.palEntries;
+			expected[p < 256 ? p : 0]++;
+		}
+
+		CHECK(decoded != NULL && found);
+		CHECK(kif_histogram(encoded, &header, counts) == header.palEntries);
+		CHECK(memcmp(counts, expected, sizeof(counts)) == 0);
+
+		// With Distance 0 the dominant colors are the palette entries by count times alpha.
+		kif_rgba_t colors[256];
+		uint32_t weights[256];
+		int number = kif_dominant_colors(encoded, &header, colors, weights, 256, 0), visible = 0, ordered = 1;
+
+		for(int p = 0; p < header.palEntries; p++){
+			visible += (expected[p] * palette[p].rgba.a + 127) / 255 > 0;
+		}
+
+		for(int c = 0; c < number; c++){
+			int p = 0;
+
+			while(p < header.palEntries && palette[p].v != colors[c].v){
+				p++;
+			}
+
+			ordered &= p < header.palEntries && weights[c] == (expected[p] * palette[p].rgba.a + 127) / 255;
+			ordered &= c == 0 || weights[c - 1] >= weights[c];
+		}
+
+		CHECK(number == visible && ordered);
+		CHECK(kif_dominant_colors(encoded, &header, colors, weights, 2, 0) == (visible < 2 ? visible : 2));
+
+		free(decoded);
+		((KIFHeader *)encoded)->Height--;
+	}
+
+	free(encoded);
+	free(pixels);
+
+	// Near shades merge into the heavier color, which can change the order.
+	uint32_t shades[500];
+
+	for(int i = 0; i < 500; i++){
+		shades[i] = i < 100 ? 0xFF100000 : i < 150 ? 0xFF120000 : i < 270 ? 0xFF00FF00 : i < 470 ? 0x800000FF : 0;
+	}
+
+	KIFHeader shade_header = { .Width = 50, .Height = 10 };
+	kif_rgba_t colors[4];
+	uint32_t weights[4];
+
+	encoded = kif_encode(shades, &shade_header, &length);
+	CHECK(kif_dominant_colors(encoded, &shade_header, colors, weights, 4, 4) == 3);
+	CHECK(colors[0].v == 0xFF100000 && weights[0] == 150);
+	CHECK(colors[1].v == 0xFF00FF00 && weights[1] == 120);
+	CHECK(colors[2].v == 0x800000FF && weights[2] == 100);
+	free(encoded);
+}
+
+int main(void) {
+	test_round_trip();
+	test_padded();
+	test_limits();
+	test_truncated();
+	test_pack();
+	test_theme();
+	test_variants();
+	test_composite();
+	test_blit();
+	test_spans();
+	test_collide();
+	test_progressive();
+#ifdef KIF_DISK_CACHE
+	test_cache();
+#endif
+	test_png();
+	test_qoi();
+	test_encode_step();
+	test_master();
+	test_yuv();
+	test_diff();
+	test_histogram();
+
+	printf("%s (%d failed)\n", failures ? "FAILED" : "ok", failures);
+	return failures;
+}